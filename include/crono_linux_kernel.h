@@ -34,6 +34,9 @@ typedef struct {
         DMA_ADDR *pages; // Pages Physical Addresses, allocated by userspace,
                          // and filled by Kernel Module. Count of elements =
                          // `pages_count`.
+                         // Optional, pass NULL (and `upages` = 0) and `mmap`
+                         // the table using `CRONO_MMAP_TYPE_SG_ADDR_TABLE`
+                         // instead of copying it.
         DMA_ADDR upages; // Is used exchangeably with `pages`. It
                          // is mainly provided for backward compatibility
                          // with kernel versions earlier than 5.6
@@ -43,6 +46,114 @@ typedef struct {
         int id; // Internal kernel ID of the buffer
 } CRONO_SG_BUFFER_INFO;
 
+/**
+ * Flags of `CRONO_SG_BUFFER_LOCK_INFO.flags`.
+ */
+// Map the whole buffer to a single contiguous DMA range of
+// `CRONO_SINGLE_IOVA_ALIGNMENT` aligned address, reported in `iova_base` and
+// `iova_size`. It needs an active IOMMU, otherwise, locking fails with
+// `EOPNOTSUPP`. The alignment is checked after mapping, not requested from the
+// IOMMU, which aligns the range by the buffer size only, so locking buffers
+// smaller than `CRONO_SINGLE_IOVA_ALIGNMENT` (2 MiB) can fail with `ERANGE`.
+#define CRONO_SG_LOCK_FLAG_SINGLE_IOVA 0x1
+// Fail locking with `EIO` if any DMA segment of the buffer is bounce buffered
+// by `swiotlb`, e.g. the device DMA mask can't address the buffer memory and
+// there is no IOMMU, instead of losing bandwidth on CPU copies.
+#define CRONO_SG_LOCK_FLAG_NO_BOUNCE 0x2
+
+/**
+ * Alignment of the DMA range mapped with `CRONO_SG_LOCK_FLAG_SINGLE_IOVA`.
+ */
+#define CRONO_SINGLE_IOVA_ALIGNMENT 0x200000
+
+/**
+ * Values of `CRONO_SG_BUFFER_LOCK_INFO.dma_dir`, the direction of the data
+ * transferred by the device, same values as linux `enum dma_data_direction`.
+ * Acquisition buffers, only written by the device, should use
+ * `CRONO_DMA_FROM_DEVICE` to save the cache maintenance and bounce copies of
+ * the other direction.
+ */
+#define CRONO_DMA_BIDIRECTIONAL 0 // Default
+#define CRONO_DMA_TO_DEVICE 1
+#define CRONO_DMA_FROM_DEVICE 2
+
+/**
+ * Flags of `CRONO_SG_BUFFER_LOCK_INFO.dma_attrs`, mapped to linux
+ * `DMA_ATTR_xxx` attributes when mapping and unmapping the buffer.
+ */
+// Device writes to the buffer may be reordered with other writes.
+#define CRONO_DMA_ATTR_WEAK_ORDERING 0x1
+// No CPU cache sync on mapping and unmapping, the buffer ranges are synced
+// using `IOCTL_CRONO_SYNC_BUFFER_FOR_CPU` and
+// `IOCTL_CRONO_SYNC_BUFFER_FOR_DEVICE` only when needed, including before
+// unlocking the buffer if its data is still needed.
+#define CRONO_DMA_ATTR_SKIP_CPU_SYNC 0x2
+
+/**
+ * @brief
+ * Extended lock information communicated with user space for scatter/gather
+ * memory, passed to `IOCTL_CRONO_LOCK_BUFFER_EX`.
+ */
+typedef struct {
+        // Buffer information, same as passed to `IOCTL_CRONO_LOCK_BUFFER`.
+        // Buffer is unlocked using `IOCTL_CRONO_UNLOCK_BUFFER` and `id`.
+        CRONO_SG_BUFFER_INFO buff_info;
+        uint32_t flags;     // Bitmask of `CRONO_SG_LOCK_FLAG_xxx`
+        uint32_t dma_dir;   // One of `CRONO_DMA_xxx` directions
+        uint32_t dma_attrs; // Bitmask of `CRONO_DMA_ATTR_xxx`
+
+        // Mapping Information, filled by Kernel Module
+        uint32_t dma_segments_count; // Count of DMA contiguous segments
+        DMA_ADDR iova_base; // DMA address of the buffer start, valid with
+                            // `CRONO_SG_LOCK_FLAG_SINGLE_IOVA`.
+        uint64_t iova_size; // Size in bytes of the DMA range starting at
+                            // `iova_base`.
+        uint32_t bounced_segments_count; // Count of DMA segments bounce
+                                         // buffered by `swiotlb`, expected 0.
+} CRONO_SG_BUFFER_LOCK_INFO;
+
+/**
+ * @brief
+ * Lock information of a scatter/gather buffer backed by a range of a memfd,
+ * shmem or hugetlbfs file, passed to `IOCTL_CRONO_LOCK_FD_BUFFER`.
+ * The pages of the file range are locked, whatever processes map the file,
+ * so the buffer doesn't have to be mapped by the locking process.
+ */
+typedef struct {
+        // Lock information, with `buff_info.addr` = NULL, and `buff_info.size`
+        // and `buff_info.pages_count` of the file range. `buff_info.addr` is
+        // NULL on return as well.
+        CRONO_SG_BUFFER_LOCK_INFO lock_info;
+        int32_t fd;        // File descriptor of the memfd, shmem or hugetlbfs
+                           // file, in the calling process.
+        uint32_t reserved; // Zero
+        uint64_t offset;   // Offset in bytes of the range in the file, page
+                           // aligned, or huge page aligned for hugetlbfs.
+} CRONO_FD_BUFFER_LOCK_INFO;
+
+/**
+ * @brief
+ * Byte range of a locked scatter/gather buffer, passed to
+ * `IOCTL_CRONO_SYNC_BUFFER_FOR_CPU` and `IOCTL_CRONO_SYNC_BUFFER_FOR_DEVICE`.
+ */
+typedef struct {
+        int id;          // `CRONO_SG_BUFFER_INFO.id` of the locked buffer
+        uint64_t offset; // Offset in bytes of the range from the buffer start
+        uint64_t size;   // Size in bytes of the range
+} CRONO_SG_BUFFER_SYNC_INFO;
+
+/**
+ * @brief
+ * Packet written by the emulated devices of the kernel module (parameter
+ * `emulated_devices`) into their locked scatter/gather buffers, one after the
+ * other from the buffer start, then into the next buffer, wrapping around the
+ * last one.
+ */
+typedef struct {
+        uint64_t timestamp; // Kernel monotonic time of the packet in ns
+        uint64_t seq;       // Device packet sequence number, starting at 1
+} CRONO_EMULATED_PACKET;
+
 /**
  * @brief
  * Buffer info communicated with user space for contiguous memory
@@ -58,11 +169,194 @@ typedef struct {
         int id; // Internal kernel ID of the buffer
 } CRONO_CONTIG_BUFFER_INFO;
 
+/**
+ * @brief
+ * Small contiguous block, e.g. a descriptor table or a status word, allocated
+ * from the device blocks arena by `IOCTL_CRONO_ALLOC_CONTIG_BLOCK`, and freed
+ * by `IOCTL_CRONO_UNLOCK_CONTIG_BUFFER` and `id`.
+ * All blocks of a device share one mapping of the arena, see
+ * `CRONO_MMAP_TYPE_BLOCK_ARENA`, the block is at `offset` from its start.
+ */
+typedef struct {
+        uint32_t size;      // Size of the block in bytes
+        uint32_t alignment; // Alignment of the block in bytes, a power of 2
+                            // up to the page size, or 0 for
+                            // `CRONO_BLOCK_MIN_ALIGNMENT`.
+
+        // Filled by Kernel Module
+        uint64_t offset;     // Offset of the block from the arena start
+        uint64_t dma_handle; // DMA address of the block
+        int id;              // Internal kernel ID of the block
+} CRONO_CONTIG_BLOCK_INFO;
+
+/**
+ * Minimum alignment, and allocation granularity, of the contiguous blocks.
+ */
+#define CRONO_BLOCK_MIN_ALIGNMENT 64
+
+/**
+ * @brief
+ * Steering of the device DMA writes into a locked SG buffer towards the cache
+ * of the CPU consuming its data, using PCIe TLP Processing Hints, passed to
+ * `IOCTL_CRONO_SET_BUFFER_TPH`.
+ * The device firmware puts the Steering Tag table entry `st_index` in the
+ * TLPs of the buffer DMA, the kernel module programs the entry with the tag of
+ * `cpu`.
+ */
+typedef struct {
+        int id;            // `CRONO_SG_BUFFER_INFO.id` of the locked buffer
+        uint32_t cpu;      // CPU consuming the buffer data
+        uint32_t st_index; // Steering Tag table entry used for the buffer DMA
+
+        // Filled by Kernel Module
+        int32_t steering_tag; // Steering Tag programmed into `st_index`, or
+                              // -1 if the device or the platform doesn't
+                              // support TPH, and nothing is programmed.
+} CRONO_SG_BUFFER_TPH_INFO;
+
+/**
+ * Flags of `CRONO_DEV_CAPS.caps`.
+ */
+// TLP Processing Hints are enabled, `IOCTL_CRONO_SET_BUFFER_TPH` programs the
+// Steering Tags.
+#define CRONO_DEV_CAP_TPH 0x1
+// DMA is translated by an IOMMU, `CRONO_SG_LOCK_FLAG_SINGLE_IOVA` is usable.
+#define CRONO_DEV_CAP_IOMMU 0x2
+// Software emulated device, see module parameter `emulated_devices`.
+#define CRONO_DEV_CAP_EMULATED 0x4
+// The device has a status page, see `CRONO_STATUS_PAGE`, emulated devices only.
+#define CRONO_DEV_CAP_STATUS_PAGE 0x8
+
+/**
+ * @brief
+ * Capabilities of the device and the platform, filled by
+ * `IOCTL_CRONO_GET_DEV_CAPS`.
+ */
+typedef struct {
+        uint32_t caps;             // Bitmask of `CRONO_DEV_CAP_xxx`
+        uint32_t status_page_size; // Size of the status page in bytes
+        DMA_ADDR status_page_dma;  // DMA address of the status page
+        uint32_t reserved[4];      // Zeroed, for capabilities added later
+} CRONO_DEV_CAPS;
+
+/**
+ * Flags of `CRONO_STATUS_PAGE.error_flags`, kept set until the device is
+ * closed.
+ */
+// Data was dropped, the device couldn't keep up with the incoming rate.
+#define CRONO_STATUS_ERR_OVERRUN 0x1
+// Data was dropped, no buffer was locked for the device to write into.
+#define CRONO_STATUS_ERR_NO_BUFFER 0x2
+
+/**
+ * @brief
+ * DMA progress of the device, held at the start of the device status page, a
+ * page of coherent memory mapped read-only by `CRONO_MMAP_TYPE_STATUS_PAGE`,
+ * so readers can poll it with no system call or register read.
+ * The kernel module updates it for the emulated devices, the PCI devices have
+ * no status page (no `CRONO_DEV_CAP_STATUS_PAGE`).
+ * `seq` is odd while the other members are updated. Read `seq`, then the
+ * members, then `seq` again, and retry if it's odd or changed, using
+ * acquire loads, e.g. `__atomic_load_n(&seq, __ATOMIC_ACQUIRE)`.
+ */
+typedef struct {
+        uint64_t seq;           // Update sequence number, even when stable
+        int32_t buffer_id;      // `CRONO_SG_BUFFER_INFO.id` of the buffer
+                                // being written, or -1 if none.
+        uint32_t error_flags;   // Bitmask of `CRONO_STATUS_ERR_xxx`
+        uint64_t write_offset;  // Bytes written into `buffer_id` so far
+        uint64_t wraps;         // Wraps from the last buffer to the first
+        uint64_t bytes_written; // Total bytes written by the device
+} CRONO_STATUS_PAGE;
+
+/**
+ * @brief
+ * Streaming ring of a device, set up by `IOCTL_CRONO_RING_SETUP`, and freed
+ * when the device is closed.
+ * The ring is `pages_count` pages, managed by the kernel module, that the
+ * device writes in order. The DMA address of every page is in the table
+ * mapped by `CRONO_MMAP_TYPE_RING_ADDR_TABLE`.
+ * The written data is consumed by `read()`, by `splice()` to a pipe with no
+ * copy, or in place using the mapping of `CRONO_MMAP_TYPE_RING` and
+ * `IOCTL_CRONO_RING_CONSUME`.
+ * Streaming rings are supported by emulated devices only,
+ * `CRONO_DEV_CAP_EMULATED`.
+ */
+typedef struct {
+        uint32_t pages_count; // Count of pages, up to `CRONO_RING_MAX_PAGES`
+        uint32_t flags;       // Zero, reserved
+
+        // Filled by Kernel Module
+        uint64_t size; // Size of the ring in bytes
+} CRONO_RING_SETUP_INFO;
+
+/**
+ * Maximum count of pages of a streaming ring.
+ */
+#define CRONO_RING_MAX_PAGES 0x40000
+
+/**
+ * @brief
+ * Position of a streaming ring, passed to `IOCTL_CRONO_RING_PRODUCE` and
+ * `IOCTL_CRONO_RING_CONSUME`. `head` and `tail` count the bytes since the
+ * ring is set up, the byte at `head` is at offset (`head` % ring size) of the
+ * ring.
+ */
+typedef struct {
+        uint64_t bytes; // Bytes produced or consumed by the call
+
+        // Filled by Kernel Module
+        uint64_t head;  // Total bytes written by the device
+        uint64_t tail;  // Total bytes consumed
+        uint64_t space; // Bytes the device can write after `head`, pages
+                        // spliced to pipes are written after they are
+                        // released.
+} CRONO_RING_POS;
+
+/**
+ * Descriptor table formats built by `IOCTL_CRONO_BUILD_SG_DESC_TABLE`.
+ */
+// The native format of the device family, replaced by the actual format
+#define CRONO_DESC_FORMAT_DEVICE_DEFAULT 0
+// One `DMA_ADDR` element per page of the buffer
+#define CRONO_DESC_FORMAT_PAGE_LIST 1
+// One `CRONO_DESC_EXTENT` element per DMA contiguous segment of the buffer
+#define CRONO_DESC_FORMAT_EXTENT_LIST 2
+
+/**
+ * @brief
+ * Element of a `CRONO_DESC_FORMAT_EXTENT_LIST` descriptor table.
+ */
+typedef struct {
+        DMA_ADDR addr; // DMA address of the segment start
+        uint64_t size; // Size of the segment in bytes
+} CRONO_DESC_EXTENT;
+
+/**
+ * @brief
+ * Descriptor table information communicated with user space to build the
+ * descriptor table of a locked scatter/gather buffer.
+ */
+typedef struct {
+        int sg_id; // `CRONO_SG_BUFFER_INFO.id` of the locked buffer
+        uint32_t format; // One of `CRONO_DESC_FORMAT_xxx`. Set by the kernel
+                         // module to the actual format if passed as
+                         // `CRONO_DESC_FORMAT_DEVICE_DEFAULT`.
+        uint32_t entries_count; // Count of elements in the table, filled by
+                                // the kernel module.
+
+        // The contiguous DMA buffer holding the table, filled by the kernel
+        // module. It's mapped using `CRONO_MMAP_TYPE_CONTIG`, and unlocked
+        // using `IOCTL_CRONO_UNLOCK_CONTIG_BUFFER` with `table.id`.
+        CRONO_CONTIG_BUFFER_INFO table;
+} CRONO_SG_DESC_TABLE_INFO;
+
 /**
  * CRONO PCI Driver Name passed in pci_driver structure, and is found under
  * /sys/bus/pci/drivers after installing the driver module.
  */
 #define CRONO_PCI_DRIVER_NAME "crono_pci_driver"
+#define CRONO_EMU_DEVICE_NAME "crono_emu"
 /**
  * Maximum size of the misdev name string under /dev
  */
@@ -101,8 +395,62 @@ typedef struct {
         uint32_t count; // Count of elements in `cmds`
 } CRONO_KERNEL_CMDS_INFO;
 
+/**
+ * The miscdev `mmap` offset selects the object to be mapped. The offset, in
+ * pages, is constructed as (type << CRONO_MMAP_TYPE_SHIFT | id), where `type`
+ * is one of `CRONO_MMAP_TYPE_xxx` and `id` is the buffer id.
+ * Use `CRONO_MMAP_OFFSET` to construct it.
+ */
+#define CRONO_MMAP_TYPE_SHIFT 40
+/**
+ * Contiguous buffer memory, `id` is `CRONO_CONTIG_BUFFER_INFO.id`.
+ * Type value is zero, so passing the buffer id multiplied by page size as
+ * `mmap` offset is still valid.
+ */
+#define CRONO_MMAP_TYPE_CONTIG 0x0
+/**
+ * Read-only DMA addresses table of a locked scatter/gather buffer, `id` is
+ * `CRONO_SG_BUFFER_INFO.id`. The table has `pages_count` elements of type
+ * `DMA_ADDR`, and is valid as long as the buffer is locked.
+ */
+#define CRONO_MMAP_TYPE_SG_ADDR_TABLE 0x1
+/**
+ * Blocks arena of the device, holding all the blocks allocated by
+ * `IOCTL_CRONO_ALLOC_CONTIG_BLOCK`, `id` is 0. The mapping size is up to the
+ * arena size, the module parameter `block_arena_size`.
+ */
+#define CRONO_MMAP_TYPE_BLOCK_ARENA 0x2
+/**
+ * Read-only status page of the device, `id` is 0. The mapping size is one
+ * page, the structure is `CRONO_STATUS_PAGE`. Fails with `EOPNOTSUPP` if the
+ * device has no status page.
+ */
+#define CRONO_MMAP_TYPE_STATUS_PAGE 0x3
+/**
+ * Read-only pages of the streaming ring of the device, `id` is 0. The
+ * mapping size is up to the ring size.
+ */
+#define CRONO_MMAP_TYPE_RING 0x4
+/**
+ * Read-only DMA addresses table of the streaming ring pages, `id` is 0. The
+ * table has `pages_count` elements of type `DMA_ADDR`.
+ */
+#define CRONO_MMAP_TYPE_RING_ADDR_TABLE 0x5
+/**
+ * Construct the `mmap` offset argument.
+ *
+ * @param type[in]: one of `CRONO_MMAP_TYPE_xxx`.
+ * @param id[in]: the object id, e.g. buffer id.
+ * @param page_size[in]: system page size, e.g. `sysconf(_SC_PAGESIZE)`.
+ */
+#define CRONO_MMAP_OFFSET(type, id, page_size)                                 \
+        ((((uint64_t)(type) << CRONO_MMAP_TYPE_SHIFT) | (uint64_t)(id)) *      \
+         (page_size))
+
 /**
  * Command value passed to miscdev ioctl() to lock a memory buffer.
+ * Fails with `ENOMEM` if the buffer exceeds the process `RLIMIT_MEMLOCK`, or
+ * with `EDQUOT` if it exceeds the module parameters `max_pinned_bytes_xxx`.
  * 'c' is for `cronologic`.
  */
 #define IOCTL_CRONO_LOCK_BUFFER _IOWR('c', 0, CRONO_SG_BUFFER_INFO *)
@@ -125,5 +473,92 @@ typedef struct {
  * 'c' is for `cronologic`. Passing buffer wrapper ID in kernel module.
  */
 #define IOCTL_CRONO_UNLOCK_CONTIG_BUFFER _IOWR('c', 4, int *)
+/**
+ * Command value passed to miscdev ioctl() to build the device descriptor table
+ * of a locked scatter/gather buffer in a contiguous DMA buffer.
+ * 'c' is for `cronologic`.
+ */
+#define IOCTL_CRONO_BUILD_SG_DESC_TABLE                                        \
+        _IOWR('c', 5, CRONO_SG_DESC_TABLE_INFO *)
+/**
+ * Command value passed to miscdev ioctl() to lock a memory buffer with the
+ * extended options of `CRONO_SG_BUFFER_LOCK_INFO`.
+ * 'c' is for `cronologic`.
+ */
+#define IOCTL_CRONO_LOCK_BUFFER_EX _IOWR('c', 6, CRONO_SG_BUFFER_LOCK_INFO *)
+/**
+ * Command value passed to miscdev ioctl() to make a range of a locked buffer,
+ * written by the device, visible to the CPU, before reading it.
+ * Needed on platforms with non-coherent DMA or bounce buffers.
+ * 'c' is for `cronologic`.
+ */
+#define IOCTL_CRONO_SYNC_BUFFER_FOR_CPU                                        \
+        _IOWR('c', 7, CRONO_SG_BUFFER_SYNC_INFO *)
+/**
+ * Command value passed to miscdev ioctl() to give a range of a locked buffer
+ * back to the device, after the CPU is done with it.
+ * 'c' is for `cronologic`.
+ */
+#define IOCTL_CRONO_SYNC_BUFFER_FOR_DEVICE                                     \
+        _IOWR('c', 8, CRONO_SG_BUFFER_SYNC_INFO *)
+/**
+ * Command value passed to miscdev ioctl() to allocate a small contiguous block
+ * from the device blocks arena.
+ * 'c' is for `cronologic`.
+ */
+#define IOCTL_CRONO_ALLOC_CONTIG_BLOCK                                         \
+        _IOWR('c', 9, CRONO_CONTIG_BLOCK_INFO *)
+/**
+ * Command value passed to miscdev ioctl() to wait until the buffers unlocked,
+ * or released by closing the miscdev, before the call are unmapped, unpinned
+ * and freed, when the module parameter `async_teardown` is set. No argument.
+ * 'c' is for `cronologic`.
+ */
+#define IOCTL_CRONO_WAIT_TEARDOWN _IO('c', 10)
+/**
+ * Command value passed to miscdev ioctl() to steer the device DMA writes into
+ * a locked SG buffer towards the cache of a CPU. Succeeds without programming
+ * anything, and `steering_tag` = -1, if TPH is not supported.
+ * 'c' is for `cronologic`.
+ */
+#define IOCTL_CRONO_SET_BUFFER_TPH _IOWR('c', 11, CRONO_SG_BUFFER_TPH_INFO *)
+/**
+ * Command value passed to miscdev ioctl() to get the device capabilities.
+ * 'c' is for `cronologic`.
+ */
+#define IOCTL_CRONO_GET_DEV_CAPS _IOWR('c', 12, CRONO_DEV_CAPS *)
+/**
+ * Command value passed to miscdev ioctl() to set up the streaming ring of the
+ * device. Fails with `EBUSY` if the ring is already set up, and with
+ * `EOPNOTSUPP` if the device is not emulated.
+ * 'c' is for `cronologic`.
+ */
+#define IOCTL_CRONO_RING_SETUP _IOWR('c', 13, CRONO_RING_SETUP_INFO *)
+/**
+ * Command value passed to miscdev ioctl() to advance the ring `head` by the
+ * `bytes` written by the device, making them readable. Fails with `ENOSPC` if
+ * `bytes` exceeds `space`.
+ * The head is owned by the device, the command is for emulated devices only,
+ * `CRONO_DEV_CAP_EMULATED`, and fails with `EPERM` otherwise.
+ * 'c' is for `cronologic`.
+ */
+#define IOCTL_CRONO_RING_PRODUCE _IOWR('c', 14, CRONO_RING_POS *)
+/**
+ * Command value passed to miscdev ioctl() to advance the ring `tail` by the
+ * `bytes` consumed in place using the ring mapping, giving them back to the
+ * device. Pass `bytes` = 0 to get the ring position.
+ * 'c' is for `cronologic`.
+ */
+#define IOCTL_CRONO_RING_CONSUME _IOWR('c', 15, CRONO_RING_POS *)
+/**
+ * Command value passed to miscdev ioctl() to lock a buffer backed by a range
+ * of a memfd, shmem or hugetlbfs file. The buffer is unlocked using
+ * `IOCTL_CRONO_UNLOCK_BUFFER`.
+ * The file must be opened for reading, and for writing too unless `dma_dir`
+ * is `CRONO_DMA_TO_DEVICE`, otherwise it fails with `EACCES`. It fails with
+ * `EAGAIN` if another thread replaced the range mapping meanwhile.
+ * 'c' is for `cronologic`.
+ */
+#define IOCTL_CRONO_LOCK_FD_BUFFER _IOWR('c', 16, CRONO_FD_BUFFER_LOCK_INFO *)
 
 #endif // #ifndef _CRONO_LINUX_KERNEL_H_
@@ -0,0 +1,574 @@
+/**
+ * @file crono_linux_kernel.hpp
+ * @brief Header-only C++17 interface to the cronologic PCI driver module
+ * miscdevs, on top of `crono_linux_kernel.h`.
+ *
+ * - `crono::device` opens a miscdev.
+ * - `crono::sg_buffer` and `crono::contig_buffer` are move-only handles of
+ *   locked buffers, unlocked when destroyed.
+ * - `crono::sg_buffer_pool` keeps buffers locked between acquisitions, so the
+ *   lock and unlock ioctls are paid once per buffer, not per acquisition.
+ *
+ * The DMA addresses table of SG buffers is mapped read-only instead of being
+ * copied when locking. Errors are thrown as `std::system_error`.
+ * A device must outlive its buffers and pools.
+ */
+#ifndef _CRONO_LINUX_KERNEL_HPP_
+#define _CRONO_LINUX_KERNEL_HPP_
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <future>
+#include <mutex>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#ifndef CRONO_KERNEL_CMD_DEFINED
+/**
+ * Cleanup command, as defined by the kernel module. Define
+ * `CRONO_KERNEL_CMD_DEFINED` if it's already defined by the application.
+ */
+typedef struct {
+        uint32_t addr; // From the start address of BAR 0 region
+        uint32_t data; // Use for 32 bit transfer.
+} CRONO_KERNEL_CMD;
+#endif
+
+#include "crono_linux_kernel.h"
+
+namespace crono {
+
+/**
+ * Throw the `errno` of a failed call as `std::system_error`.
+ */
+[[noreturn]] inline void throw_errno(const char *what, int err = errno) {
+        throw std::system_error(err, std::generic_category(), what);
+}
+
+/**
+ * Options of locking a scatter/gather buffer, see
+ * `CRONO_SG_BUFFER_LOCK_INFO`.
+ */
+struct lock_options {
+        uint32_t flags = 0;                         // CRONO_SG_LOCK_FLAG_xxx
+        uint32_t dma_dir = CRONO_DMA_BIDIRECTIONAL; // CRONO_DMA_xxx
+        uint32_t dma_attrs = 0;                     // CRONO_DMA_ATTR_xxx
+        bool huge_pages = false; // Advise transparent huge pages for the
+                                 // memory allocated by the library
+};
+
+class device;
+
+/**
+ * Locked scatter/gather buffer, unlocked when destroyed.
+ * Memory is either allocated by the library, and freed after unlocking, or
+ * passed by the application, and must outlive the buffer.
+ */
+class sg_buffer {
+      public:
+        sg_buffer() = default;
+        sg_buffer(const sg_buffer &) = delete;
+        sg_buffer &operator=(const sg_buffer &) = delete;
+        sg_buffer(sg_buffer &&other) noexcept { *this = std::move(other); }
+        sg_buffer &operator=(sg_buffer &&other) noexcept {
+                if (this != &other) {
+                        reset();
+                        fd_ = std::exchange(other.fd_, -1);
+                        info_ = other.info_;
+                        owns_memory_ = other.owns_memory_;
+                        table_ = std::exchange(other.table_, nullptr);
+                        table_size_ = other.table_size_;
+                        mapped_size_ = other.mapped_size_;
+                }
+                return *this;
+        }
+        ~sg_buffer() { reset(); }
+
+        /**
+         * Unlock the buffer, and free its memory if allocated by the library.
+         */
+        void reset() noexcept {
+                if (fd_ < 0)
+                        return;
+                if (table_)
+                        munmap(const_cast<DMA_ADDR *>(table_), table_size_);
+                int id = info_.buff_info.id;
+                ioctl(fd_, IOCTL_CRONO_UNLOCK_BUFFER, &id);
+                if (owns_memory_)
+                        munmap(info_.buff_info.addr, mapped_size_);
+                fd_ = -1;
+                table_ = nullptr;
+        }
+
+        explicit operator bool() const noexcept { return fd_ >= 0; }
+        int id() const noexcept { return info_.buff_info.id; }
+        void *data() const noexcept { return info_.buff_info.addr; }
+        size_t size() const noexcept { return info_.buff_info.size; }
+        uint32_t pages_count() const noexcept {
+                return info_.buff_info.pages_count;
+        }
+        uint32_t dma_segments_count() const noexcept {
+                return info_.dma_segments_count;
+        }
+        uint32_t bounced_segments_count() const noexcept {
+                return info_.bounced_segments_count;
+        }
+        DMA_ADDR iova_base() const noexcept { return info_.iova_base; }
+
+        /**
+         * DMA address of every page of the buffer, `pages_count()` elements,
+         * mapped read-only when first called.
+         */
+        const DMA_ADDR *dma_addresses() {
+                if (nullptr == table_) {
+                        table_size_ = pages_count() * sizeof(DMA_ADDR);
+                        void *table = mmap(
+                            nullptr, table_size_, PROT_READ, MAP_SHARED, fd_,
+                            CRONO_MMAP_OFFSET(CRONO_MMAP_TYPE_SG_ADDR_TABLE,
+                                              id(), sysconf(_SC_PAGESIZE)));
+                        if (MAP_FAILED == table)
+                                throw_errno("crono: mapping addresses table");
+                        table_ = static_cast<const DMA_ADDR *>(table);
+                }
+                return table_;
+        }
+
+        /**
+         * Make the range written by the device visible to the CPU.
+         */
+        void sync_for_cpu(uint64_t offset, uint64_t size) const {
+                sync(IOCTL_CRONO_SYNC_BUFFER_FOR_CPU, offset, size);
+        }
+        void sync_for_cpu() const { sync_for_cpu(0, size()); }
+
+        /**
+         * Give the range back to the device after the CPU is done with it.
+         */
+        void sync_for_device(uint64_t offset, uint64_t size) const {
+                sync(IOCTL_CRONO_SYNC_BUFFER_FOR_DEVICE, offset, size);
+        }
+        void sync_for_device() const { sync_for_device(0, size()); }
+
+        /**
+         * Steer the device writes using Steering Tag entry `st_index` into
+         * the cache of `cpu`. Returns the programmed tag, or -1 if TPH is not
+         * supported.
+         */
+        int32_t steer_to_cpu(uint32_t cpu, uint32_t st_index) const {
+                CRONO_SG_BUFFER_TPH_INFO tph_info = {id(), cpu, st_index, -1};
+                if (ioctl(fd_, IOCTL_CRONO_SET_BUFFER_TPH, &tph_info))
+                        throw_errno("crono: steering buffer");
+                return tph_info.steering_tag;
+        }
+
+      private:
+        friend class device;
+
+        void sync(unsigned long cmd, uint64_t offset, uint64_t size) const {
+                CRONO_SG_BUFFER_SYNC_INFO sync_info = {id(), offset, size};
+                if (ioctl(fd_, cmd, &sync_info))
+                        throw_errno("crono: syncing buffer");
+        }
+
+        int fd_ = -1;
+        CRONO_SG_BUFFER_LOCK_INFO info_ = {};
+        bool owns_memory_ = false;
+        const DMA_ADDR *table_ = nullptr;
+        size_t table_size_ = 0;
+        size_t mapped_size_ = 0;
+};
+
+/**
+ * Contiguous DMA buffer allocated by the module and mapped to userspace,
+ * unmapped and unlocked when destroyed.
+ */
+class contig_buffer {
+      public:
+        contig_buffer() = default;
+        contig_buffer(const contig_buffer &) = delete;
+        contig_buffer &operator=(const contig_buffer &) = delete;
+        contig_buffer(contig_buffer &&other) noexcept {
+                *this = std::move(other);
+        }
+        contig_buffer &operator=(contig_buffer &&other) noexcept {
+                if (this != &other) {
+                        reset();
+                        fd_ = std::exchange(other.fd_, -1);
+                        info_ = other.info_;
+                        data_ = std::exchange(other.data_, nullptr);
+                }
+                return *this;
+        }
+        ~contig_buffer() { reset(); }
+
+        void reset() noexcept {
+                if (fd_ < 0)
+                        return;
+                if (data_)
+                        munmap(data_, info_.size);
+                int id = info_.id;
+                ioctl(fd_, IOCTL_CRONO_UNLOCK_CONTIG_BUFFER, &id);
+                fd_ = -1;
+                data_ = nullptr;
+        }
+
+        explicit operator bool() const noexcept { return fd_ >= 0; }
+        int id() const noexcept { return info_.id; }
+        void *data() const noexcept { return data_; }
+        size_t size() const noexcept { return info_.size; }
+        uint64_t dma_handle() const noexcept { return info_.dma_handle; }
+
+      private:
+        friend class device;
+
+        int fd_ = -1;
+        CRONO_CONTIG_BUFFER_INFO info_ = {};
+        void *data_ = nullptr;
+};
+
+/**
+ * An opened miscdev, e.g. `/dev/crono_06_0002000`.
+ */
+class device {
+      public:
+        device() = default;
+        explicit device(const std::string &path) {
+                fd_ = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+                if (fd_ < 0)
+                        throw_errno("crono: opening device");
+        }
+        /**
+         * Open the miscdev of the device `device_id` at `dbdf`.
+         */
+        device(int device_id, struct crono_dev_DBDF dbdf)
+            : device(miscdev_path(device_id, dbdf)) {}
+        device(const device &) = delete;
+        device &operator=(const device &) = delete;
+        device(device &&other) noexcept
+            : fd_(std::exchange(other.fd_, -1)) {}
+        device &operator=(device &&other) noexcept {
+                if (this != &other) {
+                        close();
+                        fd_ = std::exchange(other.fd_, -1);
+                }
+                return *this;
+        }
+        ~device() { close(); }
+
+        void close() noexcept {
+                if (fd_ >= 0)
+                        ::close(fd_);
+                fd_ = -1;
+        }
+
+        static std::string miscdev_path(int device_id,
+                                        struct crono_dev_DBDF dbdf) {
+                char name[CRONO_DEV_NAME_MAX_SIZE];
+                CRONO_CONSTRUCT_MISCDEV_NAME(name, device_id, dbdf);
+                return std::string("/dev/") + name;
+        }
+
+        int fd() const noexcept { return fd_; }
+
+        /**
+         * Allocate `size` bytes of page aligned memory and lock it.
+         */
+        sg_buffer lock_sg(size_t size, const lock_options &options = {}) {
+                size_t page_size = sysconf(_SC_PAGESIZE);
+                size_t mapped_size = (size + page_size - 1) & ~(page_size - 1);
+                void *addr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (MAP_FAILED == addr)
+                        throw_errno("crono: allocating buffer");
+                if (options.huge_pages)
+                        madvise(addr, mapped_size, MADV_HUGEPAGE);
+                try {
+                        sg_buffer buffer = lock_sg(addr, size, options);
+                        buffer.owns_memory_ = true;
+                        buffer.mapped_size_ = mapped_size;
+                        return buffer;
+                } catch (...) {
+                        munmap(addr, mapped_size);
+                        throw;
+                }
+        }
+
+        /**
+         * Lock the application memory `addr` of `size` bytes, which must
+         * outlive the returned buffer.
+         */
+        sg_buffer lock_sg(void *addr, size_t size,
+                          const lock_options &options = {}) {
+                size_t page_size = sysconf(_SC_PAGESIZE);
+                sg_buffer buffer;
+                buffer.info_.buff_info.addr = addr;
+                buffer.info_.buff_info.size = size;
+                buffer.info_.buff_info.pages_count =
+                    (size + page_size - 1) / page_size;
+                // No pages table copy, it's mapped by `dma_addresses()`
+                buffer.info_.buff_info.pages = nullptr;
+                buffer.info_.buff_info.upages = 0;
+                buffer.info_.flags = options.flags;
+                buffer.info_.dma_dir = options.dma_dir;
+                buffer.info_.dma_attrs = options.dma_attrs;
+                if (ioctl(fd_, IOCTL_CRONO_LOCK_BUFFER_EX, &buffer.info_))
+                        throw_errno("crono: locking buffer");
+                buffer.fd_ = fd_;
+                return buffer;
+        }
+
+        /**
+         * Lock `size` bytes at `offset` of the memfd, shmem or hugetlbfs file
+         * `file_fd`. `data()` of the returned buffer is null, every process
+         * maps the file range on its own.
+         */
+        sg_buffer lock_sg(int file_fd, uint64_t offset, size_t size,
+                          const lock_options &options = {}) {
+                size_t page_size = sysconf(_SC_PAGESIZE);
+                CRONO_FD_BUFFER_LOCK_INFO fd_info = {};
+                fd_info.lock_info.buff_info.size = size;
+                fd_info.lock_info.buff_info.pages_count =
+                    (size + page_size - 1) / page_size;
+                fd_info.lock_info.flags = options.flags;
+                fd_info.lock_info.dma_dir = options.dma_dir;
+                fd_info.lock_info.dma_attrs = options.dma_attrs;
+                fd_info.fd = file_fd;
+                fd_info.offset = offset;
+                if (ioctl(fd_, IOCTL_CRONO_LOCK_FD_BUFFER, &fd_info))
+                        throw_errno("crono: locking file buffer");
+                sg_buffer buffer;
+                buffer.info_ = fd_info.lock_info;
+                buffer.fd_ = fd_;
+                return buffer;
+        }
+
+        /**
+         * Lock the buffer on another thread, e.g. while the application
+         * prepares the acquisition. The future can be awaited by coroutine
+         * frameworks adapting `std::future`.
+         */
+        std::future<sg_buffer> lock_sg_async(size_t size,
+                                             const lock_options &options = {}) {
+                return std::async(std::launch::async, [this, size, options] {
+                        return lock_sg(size, options);
+                });
+        }
+
+        /**
+         * Allocate a contiguous DMA buffer of `size` bytes, and map it.
+         */
+        contig_buffer lock_contig(size_t size) {
+                contig_buffer buffer;
+                buffer.info_.size = size;
+                if (ioctl(fd_, IOCTL_CRONO_LOCK_CONTIG_BUFFER, &buffer.info_))
+                        throw_errno("crono: locking contiguous buffer");
+                buffer.fd_ = fd_;
+                void *data =
+                    mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd_,
+                         CRONO_MMAP_OFFSET(CRONO_MMAP_TYPE_CONTIG,
+                                           buffer.info_.id,
+                                           sysconf(_SC_PAGESIZE)));
+                if (MAP_FAILED == data)
+                        throw_errno("crono: mapping contiguous buffer");
+                buffer.data_ = data;
+                return buffer;
+        }
+
+        std::future<contig_buffer> lock_contig_async(size_t size) {
+                return std::async(std::launch::async,
+                                  [this, size] { return lock_contig(size); });
+        }
+
+        /**
+         * Set the commands written to the device registers when the device is
+         * closed.
+         */
+        void set_cleanup_commands(std::vector<CRONO_KERNEL_CMD> cmds) {
+                CRONO_KERNEL_CMDS_INFO cmds_info = {};
+                cmds_info.cmds = cmds.data();
+                cmds_info.ucmds = reinterpret_cast<uintptr_t>(cmds.data());
+                cmds_info.count = static_cast<uint32_t>(cmds.size());
+                if (ioctl(fd_, IOCTL_CRONO_CLEANUP_SETUP, &cmds_info))
+                        throw_errno("crono: setting cleanup commands");
+        }
+
+        /**
+         * Bitmask of `CRONO_DEV_CAP_xxx` of the device.
+         */
+        uint32_t caps() const {
+                CRONO_DEV_CAPS dev_caps = {};
+                if (ioctl(fd_, IOCTL_CRONO_GET_DEV_CAPS, &dev_caps))
+                        throw_errno("crono: getting device capabilities");
+                return dev_caps.caps;
+        }
+
+        /**
+         * Allocate the device streaming ring of `pages_count` pages, and
+         * return its size in bytes. The ring data is then consumed by `read()`
+         * or `splice()` on `fd()`. Emulated devices only.
+         */
+        uint64_t setup_ring(uint32_t pages_count) {
+                CRONO_RING_SETUP_INFO setup_info = {};
+                setup_info.pages_count = pages_count;
+                if (ioctl(fd_, IOCTL_CRONO_RING_SETUP, &setup_info))
+                        throw_errno("crono: setting up ring");
+                return setup_info.size;
+        }
+
+      private:
+        int fd_ = -1;
+};
+
+/**
+ * Pool of SG buffers of the same size and options, kept locked between
+ * acquisitions. Acquired buffers are returned to the pool when their handle is
+ * destroyed, and unlocked when the pool is destroyed or trimmed.
+ * Thread safe. The pool must outlive its acquired handles.
+ */
+class sg_buffer_pool {
+      public:
+        /**
+         * Buffer acquired from the pool, returned to it when destroyed.
+         */
+        class handle {
+              public:
+                handle() = default;
+                handle(const handle &) = delete;
+                handle &operator=(const handle &) = delete;
+                handle(handle &&other) noexcept
+                    : pool_(std::exchange(other.pool_, nullptr)),
+                      buffer_(std::move(other.buffer_)) {}
+                handle &operator=(handle &&other) noexcept {
+                        if (this != &other) {
+                                release();
+                                pool_ = std::exchange(other.pool_, nullptr);
+                                buffer_ = std::move(other.buffer_);
+                        }
+                        return *this;
+                }
+                ~handle() { release(); }
+
+                void release() noexcept {
+                        if (pool_)
+                                pool_->give_back(std::move(buffer_));
+                        pool_ = nullptr;
+                }
+                sg_buffer &operator*() noexcept { return buffer_; }
+                sg_buffer *operator->() noexcept { return &buffer_; }
+
+              private:
+                friend class sg_buffer_pool;
+                handle(sg_buffer_pool *pool, sg_buffer &&buffer)
+                    : pool_(pool), buffer_(std::move(buffer)) {}
+
+                sg_buffer_pool *pool_ = nullptr;
+                sg_buffer buffer_;
+        };
+
+        sg_buffer_pool(device &dev, size_t buffer_size,
+                       const lock_options &options = {})
+            : dev_(dev), buffer_size_(buffer_size), options_(options) {}
+        sg_buffer_pool(const sg_buffer_pool &) = delete;
+        sg_buffer_pool &operator=(const sg_buffer_pool &) = delete;
+
+        /**
+         * Lock buffers ahead until `count` are free in the pool, so later
+         * acquisitions don't lock.
+         */
+        void reserve(size_t count) {
+                for (;;) {
+                        {
+                                std::lock_guard<std::mutex> guard(mutex_);
+                                if (free_.size() >= count)
+                                        return;
+                        }
+                        put(dev_.lock_sg(buffer_size_, options_));
+                }
+        }
+
+        /**
+         * Get a free locked buffer, or lock a new one if none is free.
+         */
+        handle acquire() {
+                {
+                        std::lock_guard<std::mutex> guard(mutex_);
+                        // Room for all the acquired buffers, so giving them
+                        // back from the handles destructors doesn't allocate
+                        free_.reserve(free_.size() + acquired_ + 1);
+                        acquired_++;
+                        if (!free_.empty()) {
+                                sg_buffer buffer = std::move(free_.back());
+                                free_.pop_back();
+                                return handle(this, std::move(buffer));
+                        }
+                }
+                try {
+                        return handle(this,
+                                      dev_.lock_sg(buffer_size_, options_));
+                } catch (...) {
+                        std::lock_guard<std::mutex> guard(mutex_);
+                        acquired_--;
+                        throw;
+                }
+        }
+
+        std::future<handle> acquire_async() {
+                return std::async(std::launch::async,
+                                  [this] { return acquire(); });
+        }
+
+        /**
+         * Unlock the free buffers beyond `keep`.
+         */
+        void trim(size_t keep = 0) {
+                std::vector<sg_buffer> unlocked;
+                {
+                        std::lock_guard<std::mutex> guard(mutex_);
+                        while (free_.size() > keep) {
+                                unlocked.push_back(std::move(free_.back()));
+                                free_.pop_back();
+                        }
+                }
+                // Unlocked outside the lock, when `unlocked` is destroyed
+        }
+
+        size_t free_count() {
+                std::lock_guard<std::mutex> guard(mutex_);
+                return free_.size();
+        }
+
+      private:
+        void put(sg_buffer &&buffer) {
+                std::lock_guard<std::mutex> guard(mutex_);
+                free_.push_back(std::move(buffer));
+        }
+
+        // Capacity for the buffer is reserved by `acquire()`, `buffer` is
+        // empty if it was moved out of its handle
+        void give_back(sg_buffer &&buffer) noexcept {
+                std::lock_guard<std::mutex> guard(mutex_);
+                if (buffer)
+                        free_.push_back(std::move(buffer));
+                acquired_--;
+        }
+
+        device &dev_;
+        size_t buffer_size_;
+        lock_options options_;
+        std::mutex mutex_;
+        std::vector<sg_buffer> free_;
+        size_t acquired_ = 0; // Buffers held by handles
+};
+
+} // namespace crono
+
+#endif // #ifndef _CRONO_LINUX_KERNEL_HPP_
@@ -1,5 +1,7 @@
 #include "crono_kernel_module.h"
 #include "crono_miscdevice.h"
+#define CREATE_TRACE_POINTS
+#include "crono_trace.h"
 
 // _____________________________________________________________________________
 // Globals
@@ -30,10 +32,47 @@ MODULE_VERSION("1.4.2");
  */
 static struct crono_miscdev crono_miscdev_pool[CRONO_MAX_MSCDEV_COUNT];
 static uint32_t crono_miscdev_pool_new_index = 0;
+/**
+ * Serializes claiming a pool record, devices are probed asynchronously, in
+ * parallel, and emulated devices are registered meanwhile.
+ */
+static DEFINE_MUTEX(crono_miscdev_pool_lock);
 #define RESET_CRONO_MISCDEV(pcrono_miscdev)                                    \
         memset(pcrono_miscdev, 0, sizeof(struct crono_miscdev));
+static int crono_miscdev_mmap(struct file *file, struct vm_area_struct *vma);
 static int crono_mmap_contig(struct file *file, struct vm_area_struct *vma);
-static int get_bw(int bw_id, CRONO_CONTIG_BUFFER_INFO_WRAPPER **ppBW);
+static int crono_mmap_sg_addr_table(struct file *file,
+                                    struct vm_area_struct *vma);
+static int crono_mmap_block_arena(struct file *file,
+                                  struct vm_area_struct *vma);
+static int crono_mmap_status_page(struct file *file,
+                                  struct vm_area_struct *vma);
+static int crono_mmap_ring(struct file *file, struct vm_area_struct *vma);
+static int crono_mmap_ring_addr_table(struct file *file,
+                                      struct vm_area_struct *vma);
+// Find the buffer wrapper of `bw_id` and take a reference for the caller to
+// put, or, if `detach`, delete it from the list passing the list reference.
+static int get_bw(int bw_id, bool detach,
+                  CRONO_CONTIG_BUFFER_INFO_WRAPPER **ppBW);
+static int get_sg_bw(int bw_id, bool detach,
+                     CRONO_SG_BUFFER_INFO_WRAPPER **ppBW);
+static int _crono_get_mapped_sg_bw(int bw_id, struct device *devp,
+                                   CRONO_SG_BUFFER_INFO_WRAPPER **ppBW);
+
+/**
+ * Native descriptor table format of every device family, indexed by the
+ * CRONO_DEVICE_xxx Device ID. Families not listed use
+ * `CRONO_DESC_FORMAT_PAGE_LIST`, the format of the pages addresses table
+ * copied to userspace when locking the buffer.
+ */
+static const uint32_t crono_device_desc_formats[CRONO_DEVICE_DEV_ID_MAX_COUNT] =
+    {
+        [CRONO_DEVICE_XTDC4] = CRONO_DESC_FORMAT_PAGE_LIST,
+        [CRONO_DEVICE_TIMETAGGER4] = CRONO_DESC_FORMAT_PAGE_LIST,
+        [CRONO_DEVICE_XHPTDC8] = CRONO_DESC_FORMAT_PAGE_LIST,
+        [CRONO_DEVICE_NDIGO6G12] = CRONO_DESC_FORMAT_PAGE_LIST,
+        [CRONO_DEVICE_NDIGO5G] = CRONO_DESC_FORMAT_PAGE_LIST,
+};
 
 static const struct pci_device_id crono_pci_device_ids[] = {
     // Get all devices of cronologic Vendor ID
@@ -50,6 +89,8 @@ static struct pci_driver crono_pci_driver = {
     .name = CRONO_PCI_DRIVER_NAME,
     .id_table = crono_pci_device_ids,
     .probe = crono_driver_probe,
+    // Cards are initialized in parallel, not to wait on serial probing
+    .driver = {.probe_type = PROBE_PREFER_ASYNCHRONOUS},
 };
 
 static struct file_operations crono_miscdev_fops = {
@@ -60,8 +101,107 @@ static struct file_operations crono_miscdev_fops = {
 
     .unlocked_ioctl = crono_miscdev_ioctl,
 
-    .mmap = crono_mmap_contig,
+    .mmap = crono_miscdev_mmap,
+
+    // Streaming ring consumers
+    .read = crono_miscdev_read,
+    .poll = crono_miscdev_poll,
+#ifdef KERNEL_5_8_OR_LATER
+    .splice_read = crono_miscdev_splice_read,
+#endif
+};
+
+// miscdev sysfs attributes
+/**
+ * Define the read-only sysfs attribute of the statistics `field` sum.
+ */
+#define CRONO_STAT_ATTR_RO(field)                                              \
+        static ssize_t field##_show(struct device *dev,                        \
+                                    struct device_attribute *attr,             \
+                                    char *buf) {                               \
+                struct crono_miscdev *crono_dev =                              \
+                    CRONO_MISCDEV_FROM_SYSFS_DEV(dev);                         \
+                return scnprintf(buf, PAGE_SIZE, "%lld\n",                     \
+                                 CRONO_STAT_READ(crono_dev, field));           \
+        }                                                                      \
+        static DEVICE_ATTR_RO(field)
+
+static DEVICE_ATTR_RO(bounced_buffers);
+static DEVICE_ATTR_RO(bounced_segments);
+static DEVICE_ATTR_RO(contig_pool_avail);
+static DEVICE_ATTR_RO(block_arena_avail);
+static DEVICE_ATTR_RO(probe_ns);
+CRONO_STAT_ATTR_RO(pinned_bytes);
+CRONO_STAT_ATTR_RO(sg_buffers);
+CRONO_STAT_ATTR_RO(contig_buffers);
+CRONO_STAT_ATTR_RO(locks);
+CRONO_STAT_ATTR_RO(lock_errors);
+CRONO_STAT_ATTR_RO(unlocks);
+CRONO_STAT_ATTR_RO(unlock_errors);
+CRONO_STAT_ATTR_RO(maps);
+CRONO_STAT_ATTR_RO(map_errors);
+CRONO_STAT_ATTR_RO(contig_cache_hits);
+static struct attribute *crono_miscdev_attrs[] = {
+    &dev_attr_bounced_buffers.attr,
+    &dev_attr_bounced_segments.attr,
+    &dev_attr_contig_pool_avail.attr,
+    &dev_attr_block_arena_avail.attr,
+    &dev_attr_probe_ns.attr,
+    &dev_attr_pinned_bytes.attr,
+    &dev_attr_sg_buffers.attr,
+    &dev_attr_contig_buffers.attr,
+    &dev_attr_locks.attr,
+    &dev_attr_lock_errors.attr,
+    &dev_attr_unlocks.attr,
+    &dev_attr_unlock_errors.attr,
+    &dev_attr_maps.attr,
+    &dev_attr_map_errors.attr,
+    &dev_attr_contig_cache_hits.attr,
+    NULL};
+static const struct attribute_group crono_miscdev_group = {
+    .attrs = crono_miscdev_attrs,
+};
+
+// PCIe link attributes, read from the device on every `show`
+static DEVICE_ATTR_RO(current_link_speed);
+static DEVICE_ATTR_RO(current_link_width);
+static DEVICE_ATTR_RO(max_link_speed);
+static DEVICE_ATTR_RO(max_link_width);
+static DEVICE_ATTR_RO(max_payload_size);
+static DEVICE_ATTR_RO(max_read_request_size);
+static DEVICE_ATTR_RO(relaxed_ordering);
+static DEVICE_ATTR_RO(extended_tags);
+static DEVICE_ATTR_RO(numa_node);
+static DEVICE_ATTR_RO(irq_mode);
+static struct attribute *crono_pcie_attrs[] = {
+    &dev_attr_current_link_speed.attr,
+    &dev_attr_current_link_width.attr,
+    &dev_attr_max_link_speed.attr,
+    &dev_attr_max_link_width.attr,
+    &dev_attr_max_payload_size.attr,
+    &dev_attr_max_read_request_size.attr,
+    &dev_attr_relaxed_ordering.attr,
+    &dev_attr_extended_tags.attr,
+    &dev_attr_numa_node.attr,
+    &dev_attr_irq_mode.attr,
+    NULL};
+static const struct attribute_group crono_pcie_group = {
+    .name = "pcie",
+    .is_visible = _crono_pcie_attr_visible,
+    .attrs = crono_pcie_attrs,
 };
+static const struct attribute_group *crono_miscdev_groups[] = {
+    &crono_miscdev_group, &crono_pcie_group, NULL};
+
+// debugfs files
+DEFINE_SHOW_ATTRIBUTE(crono_debugfs_histograms);
+DEFINE_SHOW_ATTRIBUTE(crono_debugfs_buffers);
+
+/**
+ * debugfs directory `crono`, holding the buffers list and a directory per
+ * device.
+ */
+static struct dentry *crono_debugfs_root = NULL;
 
 // DMA Buffer Information Wrappers List Variables and Functions
 /**
@@ -77,6 +217,159 @@ struct list_head contig_buff_wrappers_head;
 static int sg_buff_wrappers_new_id = 0;
 static int contig_buff_wrappers_new_id = 0;
 
+/**
+ * @brief Protects the buffer wrappers lists and new ids.
+ * Held only while the lists are accessed, never across userspace memory
+ * access, as `mmap` is called with the process memory map locked.
+ */
+static DEFINE_MUTEX(crono_buff_wrappers_lock);
+
+// Deferred Teardown
+/**
+ * Unlock buffers of closed files and unlock ioctls in the background, so
+ * `close` and unlock return after DMA is stopped, without waiting for the
+ * buffers to be unmapped, unpinned and freed.
+ */
+static bool async_teardown = true;
+module_param(async_teardown, bool, 0644);
+MODULE_PARM_DESC(async_teardown,
+                 "Unmap, unpin and free unlocked buffers in the background "
+                 "(default Y)");
+
+/**
+ * Buffer wrappers of both types waiting to be released by
+ * `crono_teardown_work`, protected by `crono_buff_wrappers_lock`.
+ */
+static LIST_HEAD(crono_teardown_head);
+static DECLARE_WORK(crono_teardown_work, _crono_teardown_work_fn);
+
+// Pinned Memory Limits
+/**
+ * Limits of the memory pinned by the locked SG buffers of a device and of a
+ * process, in bytes, 0 is unlimited. Locking a buffer exceeding a limit fails
+ * with `EDQUOT`. Pinned pages are also charged to the process `VmPin`, and
+ * limited by its `RLIMIT_MEMLOCK`.
+ */
+static unsigned long max_pinned_bytes_per_device = 0;
+module_param(max_pinned_bytes_per_device, ulong, 0644);
+MODULE_PARM_DESC(max_pinned_bytes_per_device,
+                 "Maximum bytes pinned by the SG buffers of a device, 0 is "
+                 "unlimited (default 0)");
+static unsigned long max_pinned_bytes_per_process = 0;
+module_param(max_pinned_bytes_per_process, ulong, 0644);
+MODULE_PARM_DESC(max_pinned_bytes_per_process,
+                 "Maximum bytes pinned by the SG buffers of a process, over "
+                 "all devices, 0 is unlimited (default 0)");
+
+// Contiguous Buffers Pools
+/**
+ * Size in bytes of the coherent memory reserved per device when the module is
+ * loaded, before memory is fragmented, to allocate the contiguous buffers
+ * from. Reservations larger than the buddy allocator maximum, e.g. 4 MiB, need
+ * a CMA area, e.g. kernel parameter `cma=256M`.
+ */
+static unsigned long contig_pool_size = 0;
+module_param(contig_pool_size, ulong, 0444);
+MODULE_PARM_DESC(contig_pool_size,
+                 "Bytes of 32-bit coherent memory reserved per device for the "
+                 "contiguous buffers, 0 to disable (default 0)");
+
+/**
+ * Maximum size in bytes of the freed contiguous buffers kept per device, zeroed
+ * in the background, so the next allocations of the same size don't wait for
+ * `dma_alloc_coherent` zeroing.
+ */
+static unsigned long contig_cache_size = 0;
+module_param(contig_cache_size, ulong, 0644);
+MODULE_PARM_DESC(contig_cache_size,
+                 "Bytes of freed contiguous buffers cached per device and "
+                 "zeroed in the background, 0 to disable (default 0)");
+
+/**
+ * Unbound workqueue zeroing the cached buffers, its `nice` is set in
+ * `/sys/devices/virtual/workqueue/crono_zero/`. NULL if not allocated, then
+ * buffers are not cached.
+ */
+static struct workqueue_struct *crono_zero_wq = NULL;
+
+/**
+ * Size in bytes of the coherent memory reserved per device for the small
+ * contiguous blocks of `IOCTL_CRONO_ALLOC_CONTIG_BLOCK`, e.g. descriptor tables
+ * and status words, sharing a single userspace mapping.
+ */
+static unsigned long block_arena_size = 256 * 1024;
+module_param(block_arena_size, ulong, 0444);
+MODULE_PARM_DESC(block_arena_size,
+                 "Bytes of 32-bit coherent memory reserved per device for the "
+                 "contiguous blocks, 0 to disable (default 256 KiB)");
+
+/**
+ * Reserved memory of the pools and the arenas, kept to be freed after the
+ * miscdevs are reset and the buffers are released. Records are claimed under
+ * `crono_miscdev_pool_lock`, as the devices are probed in parallel.
+ */
+static struct crono_reserved_pool
+    crono_reserved_pools[2 * CRONO_MAX_MSCDEV_COUNT];
+static unsigned int crono_reserved_pools_count = 0;
+
+// PCIe Tuning
+/**
+ * PCIe settings applied to every card at probe, the firmware defaults are
+ * kept if not set. Values not supported by the card or by the platform are
+ * logged and skipped.
+ */
+static int pcie_max_payload_size = 0;
+module_param(pcie_max_payload_size, int, 0444);
+MODULE_PARM_DESC(pcie_max_payload_size,
+                 "Max Payload Size in bytes, not above the upstream bridge "
+                 "one, 0 to keep (default 0)");
+static int pcie_max_read_request_size = 0;
+module_param(pcie_max_read_request_size, int, 0444);
+MODULE_PARM_DESC(pcie_max_read_request_size,
+                 "Max Read Request Size in bytes, 128 to 4096, 0 to keep "
+                 "(default 0)");
+static int pcie_relaxed_ordering = -1;
+module_param(pcie_relaxed_ordering, int, 0444);
+MODULE_PARM_DESC(pcie_relaxed_ordering,
+                 "1 to enable relaxed ordering unless the root port doesn't "
+                 "support it, 0 to disable, -1 to keep (default -1)");
+static int pcie_extended_tags = -1;
+module_param(pcie_extended_tags, int, 0444);
+MODULE_PARM_DESC(pcie_extended_tags,
+                 "1 to enable 8-bit extended tags, 2 to enable 10-bit tags, 0 "
+                 "to disable both, -1 to keep (default -1)");
+static bool pcie_tph = true;
+module_param(pcie_tph, bool, 0444);
+MODULE_PARM_DESC(pcie_tph, "Enable TLP Processing Hints if supported by the "
+                           "device and the platform (default Y)");
+
+// Emulated Devices
+/**
+ * Software emulated devices, registered in addition to the probed PCI devices,
+ * for testing and benchmarking the applications and the module without
+ * hardware.
+ */
+static unsigned int emulated_devices = 0;
+module_param(emulated_devices, uint, 0444);
+MODULE_PARM_DESC(emulated_devices,
+                 "Number of software emulated devices to register (default 0)");
+static int emulated_device_id = CRONO_DEVICE_XTDC4;
+module_param(emulated_device_id, int, 0444);
+MODULE_PARM_DESC(emulated_device_id,
+                 "Device ID of the emulated devices (default xTDC4)");
+static unsigned long emulated_packet_rate = 1000000;
+module_param(emulated_packet_rate, ulong, 0644);
+MODULE_PARM_DESC(emulated_packet_rate,
+                 "Packets per second written by every emulated device into its "
+                 "locked buffers, 0 to pause (default 1000000)");
+
+/**
+ * Platform devices of the emulated devices, kept to be unregistered after the
+ * miscdevs are reset and the buffers are released.
+ */
+static struct platform_device *crono_emu_pdevs[CRONO_MAX_MSCDEV_COUNT];
+static unsigned int crono_emu_pdevs_count = 0;
+
 // _____________________________________________________________________________
 // init & exit
 //
@@ -95,16 +388,34 @@ static int __init crono_driver_init(void) {
         memset(crono_miscdev_pool, 0,
                sizeof(struct crono_miscdev) * CRONO_MAX_MSCDEV_COUNT);
 
+        // Only one buffer is zeroed at a time, not to compete with
+        // acquisitions. Buffers are not cached if not allocated.
+        crono_zero_wq = alloc_workqueue("crono_zero", WQ_UNBOUND | WQ_SYSFS, 1);
+        if (NULL == crono_zero_wq)
+                pr_warn("Error allocating workqueue, contiguous buffers are "
+                        "not cached");
+
+        // debugfs is optional, no error is returned if not available
+        crono_debugfs_root = debugfs_create_dir("crono", NULL);
+        debugfs_create_file("buffers", 0444, crono_debugfs_root, NULL,
+                            &crono_debugfs_buffers_fops);
+
         // Register the driver, and start probing
         ret = pci_register_driver(&crono_pci_driver);
         if (ret) {
                 pr_err("Error Registering PCI Driver, <%d>!!!", ret);
+                debugfs_remove_recursive(crono_debugfs_root);
+                if (crono_zero_wq)
+                        destroy_workqueue(crono_zero_wq);
                 return ret;
         }
 
         // Success
         pr_info("Done registering cronologic PCI driver");
 
+        // Emulated devices errors are logged, and don't fail the module
+        _crono_emu_init();
+
         return ret;
 }
 module_init(crono_driver_init);
@@ -116,6 +427,13 @@ static void __exit crono_driver_exit(void) {
 
         int icrono_miscdev;
 
+        // Finish the deferred teardown while the devices are valid
+        flush_work(&crono_teardown_work);
+
+        // Remove debugfs files before the devices statistics are freed
+        debugfs_remove_recursive(crono_debugfs_root);
+        crono_debugfs_root = NULL;
+
         // Unregister all registered devices miscdevs
         if (crono_miscdev_pool_new_index)
                 pr_info("Unregistering <%d> miscellaneous devices...",
@@ -131,6 +449,9 @@ static void __exit crono_driver_exit(void) {
                             icrono_miscdev);
                         continue;
                 }
+                // Stop writing into the buffers before they are released
+                _crono_emu_stop(&(crono_miscdev_pool[icrono_miscdev]));
+
                 // Deregister the miscdev
                 pr_info(
                     "Exiting cronologic miscdev driver: <%s>, minor: <%d>...",
@@ -140,6 +461,16 @@ static void __exit crono_driver_exit(void) {
                 // Log to inform deregisteration didn't crash
                 pr_info("Done exiting miscdev driver: <%s>",
                         crono_miscdev_pool[icrono_miscdev].miscdev.name);
+                free_percpu(crono_miscdev_pool[icrono_miscdev].stats);
+#ifdef KERNEL_6_13_OR_LATER
+                if (crono_miscdev_pool[icrono_miscdev].tph_enabled)
+                        pcie_disable_tph(
+                            crono_miscdev_pool[icrono_miscdev].dev);
+#endif
+                _crono_contig_cache_drain(
+                    &(crono_miscdev_pool[icrono_miscdev]));
+                _crono_status_page_exit(&(crono_miscdev_pool[icrono_miscdev]));
+                _crono_ring_free(&(crono_miscdev_pool[icrono_miscdev]));
 
                 // Reset the record
                 RESET_CRONO_MISCDEV(&(crono_miscdev_pool[icrono_miscdev]));
@@ -152,6 +483,11 @@ static void __exit crono_driver_exit(void) {
         // Release all buffer wrappers, assuming their applications are
         // terminated
         _crono_release_buffer_wrappers();
+        _crono_reserved_pools_exit();
+        _crono_emu_exit();
+        if (crono_zero_wq)
+                destroy_workqueue(crono_zero_wq);
+        crono_zero_wq = NULL;
 
         // Unregister the driver
         pr_info("Removing Driver...");
@@ -166,12 +502,13 @@ static int crono_driver_probe(struct pci_dev *dev,
 
         int ret = CRONO_SUCCESS;
         struct crono_miscdev *new_crono_miscdev = NULL;
+        u64 start_ns = ktime_get_ns();
 
         // Check the device to claim if concerned
-        pr_info("Probe Device, ID <0x%02X>", dev->device);
+        pr_debug("Probe Device, ID <0x%02X>", dev->device);
         if (id->vendor != CRONO_VENDOR_ID)
                 return -EINVAL;
-        if ((dev->device > CRONO_DEVICE_DEV_ID_MAX_COUNT) ||
+        if ((dev->device >= CRONO_DEVICE_DEV_ID_MAX_COUNT) ||
             (dev->device < 0)) {
                 pr_err("Error Device ID <0x%02x> not supported", dev->device);
                 return -EINVAL;
@@ -186,14 +523,10 @@ static int crono_driver_probe(struct pci_dev *dev,
 
         // Enable DMA by setting the bus master bit in the PCI_COMMAND register
         pci_set_master(dev);
+        _crono_pcie_tune(dev);
+        _crono_pcie_check_link(dev);
 
-        // Register a miscdev for this device
-        if (CRONO_SUCCESS !=
-            (ret = _crono_miscdev_init(dev, id, &new_crono_miscdev))) {
-                goto error_miscdev;
-        }
-
-        // Set DMA Mask
+        // Set DMA Mask before the miscdev is registered and usable
         // Since SG crono devices can all handle full 64 bit address as DMA
         // source and destination, we need to set 64-bit mask to avoid using
         // `swiotlb` by linux when calling `dma_map_sg`.
@@ -205,26 +538,78 @@ static int crono_driver_probe(struct pci_dev *dev,
 
                 goto error_miscdev;
         }
+        // Let the IOMMU merge the mapped pages into segments as large as a
+        // scatterlist entry can describe, instead of the 64KB default, and
+        // across the 4GB boundaries, which the device DMA doesn't care about.
+        if (dma_set_max_seg_size(&dev->dev, UINT_MAX))
+                pr_debug("Cannot set maximum DMA segment size");
+        if (dma_set_seg_boundary(&dev->dev, DMA_BIT_MASK(64)))
+                pr_debug("Cannot set DMA segment boundary");
+
+        // Register a miscdev for this device
+        if (CRONO_SUCCESS !=
+            (ret = _crono_miscdev_init(dev, id, &new_crono_miscdev))) {
+                goto error_miscdev;
+        }
 
         // Log and return
-        if (NULL != new_crono_miscdev)
-                pr_info("Done probing with minor: <%d>",
-                        new_crono_miscdev->miscdev.minor);
-        else
+        if (NULL == new_crono_miscdev) {
                 pr_err("Invalid crono_miscdev object of initialized miscdev");
+                return ret;
+        }
+        new_crono_miscdev->probe_ns = ktime_get_ns() - start_ns;
+        pr_info("Probed device <%s>, minor <%d>, in <%llu> us",
+                new_crono_miscdev->name, new_crono_miscdev->miscdev.minor,
+                new_crono_miscdev->probe_ns / NSEC_PER_USEC);
         return ret;
 
 error_miscdev:
         pci_disable_device(dev);
         // Reset the record
         if (NULL != new_crono_miscdev)
-                RESET_CRONO_MISCDEV(new_crono_miscdev);
+                _crono_miscdev_unclaim(new_crono_miscdev);
         return ret;
 }
 
 // _____________________________________________________________________________
 // Miscellaneous Device Driver
 char testval[20] = "testval";
+static struct crono_miscdev *_crono_miscdev_claim(void) {
+
+        struct crono_miscdev *crono_dev = NULL;
+        uint32_t icrono_miscdev;
+
+        mutex_lock(&crono_miscdev_pool_lock);
+        // Reuse the record of a device that failed to initialize
+        for (icrono_miscdev = 0; icrono_miscdev < crono_miscdev_pool_new_index;
+             icrono_miscdev++) {
+                if (!crono_miscdev_pool[icrono_miscdev].claimed) {
+                        crono_dev = &(crono_miscdev_pool[icrono_miscdev]);
+                        break;
+                }
+        }
+        if ((NULL == crono_dev) &&
+            (crono_miscdev_pool_new_index < CRONO_MAX_MSCDEV_COUNT)) {
+                crono_dev = &(crono_miscdev_pool[crono_miscdev_pool_new_index]);
+                // Read without the lock by the file operations
+                WRITE_ONCE(crono_miscdev_pool_new_index,
+                           crono_miscdev_pool_new_index + 1);
+        }
+        if (NULL != crono_dev)
+                crono_dev->claimed = true;
+        mutex_unlock(&crono_miscdev_pool_lock);
+        if (NULL == crono_dev)
+                pr_err("Error, reached the maximum of <%d> devices",
+                       CRONO_MAX_MSCDEV_COUNT);
+        return crono_dev;
+}
+
+static void _crono_miscdev_unclaim(struct crono_miscdev *crono_dev) {
+        mutex_lock(&crono_miscdev_pool_lock);
+        RESET_CRONO_MISCDEV(crono_dev);
+        mutex_unlock(&crono_miscdev_pool_lock);
+}
+
 static int _crono_miscdev_init(struct pci_dev *dev,
                                const struct pci_device_id *id,
                                struct crono_miscdev **crono_dev) {
@@ -246,18 +631,39 @@ static int _crono_miscdev_init(struct pci_dev *dev,
                 return -EINVAL;
         }
 
-        // Initialize crono_miscdev and generate the device name
-        new_crono_miscdev = &(crono_miscdev_pool[crono_miscdev_pool_new_index]);
+        // Initialize crono_miscdev
+        new_crono_miscdev = _crono_miscdev_claim();
+        if (NULL == new_crono_miscdev)
+                return -ENOSPC;
         new_crono_miscdev->dev = dev;
+        new_crono_miscdev->dma_dev = &dev->dev;
         new_crono_miscdev->device_id = dev->device;
         if (CRONO_SUCCESS !=
             (ret = _crono_get_DBDF_from_dev(dev, &(new_crono_miscdev->dbdf)))) {
-                goto init_err;
+                _crono_miscdev_unclaim(new_crono_miscdev);
+                return ret;
         }
-        pr_info("Probed device BDBF: <%04X:%02X:%02X.%01X>",
-                new_crono_miscdev->dbdf.domain, new_crono_miscdev->dbdf.bus,
-                new_crono_miscdev->dbdf.dev, new_crono_miscdev->dbdf.func);
+        pr_debug("Probed device BDBF: <%04X:%02X:%02X.%01X>",
+                 new_crono_miscdev->dbdf.domain, new_crono_miscdev->dbdf.bus,
+                 new_crono_miscdev->dbdf.dev, new_crono_miscdev->dbdf.func);
+
+        // Enable TPH before the miscdev is registered and usable
+        _crono_tph_init(new_crono_miscdev);
+        ret = _crono_miscdev_register(new_crono_miscdev, crono_dev);
+#ifdef KERNEL_6_13_OR_LATER
+        // The miscdev object is reset on error
+        if (CRONO_SUCCESS != ret)
+                pcie_disable_tph(dev);
+#endif
+        return ret;
+}
+
+static int _crono_miscdev_register(struct crono_miscdev *new_crono_miscdev,
+                                   struct crono_miscdev **crono_dev) {
+
+        int ret = CRONO_SUCCESS;
 
+        // Generate the device name
         CRONO_CONSTRUCT_MISCDEV_NAME(new_crono_miscdev->name,
                                      new_crono_miscdev->device_id,
                                      new_crono_miscdev->dbdf);
@@ -266,9 +672,27 @@ static int _crono_miscdev_init(struct pci_dev *dev,
         new_crono_miscdev->miscdev.minor = MISC_DYNAMIC_MINOR;
         new_crono_miscdev->miscdev.fops = &crono_miscdev_fops;
         new_crono_miscdev->miscdev.name = new_crono_miscdev->name;
+        new_crono_miscdev->miscdev.groups = crono_miscdev_groups;
 
-        pr_info("Initializing cronologic miscdev driver: <%s>...",
-                new_crono_miscdev->name);
+        // Allocate statistics before registering, they are shown in sysfs
+        new_crono_miscdev->stats = alloc_percpu(struct crono_dev_stats);
+        if (NULL == new_crono_miscdev->stats) {
+                pr_err("Error allocating device statistics");
+                ret = -ENOMEM;
+                goto init_err;
+        }
+        dev_set_drvdata(new_crono_miscdev->dma_dev, new_crono_miscdev);
+        new_crono_miscdev->contig_pool = _crono_reserve_pool(
+            new_crono_miscdev, contig_pool_size, PAGE_SHIFT);
+        new_crono_miscdev->block_arena =
+            _crono_reserve_pool(new_crono_miscdev, block_arena_size,
+                                ilog2(CRONO_BLOCK_MIN_ALIGNMENT));
+        _crono_contig_cache_init(new_crono_miscdev);
+        _crono_status_page_init(new_crono_miscdev);
+        _crono_ring_init(new_crono_miscdev);
+
+        pr_debug("Initializing cronologic miscdev driver: <%s>...",
+                 new_crono_miscdev->name);
 
         // Register the device driver
         ret = misc_register(&(new_crono_miscdev->miscdev));
@@ -277,9 +701,11 @@ static int _crono_miscdev_init(struct pci_dev *dev,
                        new_crono_miscdev->miscdev.name, ret);
                 goto init_err;
         }
-
-        // Increments the new index in the pool for the new device
-        crono_miscdev_pool_new_index++;
+        new_crono_miscdev->debugfs_dir =
+            debugfs_create_dir(new_crono_miscdev->name, crono_debugfs_root);
+        debugfs_create_file("histograms", 0444, new_crono_miscdev->debugfs_dir,
+                            new_crono_miscdev,
+                            &crono_debugfs_histograms_fops);
 
         // Log and return
         *crono_dev = new_crono_miscdev;
@@ -287,22 +713,28 @@ static int _crono_miscdev_init(struct pci_dev *dev,
 
 init_err:
         // Reset object
-        if (NULL != new_crono_miscdev) {
-                RESET_CRONO_MISCDEV(new_crono_miscdev);
-        }
+        dev_set_drvdata(new_crono_miscdev->dma_dev, NULL);
+        free_percpu(new_crono_miscdev->stats);
+        _crono_status_page_exit(new_crono_miscdev);
+        // Nothing is allocated from the pools of an unregistered device
+        _crono_release_pool(new_crono_miscdev->contig_pool);
+        _crono_release_pool(new_crono_miscdev->block_arena);
+        _crono_miscdev_unclaim(new_crono_miscdev);
         return ret;
 }
 
 static long crono_miscdev_ioctl(struct file *filp, unsigned int cmd,
                                 unsigned long arg) {
         int ret = CRONO_SUCCESS;
+        u64 start_ns = ktime_get_ns();
 
         pr_debug("ioctl is called for command <0x%x>, PID <%d>", cmd,
                  task_pid_nr(current));
 
         switch (cmd) {
         case IOCTL_CRONO_LOCK_BUFFER: // 0xc0086300
-                ret = _crono_miscdev_ioctl_lock_sg_buffer(filp, arg);
+                ret = _crono_miscdev_ioctl_lock_sg_buffer(
+                    filp, arg, sizeof(CRONO_SG_BUFFER_INFO));
                 break;
         case IOCTL_CRONO_UNLOCK_BUFFER: // 0xc0086301
                 ret = _crono_miscdev_ioctl_unlock_sg_buffer(filp, arg);
@@ -316,14 +748,193 @@ static long crono_miscdev_ioctl(struct file *filp, unsigned int cmd,
         case IOCTL_CRONO_UNLOCK_CONTIG_BUFFER: // 0xc0086304
                 ret = _crono_miscdev_ioctl_unlock_contig_buffer(filp, arg);
                 break;
+        case IOCTL_CRONO_BUILD_SG_DESC_TABLE: // 0xc0086305
+                ret = _crono_miscdev_ioctl_build_sg_desc_table(filp, arg);
+                break;
+        case IOCTL_CRONO_LOCK_BUFFER_EX: // 0xc0086306
+                ret = _crono_miscdev_ioctl_lock_sg_buffer(
+                    filp, arg, sizeof(CRONO_SG_BUFFER_LOCK_INFO));
+                break;
+        case IOCTL_CRONO_SYNC_BUFFER_FOR_CPU: // 0xc0086307
+                ret = _crono_miscdev_ioctl_sync_sg_buffer(filp, arg, true);
+                break;
+        case IOCTL_CRONO_SYNC_BUFFER_FOR_DEVICE: // 0xc0086308
+                ret = _crono_miscdev_ioctl_sync_sg_buffer(filp, arg, false);
+                break;
+        case IOCTL_CRONO_ALLOC_CONTIG_BLOCK: // 0xc0086309
+                ret = _crono_miscdev_ioctl_alloc_contig_block(filp, arg);
+                break;
+        case IOCTL_CRONO_WAIT_TEARDOWN: // 0x630a
+                // Waits for the buffers queued before the call
+                flush_work(&crono_teardown_work);
+                break;
+        case IOCTL_CRONO_SET_BUFFER_TPH: // 0xc008630b
+                ret = _crono_miscdev_ioctl_set_buffer_tph(filp, arg);
+                break;
+        case IOCTL_CRONO_GET_DEV_CAPS: // 0xc008630c
+                ret = _crono_miscdev_ioctl_get_dev_caps(filp, arg);
+                break;
+        case IOCTL_CRONO_RING_SETUP: // 0xc008630d
+                ret = _crono_miscdev_ioctl_ring_setup(filp, arg);
+                break;
+        case IOCTL_CRONO_RING_PRODUCE: // 0xc008630e
+                ret = _crono_miscdev_ioctl_ring_move(filp, arg, true);
+                break;
+        case IOCTL_CRONO_RING_CONSUME: // 0xc008630f
+                ret = _crono_miscdev_ioctl_ring_move(filp, arg, false);
+                break;
+        case IOCTL_CRONO_LOCK_FD_BUFFER: // 0xc0086310
+                ret = _crono_miscdev_ioctl_lock_fd_buffer(filp, arg);
+                break;
         default:
                 pr_err("Error, unsupported ioctl command <%d>", cmd);
                 ret = -ENOTTY;
                 break;
         }
+        if (trace_crono_ioctl_enabled())
+                _crono_trace_ioctl(filp, cmd, arg, ret, start_ns);
         return ret;
 }
 
+static void _crono_trace_ioctl(struct file *filp, unsigned int cmd,
+                               unsigned long arg, int ret, u64 start_ns) {
+        u64 duration_ns = ktime_get_ns() - start_ns;
+        union {
+                int id;
+                CRONO_SG_BUFFER_LOCK_INFO lock;
+                CRONO_CONTIG_BUFFER_INFO contig;
+                CRONO_KERNEL_CMDS_INFO cmds;
+                CRONO_SG_DESC_TABLE_INFO desc;
+                CRONO_SG_BUFFER_SYNC_INFO sync;
+                CRONO_CONTIG_BLOCK_INFO block;
+                CRONO_SG_BUFFER_TPH_INFO tph;
+                CRONO_RING_SETUP_INFO ring;
+                CRONO_RING_POS ring_pos;
+                CRONO_FD_BUFFER_LOCK_INFO fd_lock;
+        } info;
+        size_t arg_size;
+        int id = -1, id2 = -1;
+        u64 offset = 0, size = 0;
+        u32 flags = 0, dir = 0, attrs = 0;
+
+        switch (cmd) {
+        case IOCTL_CRONO_LOCK_BUFFER:
+                arg_size = sizeof(CRONO_SG_BUFFER_INFO);
+                break;
+        case IOCTL_CRONO_LOCK_BUFFER_EX:
+                arg_size = sizeof(CRONO_SG_BUFFER_LOCK_INFO);
+                break;
+        case IOCTL_CRONO_UNLOCK_BUFFER:
+        case IOCTL_CRONO_UNLOCK_CONTIG_BUFFER:
+                arg_size = sizeof(int);
+                break;
+        case IOCTL_CRONO_LOCK_CONTIG_BUFFER:
+                arg_size = sizeof(CRONO_CONTIG_BUFFER_INFO);
+                break;
+        case IOCTL_CRONO_CLEANUP_SETUP:
+                arg_size = sizeof(CRONO_KERNEL_CMDS_INFO);
+                break;
+        case IOCTL_CRONO_BUILD_SG_DESC_TABLE:
+                arg_size = sizeof(CRONO_SG_DESC_TABLE_INFO);
+                break;
+        case IOCTL_CRONO_SYNC_BUFFER_FOR_CPU:
+        case IOCTL_CRONO_SYNC_BUFFER_FOR_DEVICE:
+                arg_size = sizeof(CRONO_SG_BUFFER_SYNC_INFO);
+                break;
+        case IOCTL_CRONO_ALLOC_CONTIG_BLOCK:
+                arg_size = sizeof(CRONO_CONTIG_BLOCK_INFO);
+                break;
+        case IOCTL_CRONO_SET_BUFFER_TPH:
+                arg_size = sizeof(CRONO_SG_BUFFER_TPH_INFO);
+                break;
+        case IOCTL_CRONO_RING_SETUP:
+                arg_size = sizeof(CRONO_RING_SETUP_INFO);
+                break;
+        case IOCTL_CRONO_RING_PRODUCE:
+        case IOCTL_CRONO_RING_CONSUME:
+                arg_size = sizeof(CRONO_RING_POS);
+                break;
+        case IOCTL_CRONO_LOCK_FD_BUFFER:
+                arg_size = sizeof(CRONO_FD_BUFFER_LOCK_INFO);
+                break;
+        default:
+                arg_size = 0;
+                break;
+        }
+
+        // Read the arguments back, including the ids filled by the module
+        memset(&info, 0, sizeof(info));
+        if (0 == arg || 0 == arg_size ||
+            copy_from_user(&info, (void __user *)arg, arg_size))
+                arg_size = 0;
+        if (arg_size) {
+                switch (cmd) {
+                case IOCTL_CRONO_LOCK_BUFFER:
+                case IOCTL_CRONO_LOCK_BUFFER_EX:
+                        // Extended members are zeros for `LOCK_BUFFER`
+                        id = info.lock.buff_info.id;
+                        size = info.lock.buff_info.size;
+                        flags = info.lock.flags;
+                        dir = info.lock.dma_dir;
+                        attrs = info.lock.dma_attrs;
+                        break;
+                case IOCTL_CRONO_UNLOCK_BUFFER:
+                case IOCTL_CRONO_UNLOCK_CONTIG_BUFFER:
+                        id = info.id;
+                        break;
+                case IOCTL_CRONO_LOCK_CONTIG_BUFFER:
+                        id = info.contig.id;
+                        size = info.contig.size;
+                        break;
+                case IOCTL_CRONO_CLEANUP_SETUP:
+                        size = info.cmds.count;
+                        break;
+                case IOCTL_CRONO_BUILD_SG_DESC_TABLE:
+                        id = info.desc.sg_id;
+                        id2 = info.desc.table.id;
+                        size = info.desc.table.size;
+                        flags = info.desc.format;
+                        break;
+                case IOCTL_CRONO_ALLOC_CONTIG_BLOCK:
+                        id = info.block.id;
+                        offset = info.block.offset;
+                        size = info.block.size;
+                        flags = info.block.alignment;
+                        break;
+                case IOCTL_CRONO_SET_BUFFER_TPH:
+                        id = info.tph.id;
+                        id2 = info.tph.st_index;
+                        flags = info.tph.cpu;
+                        break;
+                case IOCTL_CRONO_RING_SETUP:
+                        size = info.ring.size;
+                        flags = info.ring.flags;
+                        break;
+                case IOCTL_CRONO_RING_PRODUCE:
+                case IOCTL_CRONO_RING_CONSUME:
+                        offset = info.ring_pos.head;
+                        size = info.ring_pos.bytes;
+                        break;
+                case IOCTL_CRONO_LOCK_FD_BUFFER:
+                        id = info.fd_lock.lock_info.buff_info.id;
+                        id2 = info.fd_lock.fd;
+                        offset = info.fd_lock.offset;
+                        size = info.fd_lock.lock_info.buff_info.size;
+                        flags = info.fd_lock.lock_info.flags;
+                        dir = info.fd_lock.lock_info.dma_dir;
+                        attrs = info.fd_lock.lock_info.dma_attrs;
+                        break;
+                default:
+                        id = info.sync.id;
+                        offset = info.sync.offset;
+                        size = info.sync.size;
+                        break;
+                }
+        }
+        trace_crono_ioctl(iminor(file_inode(filp)), cmd, id, id2, offset, size,
+                          flags, dir, attrs, ret, duration_ns);
+}
+
 /**
  * @brief
  * - Allocate memory, pin it.
@@ -336,22 +947,61 @@ static long crono_miscdev_ioctl(struct file *filp, unsigned int cmd,
  * @param filp
  * Of the device
  * @param arg
- * `CRONO_SG_BUFFER_INFO`
+ * `CRONO_SG_BUFFER_INFO` or `CRONO_SG_BUFFER_LOCK_INFO`
+ * @param arg_size
+ * Size of the object `arg` points to. `CRONO_SG_BUFFER_INFO` is the first
+ * member of `CRONO_SG_BUFFER_LOCK_INFO`, so the other members are zeros when
+ * `arg` is `CRONO_SG_BUFFER_INFO`.
  * @return int
  * `CRONO_SUCCESS` or error code.
  */
 static int _crono_miscdev_ioctl_lock_sg_buffer(struct file *filp,
-                                               unsigned long arg) {
+                                               unsigned long arg,
+                                               size_t arg_size) {
+        int ret;
+        CRONO_SG_BUFFER_LOCK_INFO lock_info;
+        struct crono_miscdev *crono_dev = NULL;
+
+        pr_debug("Locking buffer...");
+
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(filp, &crono_dev))) {
+                return ret;
+        }
+
+        // Copy lock information from user space to kernel space
+        if (0 == arg) {
+                pr_err("Invalid parameter `arg` locking buffer");
+                CRONO_STAT_INC(crono_dev, lock_errors);
+                return -EINVAL;
+        }
+        memset(&lock_info, 0, sizeof(CRONO_SG_BUFFER_LOCK_INFO));
+        if (copy_from_user(&lock_info, (void __user *)arg, arg_size)) {
+                pr_err("Error copying user data");
+                CRONO_STAT_INC(crono_dev, lock_errors);
+                return -EFAULT;
+        }
+        return _crono_lock_sg_buffer(filp, crono_dev, &lock_info, arg, arg_size,
+                                     NULL, 0);
+}
+
+static int _crono_lock_sg_buffer(struct file *filp,
+                                 struct crono_miscdev *crono_dev,
+                                 CRONO_SG_BUFFER_LOCK_INFO *lock_info,
+                                 unsigned long arg, size_t arg_size,
+                                 struct file *backing_file,
+                                 u64 backing_offset) {
         int ret;
         CRONO_SG_BUFFER_INFO_WRAPPER *buff_wrapper = NULL;
+        u64 start_ns;
 #ifdef CRONO_DEBUG_ENABLED
         int ipage, loop_count;
 #endif
-        pr_debug("Locking buffer...");
 
         // Validate, initialize, and lock variables
-        if (CRONO_SUCCESS !=
-            (ret = _crono_init_sg_buff_wrapper(filp, arg, &buff_wrapper))) {
+        if (CRONO_SUCCESS != (ret = _crono_init_sg_buff_wrapper(
+                                  filp, lock_info, &buff_wrapper))) {
+                CRONO_STAT_INC(crono_dev, lock_errors);
                 return ret;
         }
 
@@ -359,19 +1009,61 @@ static int _crono_miscdev_ioctl_lock_sg_buffer(struct file *filp,
         pr_debug("Buffer: address <0x%p>, size <%ld>, PID <%d>",
                  buff_wrapper->buff_info.addr, buff_wrapper->buff_info.size,
                  task_pid_nr(current));
+        trace_crono_lock_begin(buff_wrapper->buff_info.id,
+                               buff_wrapper->buff_info.size,
+                               buff_wrapper->buff_info.pages_count);
+        start_ns = ktime_get_ns();
         if (CRONO_SUCCESS != (ret = _crono_miscdev_ioctl_pin_buffer(
                                   filp, buff_wrapper, GUP_NR_PER_CALL))) {
                 goto lock_err;
         }
+        _crono_stat_latency(crono_dev, CRONO_STAT_OP_PIN, start_ns);
+        if (backing_file &&
+            CRONO_SUCCESS !=
+                (ret = _crono_check_file_pages(buff_wrapper, backing_file,
+                                               backing_offset))) {
+                goto lock_err;
+        }
 
         // Fill the Scatter/Gather list
         if (CRONO_SUCCESS !=
             (ret = _crono_miscdev_ioctl_generate_sg(filp, buff_wrapper))) {
                 goto lock_err;
         }
+        lock_info->dma_segments_count = buff_wrapper->mapped_nents;
+
+        // Report bounce buffering, it silently costs a CPU copy of every
+        // transfer.
+        lock_info->bounced_segments_count =
+            _crono_count_bounced_segments(buff_wrapper);
+        if (lock_info->bounced_segments_count) {
+                pr_warn("Buffer wrapper <%d>: <%u> of <%d> DMA segments are "
+                        "bounce buffered by swiotlb, check the IOMMU and DMA "
+                        "mask settings",
+                        buff_wrapper->buff_info.id,
+                        lock_info->bounced_segments_count,
+                        buff_wrapper->mapped_nents);
+                atomic_inc(&crono_dev->bounced_buffers_count);
+                atomic_add(lock_info->bounced_segments_count,
+                           &crono_dev->bounced_segments_count);
+                if (buff_wrapper->flags & CRONO_SG_LOCK_FLAG_NO_BOUNCE) {
+                        ret = -EIO;
+                        goto lock_err;
+                }
+        }
+        if (buff_wrapper->flags & CRONO_SG_LOCK_FLAG_SINGLE_IOVA) {
+                if (CRONO_SUCCESS != (ret = _crono_get_single_iova(
+                                          buff_wrapper, &lock_info->iova_base,
+                                          &lock_info->iova_size))) {
+                        goto lock_err;
+                }
+        }
 
-        // Copy pinned pages physical address to user space
-        if (copy_to_user((void __user *)(buff_wrapper->buff_info.upages),
+        // Copy pinned pages physical address to user space, if requested.
+        // Otherwise, userspace maps the table using
+        // `CRONO_MMAP_TYPE_SG_ADDR_TABLE`.
+        if (buff_wrapper->buff_info.upages &&
+            copy_to_user((void __user *)(buff_wrapper->buff_info.upages),
                          buff_wrapper->userspace_pages,
                          buff_wrapper->buff_info.pages_count *
                              sizeof(DMA_ADDR))) {
@@ -381,8 +1073,12 @@ static int _crono_miscdev_ioctl_lock_sg_buffer(struct file *filp,
         }
 
         // Copy back all data to userspace memory
-        if (copy_to_user((void __user *)arg, &(buff_wrapper->buff_info),
-                         sizeof(CRONO_SG_BUFFER_INFO))) {
+        lock_info->buff_info = buff_wrapper->buff_info;
+        if (backing_file) {
+                // The file range is unmapped by the caller once pinned
+                lock_info->buff_info.addr = NULL;
+        }
+        if (copy_to_user((void __user *)arg, lock_info, arg_size)) {
                 pr_err("Error copying buffer information back to user space");
                 ret = -EFAULT;
                 goto lock_err;
@@ -399,17 +1095,139 @@ static int _crono_miscdev_ioctl_lock_sg_buffer(struct file *filp,
                          ipage, buff_wrapper->userspace_pages[ipage]);
         }
 #endif
-        pr_info("Done locking buffer: wrapper id <%d>",
-                buff_wrapper->buff_info.id);
+        pr_debug("Done locking buffer: wrapper id <%d>",
+                 buff_wrapper->buff_info.id);
+        CRONO_STAT_INC(crono_dev, locks);
+        trace_crono_lock_end(buff_wrapper->buff_info.id, CRONO_SUCCESS,
+                             buff_wrapper->mapped_nents);
 
         // Cleanup
         return CRONO_SUCCESS;
 
 lock_err:
-        _crono_release_buff_wrapper(buff_wrapper);
+        CRONO_STAT_INC(crono_dev, lock_errors);
+        trace_crono_lock_end(buff_wrapper->buff_info.id, ret,
+                             buff_wrapper->mapped_nents);
+        _crono_drop_buff_wrapper(buff_wrapper);
+        return ret;
+}
+
+static int _crono_miscdev_ioctl_lock_fd_buffer(struct file *filp,
+                                               unsigned long arg) {
+        int ret;
+        CRONO_FD_BUFFER_LOCK_INFO fd_info;
+        struct crono_miscdev *crono_dev = NULL;
+        struct file *buff_file;
+        unsigned long addr, mapped_size, align;
+        unsigned long prot;
+
+        pr_debug("Locking file buffer...");
+
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(filp, &crono_dev))) {
+                return ret;
+        }
+        if (copy_from_user(&fd_info, (void __user *)arg,
+                           sizeof(CRONO_FD_BUFFER_LOCK_INFO))) {
+                pr_err("Error copying user data");
+                CRONO_STAT_INC(crono_dev, lock_errors);
+                return -EFAULT;
+        }
+        if (NULL != fd_info.lock_info.buff_info.addr ||
+            0 == fd_info.lock_info.buff_info.size || 0 != fd_info.reserved ||
+            (fd_info.offset & ~PAGE_MASK)) {
+                pr_err("Invalid file buffer: size <%zu>, offset <%llu>",
+                       fd_info.lock_info.buff_info.size, fd_info.offset);
+                CRONO_STAT_INC(crono_dev, lock_errors);
+                return -EINVAL;
+        }
+
+        // Only memory backed files, pinning other files pages would block
+        // their writeback
+        buff_file = fget(fd_info.fd);
+        if (NULL == buff_file) {
+                CRONO_STAT_INC(crono_dev, lock_errors);
+                return -EBADF;
+        }
+        if (!shmem_file(buff_file) && !is_file_hugepages(buff_file)) {
+                pr_err("File <%d> is not a memfd, shmem or hugetlbfs file",
+                       fd_info.fd);
+                ret = -EINVAL;
+                goto lock_err;
+        }
+
+        // hugetlbfs files are mapped in huge pages only
+        align = is_file_hugepages(buff_file)
+                    ? huge_page_size(hstate_file(buff_file))
+                    : PAGE_SIZE;
+        if (fd_info.offset & (align - 1)) {
+                pr_err("File <%d> offset <%llu> is not aligned to its page "
+                       "size <%lu>",
+                       fd_info.fd, fd_info.offset, align);
+                ret = -EINVAL;
+                goto lock_err;
+        }
+
+        // Map writable only if the device writes into the buffer, so files
+        // opened read-only can be sent to the device
+        prot = PROT_READ;
+        if (CRONO_DMA_TO_DEVICE != fd_info.lock_info.dma_dir)
+                prot |= PROT_WRITE;
+        if (!(buff_file->f_mode & FMODE_READ) ||
+            ((prot & PROT_WRITE) && !(buff_file->f_mode & FMODE_WRITE))) {
+                pr_err("File <%d> is not opened for DMA direction <%u>",
+                       fd_info.fd, fd_info.lock_info.dma_dir);
+                ret = -EACCES;
+                goto lock_err;
+        }
+
+        // Map the file range in the caller, only until its pages are pinned.
+        // The mapping is visible to the other threads of the caller, which
+        // might replace it meanwhile, so the pinned pages are checked to be
+        // the file pages, not trusting the address.
+        mapped_size = ALIGN(fd_info.lock_info.buff_info.size, align);
+        addr = vm_mmap(buff_file, 0, mapped_size, prot, MAP_SHARED,
+                       fd_info.offset);
+        if (IS_ERR_VALUE(addr)) {
+                pr_err("Error mapping file <%d>: <%ld>", fd_info.fd,
+                       (long)addr);
+                ret = (int)addr;
+                goto lock_err;
+        }
+        fd_info.lock_info.buff_info.addr = (void *)addr;
+
+        // `lock_info` is the first member, copied back alone
+        ret = _crono_lock_sg_buffer(filp, crono_dev, &fd_info.lock_info, arg,
+                                    sizeof(CRONO_SG_BUFFER_LOCK_INFO),
+                                    buff_file, fd_info.offset);
+        vm_munmap(addr, mapped_size);
+        fput(buff_file);
+        return ret;
+
+lock_err:
+        fput(buff_file);
+        CRONO_STAT_INC(crono_dev, lock_errors);
         return ret;
 }
 
+static int _crono_check_file_pages(const CRONO_SG_BUFFER_INFO_WRAPPER *bw,
+                                   struct file *file, u64 offset) {
+        struct page *page;
+        uint32_t ipage;
+
+        for (ipage = 0; ipage < bw->pinned_pages_nr; ipage++) {
+                page = (struct page *)bw->kernel_pages[ipage];
+                if (compound_head(page)->mapping != file->f_mapping ||
+                    page_to_pgoff(page) != (offset >> PAGE_SHIFT) + ipage) {
+                        pr_err("Buffer wrapper <%d>: page <%u> is not of the "
+                               "file range, it was remapped while locking",
+                               bw->buff_info.id, ipage);
+                        return -EAGAIN;
+                }
+        }
+        return CRONO_SUCCESS;
+}
+
 static int
 _crono_miscdev_ioctl_pin_buffer(struct file *filp,
                                 CRONO_SG_BUFFER_INFO_WRAPPER *buff_wrapper,
@@ -423,12 +1241,15 @@ _crono_miscdev_ioctl_pin_buffer(struct file *filp,
 #endif
         long actual_pinned_nr_of_call; // Never unsigned, as it might contain
                                        // error returned
+        unsigned int gup_flags;
         int ret = CRONO_SUCCESS;
         // int page_index;
 
         pr_debug("Pinning buffer...");
 
         // Validate parameters
+        // On error, the pinned pages are released by the caller, using
+        // `_crono_release_buff_wrapper`.
         LOGERR_RET_EINVAL_IF_NULL(buff_wrapper,
                                   "Invalid lock buffer parameters");
 
@@ -451,6 +1272,9 @@ _crono_miscdev_ioctl_pin_buffer(struct file *filp,
                  buff_wrapper->buff_info.pages_count,
                  buff_wrapper->buff_info.pages_count * sizeof(void *));
 
+        // Pages only read by the device can be pinned read-only, e.g. of files
+        // opened read-only
+        gup_flags = (DMA_TO_DEVICE == buff_wrapper->dma_dir) ? 0 : FOLL_WRITE;
         start_addr_to_pin = (__u64)buff_wrapper->buff_info.addr;
 #ifndef OLD_KERNEL_FOR_PIN
         // https://elixir.bootlin.com/linux/v5.6/source/include/linux/mm.h#L1508
@@ -472,19 +1296,13 @@ _crono_miscdev_ioctl_pin_buffer(struct file *filp,
                         nr_per_call =
                             (next_pages_addr - start_addr_to_pin) / PAGE_SIZE;
                 }
-#ifndef KERNEL_6_5_OR_LATER
-#pragma message("Kernel version is older than 6.5 but newer than 5.5")
-                actual_pinned_nr_of_call = pin_user_pages(
-                    start_addr_to_pin, nr_per_call, FOLL_WRITE,
-                    (struct page **)(buff_wrapper->kernel_pages) +
-                        buff_wrapper->pinned_pages_nr, NULL);
-#else                        
-                actual_pinned_nr_of_call = pin_user_pages_fast(
-                    start_addr_to_pin, nr_per_call, FOLL_WRITE,
+                actual_pinned_nr_of_call = _crono_pin_user_pages(
+                    start_addr_to_pin, nr_per_call, gup_flags,
                     (struct page **)(buff_wrapper->kernel_pages) +
                         buff_wrapper->pinned_pages_nr);
-#endif                        
-
+                trace_crono_pin_chunk(buff_wrapper->buff_info.id,
+                                      start_addr_to_pin, nr_per_call,
+                                      actual_pinned_nr_of_call);
 
                 if (actual_pinned_nr_of_call < 0) {
                         // Error
@@ -511,16 +1329,15 @@ _crono_miscdev_ioctl_pin_buffer(struct file *filp,
                 buff_wrapper->pinned_pages_nr += actual_pinned_nr_of_call;
         }
 #else
-#pragma message("Kernel version is older than 5.6")
-        // https://elixir.bootlin.com/linux/v4.9/source/include/linux/mm.h#L1278
-        down_read(&current->mm->mmap_sem);
         pr_debug(
             "Calling get_user_pages: address <0x%lx>, number of pages: <%d>",
             start_addr_to_pin, buff_wrapper->buff_info.pages_count);
-        actual_pinned_nr_of_call = get_user_pages(
-            start_addr_to_pin, buff_wrapper->buff_info.pages_count,
-            (FOLL_WRITE | FOLL_FORCE),
-            (struct page **)(buff_wrapper->kernel_pages), NULL);
+        actual_pinned_nr_of_call = _crono_pin_user_pages(
+            start_addr_to_pin, buff_wrapper->buff_info.pages_count, gup_flags,
+            (struct page **)(buff_wrapper->kernel_pages));
+        trace_crono_pin_chunk(buff_wrapper->buff_info.id, start_addr_to_pin,
+                              buff_wrapper->buff_info.pages_count,
+                              actual_pinned_nr_of_call);
         if (actual_pinned_nr_of_call >= 0) {
                 pr_debug(
                     "get_user_pages is called successfully with return <%ld>",
@@ -529,19 +1346,18 @@ _crono_miscdev_ioctl_pin_buffer(struct file *filp,
         } else {
                 pr_err("get_user_pages is called with error return <%ld>",
                        actual_pinned_nr_of_call);
-                up_read(&current->mm->mmap_sem);
-                _crono_release_buff_wrapper(buff_wrapper);
                 return -EFAULT;
         }
-        up_read(&current->mm->mmap_sem);
 #endif
+        // Unaccounted when unpinned in `_crono_release_sg_buff_wrapper`
+        CRONO_STAT_ADD(CRONO_MISCDEV_OF_BW(buff_wrapper), pinned_bytes,
+                       (s64)buff_wrapper->pinned_pages_nr * PAGE_SIZE);
 
         // Validate the number of pinned pages
         if (buff_wrapper->pinned_pages_nr <
             buff_wrapper->buff_info.pages_count) {
                 // Apparently not enough memory to pin the whole buffer
                 pr_err("Error insufficient available pages to pin");
-                _crono_release_buff_wrapper(buff_wrapper);
                 if (CRONO_SUCCESS == ret)
                         return -EFAULT;
                 else
@@ -583,34 +1399,63 @@ _crono_miscdev_ioctl_pin_buffer(struct file *filp,
         return ret;
 }
 
+static long _crono_pin_user_pages(unsigned long start, unsigned long nr_pages,
+                                  unsigned int gup_flags,
+                                  struct page **pages) {
+#ifdef OLD_KERNEL_FOR_PIN
+        long pinned_nr;
+#endif
+        CRONO_KUNIT_STUB_REDIRECT(_crono_pin_user_pages, start, nr_pages,
+                                  gup_flags, pages);
+
+#ifndef OLD_KERNEL_FOR_PIN
+#ifndef KERNEL_6_5_OR_LATER
+#pragma message("Kernel version is older than 6.5 but newer than 5.5")
+        return pin_user_pages(start, nr_pages, gup_flags, pages, NULL);
+#else
+        return pin_user_pages_fast(start, nr_pages, gup_flags, pages);
+#endif
+#else
+#pragma message("Kernel version is older than 5.6")
+        // https://elixir.bootlin.com/linux/v4.9/source/include/linux/mm.h#L1278
+        down_read(&current->mm->mmap_sem);
+        pinned_nr = get_user_pages(start, nr_pages, (gup_flags | FOLL_FORCE),
+                                   pages, NULL);
+        up_read(&current->mm->mmap_sem);
+        return pinned_nr;
+#endif
+}
+
 static int _crono_miscdev_ioctl_unlock_sg_buffer(struct file *filp,
                                                  unsigned long arg) {
         int ret = CRONO_SUCCESS;
         int wrapper_id = -1;
         CRONO_SG_BUFFER_INFO_WRAPPER *found_buff_wrapper = NULL;
-        CRONO_SG_BUFFER_INFO_WRAPPER *temp_buff_wrapper = NULL;
-        struct list_head *pos, *n;
+        struct crono_miscdev *crono_dev = NULL;
+
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(filp, &crono_dev))) {
+                return ret;
+        }
 
         // Lock the memory from user space to kernel space
         if (0 == arg) {
                 pr_err("Invalid parameter `arg` unlocking buffer");
+                CRONO_STAT_INC(crono_dev, unlock_errors);
                 return -EINVAL;
         }
         if (copy_from_user(&wrapper_id, (void __user *)arg, sizeof(int))) {
                 pr_err("Error copying user data");
+                CRONO_STAT_INC(crono_dev, unlock_errors);
                 return -EFAULT;
         }
         pr_debug("Unlocking buffer of wrapper id <%d>...", wrapper_id);
 
-        // Find the related buffer_wrapper in the list
+        // Find the related buffer_wrapper in the list, and remove it, so
+        // concurrent unlocks of the same id don't find it
         _crono_debug_list_wrappers();
-        list_for_each_safe(pos, n, &sg_buff_wrappers_head) {
-                temp_buff_wrapper =
-                    list_entry(pos, CRONO_SG_BUFFER_INFO_WRAPPER, ntrn.list);
-                if (temp_buff_wrapper->buff_info.id == wrapper_id)
-                        found_buff_wrapper = temp_buff_wrapper;
-        }
-        if (NULL == found_buff_wrapper) {
+        if (CRONO_SUCCESS != get_sg_bw(wrapper_id, true, &found_buff_wrapper)) {
+                CRONO_STAT_INC(crono_dev, unlock_errors);
                 pr_warn("Buffer Wrapper of id <%d> is not found in "
                         "internal list",
                         wrapper_id);
@@ -624,17 +1469,19 @@ static int _crono_miscdev_ioctl_unlock_sg_buffer(struct file *filp,
                          found_buff_wrapper->buff_info.id);
         }
 
-        // Clean up buffer memory allocated in the kernel module
-        ret = _crono_release_buff_wrapper(found_buff_wrapper);
+        // Clean up buffer memory allocated in the kernel module, and free
+        // the wrapper after all members cleanup is done
+        ret = _crono_teardown_buff_wrapper(found_buff_wrapper);
 
         // Copy back just to obey DMA APIs rules
         if (copy_to_user((void __user *)arg, &wrapper_id, sizeof(int))) {
                 ret = -EFAULT;
         }
 
-        // Free the wrapper after all members cleanup is done
-        kvfree(found_buff_wrapper);
-
+        if (CRONO_SUCCESS == ret)
+                CRONO_STAT_INC(crono_dev, unlocks);
+        else
+                CRONO_STAT_INC(crono_dev, unlock_errors);
         return ret;
 }
 
@@ -696,11 +1543,13 @@ static int
 _crono_miscdev_ioctl_generate_sg(struct file *filp,
                                  CRONO_SG_BUFFER_INFO_WRAPPER *buff_wrapper) {
 
-        struct pci_dev *devp;
+        struct device *devp;
         int ret;
         struct sg_table *sgt = NULL;
         int mapped_buffers_count = 0;
         struct scatterlist *sg;
+        struct crono_miscdev *crono_dev = CRONO_MISCDEV_OF_BW(buff_wrapper);
+        u64 start_ns;
 #ifdef USE__sg_alloc_table_from_pages
         int page_index;
         struct scatterlist *sg_from_pages = NULL;
@@ -730,7 +1579,7 @@ _crono_miscdev_ioctl_generate_sg(struct file *filp,
         ret = _crono_get_dev_from_filp(filp, &devp);
         if (ret != CRONO_SUCCESS) {
                 // Clean up
-                crono_kvfree(sgt);
+                crono_kvfree(buff_wrapper->sgt);
                 return ret;
         }
 
@@ -742,6 +1591,7 @@ _crono_miscdev_ioctl_generate_sg(struct file *filp,
                  "pages = <%d>...",
                  buff_wrapper->buff_info.size,
                  buff_wrapper->buff_info.pages_count);
+        start_ns = ktime_get_ns();
 #ifndef USE__sg_alloc_table_from_pages
         ret = sg_alloc_table_from_pages(
             sgt, // The sg table header to use
@@ -779,11 +1629,14 @@ _crono_miscdev_ioctl_generate_sg(struct file *filp,
                 pr_err("Error allocating SG table from pages");
 
                 // Clean up
-                crono_kvfree(sgt);
+                crono_kvfree(buff_wrapper->sgt);
 
                 return ret;
         }
         pr_debug("Done allocating SG Table");
+        trace_crono_sg_alloc(buff_wrapper->buff_info.id,
+                             buff_wrapper->buff_info.pages_count, sgt->nents);
+        _crono_stat_latency(crono_dev, CRONO_STAT_OP_GEN_SG, start_ns);
 
 #ifdef USE__sg_alloc_table_from_pages
         // Using `__sg_alloc_table_from_pages` results in `nents` number
@@ -798,21 +1651,29 @@ _crono_miscdev_ioctl_generate_sg(struct file *filp,
 #endif
 
         pr_debug("Mapping SG...");
+        start_ns = ktime_get_ns();
         mapped_buffers_count =
-            dma_map_sg(&devp->dev, sgt->sgl, sgt->nents, DMA_BIDIRECTIONAL);
+            dma_map_sg_attrs(devp, sgt->sgl, sgt->nents,
+                             buff_wrapper->dma_dir, buff_wrapper->dma_attrs);
+        trace_crono_dma_map(buff_wrapper->buff_info.id, sgt->nents,
+                            mapped_buffers_count, buff_wrapper->dma_dir);
         // `ret` is the number of DMA buffers to transfer. `dma_map_sg`
         // coalesces buffers that are adjacent to each other in memory,
-        // so `ret` may be less than nents.
-        if (mapped_buffers_count < 0) {
-                pr_err("Error mapping SG: <%d>", ret);
+        // so `ret` may be less than nents. It's 0 on error.
+        if (mapped_buffers_count <= 0) {
+                pr_err("Error mapping SG: <%d>", mapped_buffers_count);
+                CRONO_STAT_INC(crono_dev, map_errors);
 
                 // Clean up
                 sg_free_table(sgt); // Free sgl, even if it's chained
-                crono_kvfree(sgt);
+                crono_kvfree(buff_wrapper->sgt);
 
-                return ret;
+                return -EIO;
         }
         pr_debug("Done mapping SG");
+        _crono_stat_latency(crono_dev, CRONO_STAT_OP_MAP, start_ns);
+        CRONO_STAT_INC(crono_dev, maps);
+        buff_wrapper->mapped_nents = mapped_buffers_count;
 
         pr_debug("SG Table is allocated of scatter lists total nents "
                  "number <%d>"
@@ -849,26 +1710,30 @@ _crono_miscdev_ioctl_generate_sg(struct file *filp,
         return CRONO_SUCCESS;
 }
 
-/**
- * @brief
- * - Delete the wrapper from the list
- * - Free the wrapper object
- *
- * @param bw
- * Buffer Wrapper, is not valid upon exit, it's freed
- *
- * @return int
- */
-static int _crono_release_sg_buff_wrapper(CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
+static int _crono_unmap_sg_buff_wrapper(CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
+        CRONO_KUNIT_STUB_REDIRECT(_crono_unmap_sg_buff_wrapper, bw);
+
+        // Unmap Scatter/Gather list
+        dma_unmap_sg_attrs(bw->ntrn.devp, ((struct sg_table *)bw->sgt)->sgl,
+                           ((struct sg_table *)bw->sgt)->nents, bw->dma_dir,
+                           bw->dma_attrs);
+
+        // Clean allocated memory for Scatter/Gather list
+        pr_debug("Wrapper<%d>: Cleanup SG Table <%p>...", bw->buff_info.id,
+                 bw->sgt);
+        sg_free_table(bw->sgt);
+        crono_kvfree(bw->sgt);
+        bw->sgt = NULL;
+        pr_debug("Done cleanup wrapper <%d> SG Table", bw->buff_info.id);
+
+        return CRONO_SUCCESS;
+}
+
+static int _crono_unpin_sg_buff_wrapper(CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
 #ifdef OLD_KERNEL_FOR_PIN
         int ipage;
 #endif
-        if (NULL == bw || NULL == bw->kernel_pages) {
-                pr_debug("Nothing to clean for the buffer");
-                return CRONO_SUCCESS;
-        }
-        _crono_debug_list_wrappers();
-        PR_DEBUG_BW_INFO("Releasing buffer:", bw);
+        CRONO_KUNIT_STUB_REDIRECT(_crono_unpin_sg_buff_wrapper, bw);
 
 #ifndef OLD_KERNEL_FOR_PIN
         // Unpin pages
@@ -887,20 +1752,51 @@ static int _crono_release_sg_buff_wrapper(CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
         pr_debug("Done putting pages");
 #endif
 
-        if (NULL != bw->sgt) {
-                // Unmap Scatter/Gather list
-                dma_unmap_sg(
-                    &(bw->ntrn.devp->dev), ((struct sg_table *)bw->sgt)->sgl,
-                    ((struct sg_table *)bw->sgt)->nents, DMA_BIDIRECTIONAL);
+        return CRONO_SUCCESS;
+}
+
+/**
+ * @brief
+ * - Delete the wrapper from the list
+ * - Free the wrapper object
+ *
+ * @param bw
+ * Buffer Wrapper, is not valid upon exit, it's freed
+ *
+ * @return int
+ */
+static int _crono_release_sg_buff_wrapper(CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
+        struct crono_miscdev *crono_dev;
+        u64 start_ns;
 
-                // Clean allocated memory for Scatter/Gather list
-                pr_debug("Wrapper<%d>: Cleanup SG Table <%p>...",
-                         bw->buff_info.id, bw->sgt);
-                sg_free_table(bw->sgt);
-                crono_kvfree(bw->sgt);
-                pr_debug("Done cleanup wrapper <%d> SG Table",
-                         bw->buff_info.id);
+        if (NULL == bw) {
+                pr_debug("Nothing to clean for the buffer");
+                return CRONO_SUCCESS;
         }
+        _crono_debug_list_wrappers();
+        PR_DEBUG_BW_INFO("Releasing buffer:", bw);
+        crono_dev = CRONO_MISCDEV_OF_BW(bw);
+
+        // The wrapper is off the lists and its last reference is dropped, so
+        // emulated devices don't write into its pages anymore
+        CRONO_STAT_ADD(crono_dev, sg_buffers, -1);
+
+        // Unmap before unpinning, unmapping might copy bounce buffered data
+        // back into the pages
+        if (NULL != bw->sgt)
+                _crono_unmap_sg_buff_wrapper(bw);
+
+        // Pages array is not allocated if locking failed before pinning
+        if (NULL == bw->kernel_pages)
+                goto free_pages_tables;
+        start_ns = ktime_get_ns();
+        _crono_unpin_sg_buff_wrapper(bw);
+        _crono_stat_latency(crono_dev, CRONO_STAT_OP_UNPIN, start_ns);
+        CRONO_STAT_ADD(crono_dev, pinned_bytes,
+                       -(s64)bw->pinned_pages_nr * PAGE_SIZE);
+
+free_pages_tables:
+        _crono_uncharge_pinned_vm(bw);
 
         // Clean allocated memory for kernel pages
         pr_debug("Wrapper<%d>: Cleanup kernel pages <%p>...", bw->buff_info.id,
@@ -914,15 +1810,12 @@ static int _crono_release_sg_buff_wrapper(CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
         crono_kvfree(bw->userspace_pages);
         pr_debug("Done cleanup wrapper <%d> userspace pages", bw->buff_info.id);
 
-        // Delete the wrapper from the list
-        pr_debug("Wrapper<%d>: Deleting from list...", bw->buff_info.id);
-        list_del(&(bw->ntrn.list));
-        pr_debug("Done deleting wrapper <%d> from list", bw->buff_info.id);
         // Don't free `bw` here, caller should free it.
         // kvfree(bw) crashes here.
 
         // Success
-        pr_info("Done releasing buffer: wrapper id <%d>", bw->buff_info.id);
+        pr_debug("Done releasing buffer: wrapper id <%d>", bw->buff_info.id);
+        trace_crono_unlock(bw->buff_info.id, BWT_SG, bw->buff_info.size);
         _crono_debug_list_wrappers();
         return CRONO_SUCCESS;
 }
@@ -949,15 +1842,23 @@ _crono_release_contig_buff_wrapper(CRONO_CONTIG_BUFFER_INFO_WRAPPER *bw) {
         PR_DEBUG_BW_INFO("Releasing contiguous buffer:", bw);
 
         pr_debug("Wrapper<%d>: Cleanup kernel memory...", bw->buff_info.id);
-        dma_free_coherent(&bw->ntrn.devp->dev, bw->buff_info.size,
-                          bw->buff_info.addr /*buff*/,
-                          bw->dma_handle /*dma_handle*/);
+        // The whole arena is mapped by every process opening the device, not
+        // to leak the block data to the next processes
+        if (bw->block)
+                memset(bw->buff_info.addr, 0, bw->buff_info.size);
+        if (bw->pool)
+                gen_pool_free(bw->pool, (unsigned long)bw->buff_info.addr,
+                              bw->buff_info.size);
+        else if (!_crono_contig_cache_put(CRONO_MISCDEV_OF_BW(bw),
+                                          bw->buff_info.addr, bw->dma_handle,
+                                          bw->buff_info.size))
+                dma_free_coherent(bw->ntrn.devp, bw->buff_info.size,
+                                  bw->buff_info.addr /*buff*/,
+                                  bw->dma_handle /*dma_handle*/);
         pr_debug("Done cleanup Wrapper<%d> kernel memory.", bw->buff_info.id);
 
-        // Delete the wrapper from the list
-        pr_debug("Wrapper<%d>: Deleting from list...", bw->buff_info.id);
-        list_del(&(bw->ntrn.list));
-        pr_debug("Done deleting wrapper <%d> from list", bw->buff_info.id);
+        CRONO_STAT_ADD(CRONO_MISCDEV_OF_BW(bw), contig_buffers, -1);
+        trace_crono_unlock(bw->buff_info.id, BWT_CONTIG, bw->buff_info.size);
         // Don't free `bw` here, caller should free it.
         // kvfree(bw) crashes here.
 
@@ -965,9 +1866,14 @@ _crono_release_contig_buff_wrapper(CRONO_CONTIG_BUFFER_INFO_WRAPPER *bw) {
 }
 
 static int _crono_release_buff_wrapper(void *buff_wrapper) {
-        if (*((int *)buff_wrapper) == BWT_SG) {
+        // Both wrapper types start with `CRONO_BUFFER_INFO_WRAPPER_INTERNAL`
+        const CRONO_BUFFER_INFO_WRAPPER_INTERNAL *ntrn = buff_wrapper;
+
+        if (NULL == ntrn) {
+                return CRONO_SUCCESS;
+        } else if (ntrn->bwt == BWT_SG) {
                 return _crono_release_sg_buff_wrapper(buff_wrapper);
-        } else if (*((int *)buff_wrapper) == BWT_CONTIG) {
+        } else if (ntrn->bwt == BWT_CONTIG) {
                 return _crono_release_contig_buff_wrapper(buff_wrapper);
         } else {
                 return -EINVAL;
@@ -984,7 +1890,8 @@ static int crono_miscdev_open(struct inode *inode, struct file *filp) {
 
         // Check the file is not opened before
         for (icrono_miscdev = 0, passed_iminor = iminor(inode);
-             icrono_miscdev < crono_miscdev_pool_new_index; icrono_miscdev++) {
+             icrono_miscdev < READ_ONCE(crono_miscdev_pool_new_index);
+             icrono_miscdev++) {
                 // Check the array element is the underlying miscdev
                 if (passed_iminor !=
                     crono_miscdev_pool[icrono_miscdev].miscdev.minor)
@@ -1021,12 +1928,14 @@ static int crono_miscdev_open(struct inode *inode, struct file *filp) {
 static int crono_miscdev_release(struct inode *inode, struct file *filp) {
 
         int icrono_miscdev, passed_iminor;
+        u64 start_ns;
         pr_debug("Releasing device file: minor <%d>, PID <%d>", iminor(inode),
                  task_pid_nr(current));
 
         // Decrement the file open counter
         passed_iminor = iminor(inode);
-        for (icrono_miscdev = 0; icrono_miscdev < crono_miscdev_pool_new_index;
+        for (icrono_miscdev = 0;
+             icrono_miscdev < READ_ONCE(crono_miscdev_pool_new_index);
              icrono_miscdev++) {
                 // Check the array element is the underlying miscdev
                 if (passed_iminor !=
@@ -1042,8 +1951,18 @@ static int crono_miscdev_release(struct inode *inode, struct file *filp) {
                         return -ENODATA; // No data found for open
                 }
                 // miscdev is opened (at least once)
-                _crono_release_buffer_wrappers_cur_proc();
+                // Stop DMA before the buffers are unmapped
+                start_ns = ktime_get_ns();
                 _crono_apply_cleanup_commands(inode);
+                _crono_release_buffer_wrappers_cur_proc();
+                _crono_ring_free(&crono_miscdev_pool[icrono_miscdev]);
+                _crono_stat_latency(&crono_miscdev_pool[icrono_miscdev],
+                                    CRONO_STAT_OP_CLEANUP, start_ns);
+
+                // Status page errors are reported until the device is closed
+                mutex_lock(&crono_buff_wrappers_lock);
+                crono_miscdev_pool[icrono_miscdev].emu_errors = 0;
+                mutex_unlock(&crono_buff_wrappers_lock);
 
                 // Releasing the device will make all "opened instances" invalid
                 // so reset open_count as nothing is open after release. Caller
@@ -1083,7 +2002,7 @@ static int _crono_get_DBDF_from_dev(struct pci_dev *dev,
         return CRONO_SUCCESS;
 }
 
-static int _crono_get_dev_from_filp(struct file *filp, struct pci_dev **devpp) {
+static int _crono_get_dev_from_filp(struct file *filp, struct device **devpp) {
 
         int ret = CRONO_SUCCESS;
         struct crono_miscdev *crono_dev = NULL;
@@ -1092,12 +2011,15 @@ static int _crono_get_dev_from_filp(struct file *filp, struct pci_dev **devpp) {
             (ret = _crono_get_crono_dev_from_filp(filp, &crono_dev))) {
                 return ret;
         }
-        *devpp = crono_dev->dev;
+        *devpp = crono_dev->dma_dev;
         return CRONO_SUCCESS;
 }
 
 static int _crono_get_crono_dev_from_filp(struct file *filp,
                                           struct crono_miscdev **crono_devpp) {
+        CRONO_KUNIT_STUB_REDIRECT(_crono_get_crono_dev_from_filp, filp,
+                                  crono_devpp);
+
         // Validate parameters
         LOGERR_RET_EINVAL_IF_NULL(filp, "Invalid file to get dev for");
         LOGERR_RET_EINVAL_IF_NULL(crono_devpp, "Invalid device pointer");
@@ -1122,7 +2044,8 @@ _crono_get_crono_dev_from_inode(struct inode *miscdev_inode,
         passed_drv_minor = iminor(miscdev_inode);
 
         // Loop on the registered devices of every device type
-        for (icrono_miscdev = 0; icrono_miscdev < crono_miscdev_pool_new_index;
+        for (icrono_miscdev = 0;
+             icrono_miscdev < READ_ONCE(crono_miscdev_pool_new_index);
              icrono_miscdev++) {
                 if (crono_miscdev_pool[icrono_miscdev].miscdev.minor !=
                     passed_drv_minor) {
@@ -1140,24 +2063,24 @@ _crono_get_crono_dev_from_inode(struct inode *miscdev_inode,
 }
 
 static int
-_crono_init_sg_buff_wrapper(struct file *filp, unsigned long arg,
+_crono_init_sg_buff_wrapper(struct file *filp,
+                            const CRONO_SG_BUFFER_LOCK_INFO *lock_info,
                             CRONO_SG_BUFFER_INFO_WRAPPER **pp_buff_wrapper) {
 
         int ret = CRONO_SUCCESS;
         CRONO_SG_BUFFER_INFO_WRAPPER *buff_wrapper =
             NULL; // To simplify pointer-to-pointer
 
-        if (0 == arg) {
-                pr_err("Invalid parameter `arg` initializing buffer "
+        if (NULL == lock_info) {
+                pr_err("Invalid parameter `lock_info` initializing buffer "
                        "wrapper");
                 return -EINVAL;
         }
 
         // Allocate and initialize `buff_wrapper`
-        // Should be freed using 'crono_kvfree', e.g. after any call to
-        // `_crono_release_buffxyz` family.
+        // Freed when its last reference is put, once added to the list
         *pp_buff_wrapper = buff_wrapper =
-            kmalloc(sizeof(CRONO_SG_BUFFER_INFO_WRAPPER), GFP_KERNEL);
+            kvzalloc(sizeof(CRONO_SG_BUFFER_INFO_WRAPPER), GFP_KERNEL);
         if (NULL == buff_wrapper) {
                 pr_err("Error allocating DMA internal struct");
                 return -ENOMEM;
@@ -1167,6 +2090,7 @@ _crono_init_sg_buff_wrapper(struct file *filp, unsigned long arg,
         buff_wrapper->userspace_pages = NULL;
         buff_wrapper->pinned_pages_nr = 0;
         buff_wrapper->sgt = NULL;
+        buff_wrapper->mapped_nents = 0;
         buff_wrapper->ntrn.app_pid = task_pid_nr(current);
 
         // Get device pointer in internal structure
@@ -1175,17 +2099,32 @@ _crono_init_sg_buff_wrapper(struct file *filp, unsigned long arg,
                 goto func_err;
         }
 
-        // Copy buffer information from user space to kernel space
-        if (copy_from_user(&(buff_wrapper->buff_info), (void __user *)arg,
-                           sizeof(CRONO_SG_BUFFER_INFO))) {
-                pr_err("Error copying user data");
-                ret = -EFAULT;
+        // Copy buffer information, already copied from user space
+        buff_wrapper->buff_info = lock_info->buff_info;
+        buff_wrapper->flags = lock_info->flags;
+
+        // Validate and translate DMA direction and attributes
+        if (lock_info->dma_dir > CRONO_DMA_FROM_DEVICE ||
+            (lock_info->dma_attrs & ~(CRONO_DMA_ATTR_WEAK_ORDERING |
+                                      CRONO_DMA_ATTR_SKIP_CPU_SYNC))) {
+                pr_err("Invalid DMA direction <%u> or attributes <0x%x>",
+                       lock_info->dma_dir, lock_info->dma_attrs);
+                ret = -EINVAL;
                 goto func_err;
         }
+        buff_wrapper->dma_dir = (enum dma_data_direction)lock_info->dma_dir;
+        buff_wrapper->dma_attrs = 0;
+        if (lock_info->dma_attrs & CRONO_DMA_ATTR_WEAK_ORDERING)
+                buff_wrapper->dma_attrs |= DMA_ATTR_WEAK_ORDERING;
+        if (lock_info->dma_attrs & CRONO_DMA_ATTR_SKIP_CPU_SYNC)
+                buff_wrapper->dma_attrs |= DMA_ATTR_SKIP_CPU_SYNC;
 
         // Validate address
-        LOGERR_RET_EINVAL_IF_NULL(buff_wrapper->buff_info.addr,
-                                  "Invalid buffer to be locked");
+        if (NULL == buff_wrapper->buff_info.addr) {
+                pr_err("Invalid buffer to be locked");
+                ret = -EINVAL;
+                goto func_err;
+        }
         // Validate passed buffer size, and `pages_count` value is
         // consistent with the passed buffer size
         if (buff_wrapper->buff_info.size > ULONG_MAX) {
@@ -1205,45 +2144,150 @@ _crono_init_sg_buff_wrapper(struct file *filp, unsigned long arg,
                 goto func_err;
         }
 
-        // Allocate memory in kernel space for pages addressess
+        // Allocate memory in kernel space for pages addressess.
+        // `vmalloc_user` memory is page aligned and zeroed, so it can be
+        // mapped read-only to userspace by `crono_mmap_sg_addr_table` without
+        // exposing any other kernel data.
+        // No copy from `upages` is needed, all elements are filled when
+        // generating the SG list.
         pr_debug("Allocating kernel pages structure of size <%ld>",
                  buff_wrapper->buff_info.pages_count * sizeof(DMA_ADDR));
-        buff_wrapper->userspace_pages = (DMA_ADDR *)kvmalloc_array(
-            buff_wrapper->buff_info.pages_count, sizeof(DMA_ADDR), GFP_KERNEL);
+        buff_wrapper->userspace_pages = (DMA_ADDR *)vmalloc_user(
+            buff_wrapper->buff_info.pages_count * sizeof(DMA_ADDR));
         if (NULL == buff_wrapper->userspace_pages) {
                 pr_err("Error allocating memory");
                 ret = -ENOMEM;
                 goto func_err;
         }
 
-        // Locking pages memory in user space. No real copy is needed.
-        // All should be replaced when pinning.
-        pr_debug("Copying kernel pages structure from address <0x%llx>",
-                 buff_wrapper->buff_info.upages);
-        if (copy_from_user(buff_wrapper->userspace_pages,
-                           (void __user *)(buff_wrapper->buff_info.upages),
-                           buff_wrapper->buff_info.pages_count *
-                               sizeof(DMA_ADDR))) {
-                ret = -EFAULT;
+        // Charge the pages to the process before pinning them
+        if (CRONO_SUCCESS != (ret = _crono_charge_pinned_vm(buff_wrapper))) {
                 goto func_err;
         }
 
-        // Add the buffer to list
+        // Add the buffer to list, after checking the limits under the same
+        // lock, so concurrent locks can't exceed them
+        mutex_lock(&crono_buff_wrappers_lock);
+        if (CRONO_SUCCESS !=
+            (ret = _crono_check_pinned_limits(buff_wrapper))) {
+                mutex_unlock(&crono_buff_wrappers_lock);
+                goto func_err;
+        }
         buff_wrapper->buff_info.id = sg_buff_wrappers_new_id;
+        // The reference of the list
+        kref_init(&(buff_wrapper->ntrn.ref));
         list_add(&(buff_wrapper->ntrn.list), &sg_buff_wrappers_head);
+        sg_buff_wrappers_new_id++;
+        mutex_unlock(&crono_buff_wrappers_lock);
+        CRONO_STAT_INC(CRONO_MISCDEV_OF_BW(buff_wrapper), sg_buffers);
         PR_DEBUG_BW_INFO("Added buffer wrapper to internal list: ",
                          buff_wrapper);
-        sg_buff_wrappers_new_id++;
         _crono_debug_list_wrappers();
 
         return ret;
 
 func_err:
+        _crono_uncharge_pinned_vm(buff_wrapper);
         crono_kvfree(buff_wrapper->userspace_pages);
         crono_kvfree(buff_wrapper);
+        *pp_buff_wrapper = NULL;
         return ret;
 }
 
+static int _crono_charge_pinned_vm(CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
+        struct mm_struct *mm = current->mm;
+#ifndef OLD_KERNEL_FOR_PIN
+        unsigned long npages = bw->buff_info.pages_count;
+        unsigned long lock_limit;
+        s64 pinned;
+#endif
+        CRONO_KUNIT_STUB_REDIRECT(_crono_charge_pinned_vm, bw);
+
+        if (NULL == mm) {
+                pr_err("Error charging pinned memory: no process memory");
+                return -EFAULT;
+        }
+#ifndef OLD_KERNEL_FOR_PIN
+        // Same accounting as other `pin_user_pages` long term users, e.g.
+        // RDMA, pages are not charged to `locked_vm` as they are not mlocked.
+        lock_limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+        pinned = atomic64_add_return(npages, &mm->pinned_vm);
+        if (pinned > lock_limit && !capable(CAP_IPC_LOCK)) {
+                atomic64_sub(npages, &mm->pinned_vm);
+                pr_err("Error pinning <%lu> pages, exceeding RLIMIT_MEMLOCK "
+                       "<%lu> pages of process PID <%d>, pinned <%lld> pages",
+                       npages, lock_limit, task_pid_nr(current),
+                       pinned - npages);
+                return -ENOMEM;
+        }
+#endif
+        // Keep the process memory, to be uncharged after the process exits
+        mmgrab(mm);
+        bw->mm = mm;
+
+        return CRONO_SUCCESS;
+}
+
+static void _crono_uncharge_pinned_vm(CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
+        if (NULL == bw->mm)
+                return;
+#ifndef OLD_KERNEL_FOR_PIN
+        atomic64_sub(bw->buff_info.pages_count, &bw->mm->pinned_vm);
+#endif
+        mmdrop(bw->mm);
+        bw->mm = NULL;
+}
+
+static int _crono_check_pinned_limits(const CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
+        unsigned long dev_limit = READ_ONCE(max_pinned_bytes_per_device);
+        unsigned long proc_limit = READ_ONCE(max_pinned_bytes_per_process);
+        u64 size = (u64)bw->buff_info.pages_count * PAGE_SIZE;
+        u64 dev_bytes = size, proc_bytes = size;
+        // Buffers waiting for the deferred teardown are still pinned
+        struct list_head *heads[] = {&sg_buff_wrappers_head,
+                                     &crono_teardown_head};
+        CRONO_SG_BUFFER_INFO_WRAPPER *temp_buff_wrapper = NULL;
+        struct list_head *pos = NULL;
+        u64 temp_size;
+        int ihead;
+
+        if (0 == dev_limit && 0 == proc_limit)
+                return CRONO_SUCCESS;
+
+        for (ihead = 0; ihead < ARRAY_SIZE(heads); ihead++) {
+                list_for_each(pos, heads[ihead]) {
+                        temp_buff_wrapper = list_entry(
+                            pos, CRONO_SG_BUFFER_INFO_WRAPPER, ntrn.list);
+                        if (BWT_SG != temp_buff_wrapper->ntrn.bwt)
+                                continue;
+                        temp_size =
+                            (u64)temp_buff_wrapper->buff_info.pages_count *
+                            PAGE_SIZE;
+                        if (temp_buff_wrapper->ntrn.devp == bw->ntrn.devp)
+                                dev_bytes += temp_size;
+                        if (temp_buff_wrapper->mm == bw->mm)
+                                proc_bytes += temp_size;
+                }
+        }
+        if (dev_limit && dev_bytes > dev_limit) {
+                pr_err("Error locking <%llu> bytes, device <%s> would pin "
+                       "<%llu> bytes, exceeding `max_pinned_bytes_per_device` "
+                       "<%lu>",
+                       size, CRONO_MISCDEV_OF_BW(bw)->name, dev_bytes,
+                       dev_limit);
+                return -EDQUOT;
+        }
+        if (proc_limit && proc_bytes > proc_limit) {
+                pr_err("Error locking <%llu> bytes, process PID <%d> would pin "
+                       "<%llu> bytes, exceeding `max_pinned_bytes_per_process` "
+                       "<%lu>",
+                       size, task_pid_nr(current), proc_bytes, proc_limit);
+                return -EDQUOT;
+        }
+
+        return CRONO_SUCCESS;
+}
+
 static void _crono_debug_list_wrappers(void) {
 #ifdef DEBUG
         CRONO_SG_BUFFER_INFO_WRAPPER *temp_sg_buff_wrapper = NULL;
@@ -1253,6 +2297,7 @@ static void _crono_debug_list_wrappers(void) {
 
         pr_debug("Listing wrappers...");
         // List the wrappers in the list
+        mutex_lock(&crono_buff_wrappers_lock);
         list_for_each_safe(pos, n, &sg_buff_wrappers_head) {
                 wrapper_list_is_empty = false; // Set the flag
                 temp_sg_buff_wrapper =
@@ -1265,40 +2310,112 @@ static void _crono_debug_list_wrappers(void) {
                     pos, CRONO_CONTIG_BUFFER_INFO_WRAPPER, ntrn.list);
                 PR_DEBUG_BW_INFO("- Wrapper: ", temp_contig_buff_wrapper);
         }
+        mutex_unlock(&crono_buff_wrappers_lock);
         if (wrapper_list_is_empty) {
                 pr_debug("Wrappers list is empty");
         }
 #endif
 }
 
-static int _crono_release_buffer_wrappers() {
-        struct list_head *pos = NULL, *n = NULL;
+static void _crono_buff_wrapper_kref_release(struct kref *ref) {
+        CRONO_BUFFER_INFO_WRAPPER_INTERNAL *ntrn =
+            container_of(ref, CRONO_BUFFER_INFO_WRAPPER_INTERNAL, ref);
 
-        CRONO_SG_BUFFER_INFO_WRAPPER *temp_sg_buff_wrapper = NULL;
-        CRONO_CONTIG_BUFFER_INFO_WRAPPER *temp_contig_buff_wrapper = NULL;
+        _crono_release_buff_wrapper(ntrn);
+        crono_kvfree(ntrn);
+}
 
-        // Clean up all buffer information wrappers and list
-        pr_info("Cleanup wrappers list...");
+static void _crono_put_buff_wrapper(void *buff_wrapper) {
+        CRONO_BUFFER_INFO_WRAPPER_INTERNAL *ntrn = buff_wrapper;
 
-        // SG Buffer Wrappers
-        list_for_each_safe(pos, n, &sg_buff_wrappers_head) {
-                temp_sg_buff_wrapper =
-                    list_entry(pos, CRONO_SG_BUFFER_INFO_WRAPPER, ntrn.list);
-                _crono_release_buff_wrapper(temp_sg_buff_wrapper);
-                crono_kvfree(temp_sg_buff_wrapper);
-                // Don't list_del(pos); it's deleted in
-                // `_crono_release_buff_wrapper`
+        if (NULL != ntrn)
+                kref_put(&(ntrn->ref), _crono_buff_wrapper_kref_release);
+}
+
+static void _crono_drop_buff_wrapper(void *buff_wrapper) {
+        CRONO_BUFFER_INFO_WRAPPER_INTERNAL *ntrn = buff_wrapper;
+        bool listed;
+
+        mutex_lock(&crono_buff_wrappers_lock);
+        listed = !list_empty(&(ntrn->list));
+        list_del_init(&(ntrn->list));
+        mutex_unlock(&crono_buff_wrappers_lock);
+
+        // A concurrent unlock of its id might have taken the list reference
+        if (listed)
+                _crono_put_buff_wrapper(ntrn);
+}
+
+static void _crono_put_buff_wrappers(struct list_head *head) {
+        CRONO_BUFFER_INFO_WRAPPER_INTERNAL *ntrn;
+
+        // Take the wrappers off the list one by one under the lock, as
+        // `_crono_drop_buff_wrapper` might delete any of them meanwhile
+        mutex_lock(&crono_buff_wrappers_lock);
+        while (!list_empty(head)) {
+                ntrn = list_first_entry(
+                    head, CRONO_BUFFER_INFO_WRAPPER_INTERNAL, list);
+                list_del_init(&(ntrn->list));
+                mutex_unlock(&crono_buff_wrappers_lock);
+                _crono_put_buff_wrapper(ntrn);
+                cond_resched();
+                mutex_lock(&crono_buff_wrappers_lock);
         }
+        mutex_unlock(&crono_buff_wrappers_lock);
+}
 
-        // Contiguous Buffer Wrappers
-        list_for_each_safe(pos, n, &contig_buff_wrappers_head) {
-                temp_contig_buff_wrapper = list_entry(
-                    pos, CRONO_CONTIG_BUFFER_INFO_WRAPPER, ntrn.list);
-                _crono_release_buff_wrapper(temp_contig_buff_wrapper);
-                crono_kvfree(temp_contig_buff_wrapper);
-                // Don't list_del(pos); it's deleted in
-                // `_crono_release_buff_wrapper`
+static int _crono_teardown_buff_wrapper(void *buff_wrapper) {
+        CRONO_BUFFER_INFO_WRAPPER_INTERNAL *ntrn = buff_wrapper;
+        CRONO_SG_BUFFER_INFO_WRAPPER *bw;
+
+        if (READ_ONCE(async_teardown)) {
+                // The buffer is explicitly unlocked, its data is still needed,
+                // so the device writes are synced before returning, and not
+                // again when unmapped.
+                bw = (CRONO_SG_BUFFER_INFO_WRAPPER *)ntrn;
+                if (BWT_SG == ntrn->bwt && NULL != bw->sgt &&
+                    !(bw->dma_attrs & DMA_ATTR_SKIP_CPU_SYNC)) {
+                        dma_sync_sg_for_cpu(ntrn->devp,
+                                            ((struct sg_table *)bw->sgt)->sgl,
+                                            ((struct sg_table *)bw->sgt)->nents,
+                                            bw->dma_dir);
+                        bw->dma_attrs |= DMA_ATTR_SKIP_CPU_SYNC;
+                }
+
+                // The list reference is passed to the teardown list
+                mutex_lock(&crono_buff_wrappers_lock);
+                list_add_tail(&(ntrn->list), &crono_teardown_head);
+                mutex_unlock(&crono_buff_wrappers_lock);
+                queue_work(system_unbound_wq, &crono_teardown_work);
+                return CRONO_SUCCESS;
         }
+        _crono_put_buff_wrapper(buff_wrapper);
+        return CRONO_SUCCESS;
+}
+
+static void _crono_teardown_work_fn(struct work_struct *work) {
+        // All the buffers are unmapped in one run, so the IOMMU flush queue
+        // batches their IOTLB invalidations
+        _crono_put_buff_wrappers(&crono_teardown_head);
+}
+
+static int _crono_release_buffer_wrappers() {
+        LIST_HEAD(sg_head);
+        LIST_HEAD(contig_head);
+
+        // Clean up all buffer information wrappers and list
+        pr_info("Cleanup wrappers list...");
+
+        // Move the wrappers to local lists, to be released without holding
+        // the lock.
+        mutex_lock(&crono_buff_wrappers_lock);
+        list_splice_init(&sg_buff_wrappers_head, &sg_head);
+        list_splice_init(&contig_buff_wrappers_head, &contig_head);
+        mutex_unlock(&crono_buff_wrappers_lock);
+
+        // Drop the list references, releasing the wrappers
+        _crono_put_buff_wrappers(&sg_head);
+        _crono_put_buff_wrappers(&contig_head);
 
         pr_info("Done cleanup wrappers list");
         _crono_debug_list_wrappers();
@@ -1312,36 +2429,50 @@ static int _crono_release_buffer_wrappers_cur_proc() {
         CRONO_CONTIG_BUFFER_INFO_WRAPPER *temp_contig_buff_wrapper = NULL;
         bool no_wrappers_found = true;
         int app_pid = task_pid_nr(current);
+        LIST_HEAD(sg_head);
+        LIST_HEAD(contig_head);
 
         // Clean up all buffer information wrappers and list
         pr_debug("Cleanup process PID <%d> buffers wrappers...", app_pid);
         _crono_debug_list_wrappers();
 
-        // SG Buffer Wrappers
+        // Move the wrappers allocated from the underlying process to local
+        // lists, to be released without holding the lock.
+        mutex_lock(&crono_buff_wrappers_lock);
         list_for_each_safe(pos, n, &sg_buff_wrappers_head) {
                 temp_sg_buff_wrapper =
                     list_entry(pos, CRONO_SG_BUFFER_INFO_WRAPPER, ntrn.list);
-                // Check if the buffer is allocated from the underlying
-                // process
-                if (temp_sg_buff_wrapper->ntrn.app_pid == app_pid) {
-                        no_wrappers_found = false;
-                        _crono_release_buff_wrapper(temp_sg_buff_wrapper);
-                        crono_kvfree(temp_sg_buff_wrapper);
-                }
+                if (temp_sg_buff_wrapper->ntrn.app_pid == app_pid)
+                        list_move_tail(pos, &sg_head);
         }
-
-        // Contiguous Buffer Wrappers
         list_for_each_safe(pos, n, &contig_buff_wrappers_head) {
                 temp_contig_buff_wrapper = list_entry(
                     pos, CRONO_CONTIG_BUFFER_INFO_WRAPPER, ntrn.list);
-                // Check if the buffer is allocated from the underlying
-                // process
-                if (temp_contig_buff_wrapper->ntrn.app_pid == app_pid) {
-                        no_wrappers_found = false;
-                        _crono_release_buff_wrapper(temp_contig_buff_wrapper);
-                        crono_kvfree(temp_contig_buff_wrapper);
-                }
+                if (temp_contig_buff_wrapper->ntrn.app_pid == app_pid)
+                        list_move_tail(pos, &contig_head);
+        }
+        if (READ_ONCE(async_teardown)) {
+                // The buffers are given up by the closing process, don't copy
+                // bounce buffers back into pages it might have reused
+                list_for_each_entry(temp_sg_buff_wrapper, &sg_head, ntrn.list)
+                        temp_sg_buff_wrapper->dma_attrs |=
+                            DMA_ATTR_SKIP_CPU_SYNC;
+
+                // Released by `crono_teardown_work` instead
+                list_splice_tail_init(&sg_head, &crono_teardown_head);
+                list_splice_tail_init(&contig_head, &crono_teardown_head);
+                mutex_unlock(&crono_buff_wrappers_lock);
+                queue_work(system_unbound_wq, &crono_teardown_work);
+                pr_debug("Queued process PID <%d> buffer wrappers teardown",
+                         app_pid);
+                return CRONO_SUCCESS;
         }
+        no_wrappers_found = list_empty(&sg_head) && list_empty(&contig_head);
+        mutex_unlock(&crono_buff_wrappers_lock);
+
+        // Drop the list references, releasing the wrappers
+        _crono_put_buff_wrappers(&sg_head);
+        _crono_put_buff_wrappers(&contig_head);
 
         if (no_wrappers_found) {
                 pr_debug("No buffer wrappers found");
@@ -1379,6 +2510,11 @@ static int _crono_apply_cleanup_commands(struct inode *miscdev_inode) {
                          crono_dev->miscdev.name);
                 return CRONO_SUCCESS;
         }
+        if (NULL == crono_dev->dev) {
+                pr_debug("Emulated device <%s> has no registers to clean up",
+                         crono_dev->miscdev.name);
+                return CRONO_SUCCESS;
+        }
 
         // Get BAR memory information, to write cleanup commands on its
         // regiters
@@ -1409,14 +2545,26 @@ static int _crono_apply_cleanup_commands(struct inode *miscdev_inode) {
         if (NULL == hwmem) {
                 pr_err("Error mapping BAR <%d> memory", DEVICE_BAR_INDEX);
                 pci_release_region(crono_dev->dev, bar);
+                return -ENOMEM;
         }
         pr_debug("BAR <%d> memory is mapped to <0x%p>", DEVICE_BAR_INDEX,
                  hwmem);
 
         // Write the commands to the registers
         for (icmd = 0; icmd < crono_dev->cmds_count; icmd++) {
+                if ((unsigned long)crono_dev->cmds[icmd].addr + sizeof(u32) >
+                    bar_len) {
+                        pr_err("Cleanup command offset <0x%x> is out of BAR "
+                               "<%d> of length <%ld>",
+                               crono_dev->cmds[icmd].addr, DEVICE_BAR_INDEX,
+                               bar_len);
+                        continue;
+                }
                 iowrite32(crono_dev->cmds[icmd].data,
                           hwmem + crono_dev->cmds[icmd].addr);
+                trace_crono_cleanup_cmd(crono_dev->miscdev.minor,
+                                        crono_dev->cmds[icmd].addr,
+                                        crono_dev->cmds[icmd].data);
         }
 
 #ifdef DEBUG
@@ -1429,6 +2577,7 @@ static int _crono_apply_cleanup_commands(struct inode *miscdev_inode) {
         }
 #endif
         // Cleanup function data and actions
+        iounmap(hwmem);
         pci_release_region(crono_dev->dev, bar);
         pr_debug("Done applying cleanup commands of device <%s>",
                  crono_dev->miscdev.name);
@@ -1457,8 +2606,8 @@ static int _crono_init_contig_buff_wrapper(
     CRONO_CONTIG_BUFFER_INFO_WRAPPER **pp_buff_wrapper) {
 
         int ret = CRONO_SUCCESS;
-        CRONO_CONTIG_BUFFER_INFO_WRAPPER *buff_wrapper =
-            NULL; // To simplify pointer-to-pointer
+        struct device *devp = NULL;
+        CRONO_CONTIG_BUFFER_INFO buff_info;
 
         if (0 == arg) {
                 pr_err("Invalid parameter `arg` initializing buffer "
@@ -1466,49 +2615,86 @@ static int _crono_init_contig_buff_wrapper(
                 return -EINVAL;
         }
 
-        // Allocate and initialize `buff_wrapper`
-        // Should be freed using 'crono_kvfree', e.g. after any call to
-        // `_crono_release_buffxyz` family.
-        *pp_buff_wrapper = buff_wrapper =
-            kmalloc(sizeof(CRONO_CONTIG_BUFFER_INFO_WRAPPER), GFP_KERNEL);
-        if (NULL == buff_wrapper) {
-                pr_err("Error allocating DMA internal struct");
-                return -ENOMEM;
-        }
-        buff_wrapper->ntrn.bwt = BWT_CONTIG;
-        buff_wrapper->ntrn.app_pid = task_pid_nr(current);
-
         // Lock the memory from user space to kernel space to get the needed
         // memory size
-        if (copy_from_user(&(buff_wrapper->buff_info), (void __user *)arg,
+        if (copy_from_user(&buff_info, (void __user *)arg,
                            sizeof(CRONO_CONTIG_BUFFER_INFO))) {
                 pr_err("Error copying user data");
-                ret = -EFAULT;
-                goto func_err;
+                return -EFAULT;
         }
 
         // Get device pointer in internal structure
-        ret = _crono_get_dev_from_filp(filp, &(buff_wrapper->ntrn.devp));
+        ret = _crono_get_dev_from_filp(filp, &devp);
         if (ret != CRONO_SUCCESS) {
                 pr_err("Error getting dev");
-                ret = -EIO;
-                goto func_err;
+                return -EIO;
+        }
+
+        return _crono_alloc_contig_buff_wrapper(devp, &buff_info,
+                                                pp_buff_wrapper);
+}
+
+static int _crono_alloc_contig_buff_wrapper(
+    struct device *devp, const CRONO_CONTIG_BUFFER_INFO *buff_info,
+    CRONO_CONTIG_BUFFER_INFO_WRAPPER **pp_buff_wrapper) {
+
+        int ret = CRONO_SUCCESS;
+        CRONO_CONTIG_BUFFER_INFO_WRAPPER *buff_wrapper =
+            NULL; // To simplify pointer-to-pointer
+        struct crono_miscdev *crono_dev;
+
+        // Allocate and initialize `buff_wrapper`
+        // Freed when its last reference is put, once added to the list
+        *pp_buff_wrapper = buff_wrapper =
+            kvzalloc(sizeof(CRONO_CONTIG_BUFFER_INFO_WRAPPER), GFP_KERNEL);
+        if (NULL == buff_wrapper) {
+                pr_err("Error allocating DMA internal struct");
+                return -ENOMEM;
         }
+        buff_wrapper->ntrn.bwt = BWT_CONTIG;
+        buff_wrapper->ntrn.app_pid = task_pid_nr(current);
+        buff_wrapper->ntrn.devp = devp;
+        buff_wrapper->buff_info = *buff_info;
 
-        ret = dma_set_mask_and_coherent(&buff_wrapper->ntrn.devp->dev,
-                                        DMA_BIT_MASK(32));
+        // Set the coherent mask only, narrowing the streaming mask would
+        // bounce buffer all SG buffers locked afterwards.
+        ret = dma_set_coherent_mask(buff_wrapper->ntrn.devp,
+                                    DMA_BIT_MASK(32));
         if (ret) {
                 pr_err("Error setting mask: %d", ret);
                 ret = -EIO;
                 goto func_err;
         }
 
-        // Allocate contiguous memory in kernel space
+        // Allocate contiguous memory in kernel space, from the device pool
+        // if reserved and not exhausted, with no compaction
         pr_debug("Allocating contiguous buffer of size <%ld>",
                  buff_wrapper->buff_info.size);
-        buff_wrapper->buff_info.addr = dma_alloc_coherent(
-            &(buff_wrapper->ntrn.devp->dev), buff_wrapper->buff_info.size,
-            &(buff_wrapper->dma_handle), GFP_KERNEL);
+        crono_dev = dev_get_drvdata(devp);
+        if (crono_dev && crono_dev->contig_pool) {
+                buff_wrapper->buff_info.addr = gen_pool_dma_alloc(
+                    crono_dev->contig_pool->pool, buff_wrapper->buff_info.size,
+                    &(buff_wrapper->dma_handle));
+                if (buff_wrapper->buff_info.addr) {
+                        // Zeroed as `dma_alloc_coherent` memory, not to leak
+                        // the data of the previous buffer
+                        memset(buff_wrapper->buff_info.addr, 0,
+                               buff_wrapper->buff_info.size);
+                        buff_wrapper->pool = crono_dev->contig_pool->pool;
+                } else {
+                        pr_debug("Device pool is exhausted, allocating "
+                                 "buffer of size <%zu>",
+                                 buff_wrapper->buff_info.size);
+                }
+        }
+        if (NULL == buff_wrapper->pool && crono_dev)
+                buff_wrapper->buff_info.addr = _crono_contig_cache_get(
+                    crono_dev, buff_wrapper->buff_info.size,
+                    &(buff_wrapper->dma_handle));
+        if (NULL == buff_wrapper->buff_info.addr)
+                buff_wrapper->buff_info.addr = dma_alloc_coherent(
+                    buff_wrapper->ntrn.devp, buff_wrapper->buff_info.size,
+                    &(buff_wrapper->dma_handle), GFP_KERNEL);
         buff_wrapper->buff_info.dma_handle = buff_wrapper->dma_handle;
         if (buff_wrapper->buff_info.addr == NULL) {
                 // Just null, no global error setting, check `dmsg` if you
@@ -1530,33 +2716,147 @@ static int _crono_init_contig_buff_wrapper(
         // Caller to call `copy_to_user` for `buff_info` (including `.addr`
         // set).
 
-        // Add the buffer to list
+        _crono_add_contig_buff_wrapper(buff_wrapper);
+
+        return ret;
+
+func_err:
+        crono_kvfree(buff_wrapper);
+        *pp_buff_wrapper = NULL;
+        return ret;
+}
+
+static void
+_crono_add_contig_buff_wrapper(CRONO_CONTIG_BUFFER_INFO_WRAPPER *buff_wrapper) {
+        mutex_lock(&crono_buff_wrappers_lock);
         buff_wrapper->buff_info.id = contig_buff_wrappers_new_id;
+        // The reference of the list
+        kref_init(&(buff_wrapper->ntrn.ref));
         list_add(&(buff_wrapper->ntrn.list), &contig_buff_wrappers_head);
+        contig_buff_wrappers_new_id++;
+        mutex_unlock(&crono_buff_wrappers_lock);
+        CRONO_STAT_INC(CRONO_MISCDEV_OF_BW(buff_wrapper), contig_buffers);
         pr_debug("Added contiguous buffer wrapper to internal list. "
                  "Address <%p>, size <%ld>, id <%d>",
                  buff_wrapper->buff_info.addr, buff_wrapper->buff_info.size,
                  buff_wrapper->buff_info.id);
-        contig_buff_wrappers_new_id++;
         _crono_debug_list_wrappers();
+}
 
-        return ret;
+static int _crono_miscdev_ioctl_alloc_contig_block(struct file *filp,
+                                                   unsigned long arg) {
+        int ret;
+        CRONO_CONTIG_BLOCK_INFO block_info;
+        CRONO_CONTIG_BUFFER_INFO_WRAPPER *bw = NULL;
+        struct crono_miscdev *crono_dev = NULL;
+        struct crono_reserved_pool *arena;
+        struct genpool_data_align align_data;
+        unsigned long addr;
 
-func_err:
-        crono_kvfree(buff_wrapper);
-        return ret;
+        pr_debug("Allocating contiguous block...");
+
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(filp, &crono_dev))) {
+                return ret;
+        }
+        if (0 == arg) {
+                pr_err("Invalid parameter `arg` allocating block");
+                CRONO_STAT_INC(crono_dev, lock_errors);
+                return -EINVAL;
+        }
+        if (copy_from_user(&block_info, (void __user *)arg,
+                           sizeof(CRONO_CONTIG_BLOCK_INFO))) {
+                pr_err("Error copying user data");
+                CRONO_STAT_INC(crono_dev, lock_errors);
+                return -EFAULT;
+        }
+
+        // Validate the block against the device arena
+        arena = crono_dev->block_arena;
+        if (NULL == arena) {
+                pr_err("Device <%s> has no blocks arena, check module "
+                       "parameter `block_arena_size`",
+                       crono_dev->name);
+                CRONO_STAT_INC(crono_dev, lock_errors);
+                return -EOPNOTSUPP;
+        }
+        if (0 == block_info.alignment)
+                block_info.alignment = CRONO_BLOCK_MIN_ALIGNMENT;
+        if (0 == block_info.size || block_info.size > arena->size ||
+            !is_power_of_2(block_info.alignment) ||
+            block_info.alignment > PAGE_SIZE) {
+                pr_err("Invalid block size <%u> or alignment <%u>",
+                       block_info.size, block_info.alignment);
+                CRONO_STAT_INC(crono_dev, lock_errors);
+                return -EINVAL;
+        }
+
+        // Allocate the block, with no memory allocated for DMA, IOMMU mapping
+        // or userspace mapping
+        bw = kvzalloc(sizeof(CRONO_CONTIG_BUFFER_INFO_WRAPPER), GFP_KERNEL);
+        if (NULL == bw) {
+                pr_err("Error allocating DMA internal struct");
+                CRONO_STAT_INC(crono_dev, lock_errors);
+                return -ENOMEM;
+        }
+        align_data.align = block_info.alignment;
+        addr = gen_pool_alloc_algo(arena->pool, block_info.size,
+                                   gen_pool_first_fit_align, &align_data);
+        if (0 == addr) {
+                pr_err("Error allocating block of size <%u>, device <%s> "
+                       "arena is exhausted",
+                       block_info.size, crono_dev->name);
+                crono_kvfree(bw);
+                CRONO_STAT_INC(crono_dev, lock_errors);
+                return -ENOMEM;
+        }
+        // The arena is allocated zeroed, and blocks are zeroed when freed
+        bw->ntrn.bwt = BWT_CONTIG;
+        bw->ntrn.app_pid = task_pid_nr(current);
+        bw->ntrn.devp = crono_dev->dma_dev;
+        bw->pool = arena->pool;
+        bw->block = true;
+        bw->buff_info.addr = (void *)addr;
+        bw->buff_info.size = block_info.size;
+        bw->dma_handle = gen_pool_virt_to_phys(arena->pool, addr);
+        bw->buff_info.dma_handle = bw->dma_handle;
+        _crono_add_contig_buff_wrapper(bw);
+
+        // Copy back the block information
+        block_info.id = bw->buff_info.id;
+        block_info.offset = addr - (unsigned long)arena->addr;
+        block_info.dma_handle = bw->dma_handle;
+        if (copy_to_user((void __user *)arg, &block_info,
+                         sizeof(CRONO_CONTIG_BLOCK_INFO))) {
+                pr_err("Error copying block information back to user space");
+                CRONO_STAT_INC(crono_dev, lock_errors);
+                _crono_drop_buff_wrapper(bw);
+                return -EFAULT;
+        }
+
+        pr_debug("Done allocating contiguous block <%d>, offset <%llu>",
+                 block_info.id, block_info.offset);
+        CRONO_STAT_INC(crono_dev, locks);
+        return CRONO_SUCCESS;
 }
 
 static int _crono_miscdev_ioctl_lock_contig_buffer(struct file *filp,
                                                    unsigned long arg) {
         int ret;
         CRONO_CONTIG_BUFFER_INFO_WRAPPER *bw = NULL;
+        struct crono_miscdev *crono_dev = NULL;
 
         pr_debug("Locking contiguous buffer...");
 
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(filp, &crono_dev))) {
+                return ret;
+        }
+
         // Validate, initialize, and lock variables
         if (CRONO_SUCCESS !=
             (ret = _crono_init_contig_buff_wrapper(filp, arg, &bw))) {
+                CRONO_STAT_INC(crono_dev, lock_errors);
                 return ret;
         }
 
@@ -1571,11 +2871,12 @@ static int _crono_miscdev_ioctl_lock_contig_buffer(struct file *filp,
 
         // Cleanup
         pr_debug("Done locking contiguous buffer");
+        CRONO_STAT_INC(crono_dev, locks);
         return CRONO_SUCCESS;
 
 lock_err:
-        _crono_release_buff_wrapper(bw);
-        crono_kvfree(bw);
+        CRONO_STAT_INC(crono_dev, lock_errors);
+        _crono_drop_buff_wrapper(bw);
         return ret;
 }
 
@@ -1584,69 +2885,1183 @@ static int _crono_miscdev_ioctl_unlock_contig_buffer(struct file *filp,
         int ret = CRONO_SUCCESS;
         int wrapper_id = -1;
         CRONO_CONTIG_BUFFER_INFO_WRAPPER *found_buff_wrapper = NULL;
+        struct crono_miscdev *crono_dev = NULL;
+
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(filp, &crono_dev))) {
+                return ret;
+        }
 
         // Lock the memory from user space to kernel space
         if (0 == arg) {
                 pr_err("Invalid parameter `arg` unlocking buffer");
+                CRONO_STAT_INC(crono_dev, unlock_errors);
                 return -EINVAL;
         }
         if (copy_from_user(&wrapper_id, (void __user *)arg, sizeof(int))) {
                 pr_err("Error copying user data");
+                CRONO_STAT_INC(crono_dev, unlock_errors);
                 return -EFAULT;
         }
         pr_debug("Unlocking buffer of wrapper id <%d>...", wrapper_id);
 
-        if (CRONO_SUCCESS != get_bw(wrapper_id, &found_buff_wrapper)) {
+        // Remove it from the list, so concurrent unlocks of the same id don't
+        // find it
+        if (CRONO_SUCCESS != get_bw(wrapper_id, true, &found_buff_wrapper)) {
                 pr_err("Buffer wrapper <%d> is not found", wrapper_id);
+                CRONO_STAT_INC(crono_dev, unlock_errors);
                 return -EINVAL;
         }
 
-        // Clean up buffer memory allocated in the kernel module
-        ret = _crono_release_buff_wrapper(found_buff_wrapper);
-
-        // Free the wrapper after all members cleanup is done
-        kvfree(found_buff_wrapper);
+        // Clean up buffer memory allocated in the kernel module, and free
+        // the wrapper after all members cleanup is done
+        ret = _crono_teardown_buff_wrapper(found_buff_wrapper);
 
         // Copy back just to obey DMA APIs rules
         if (copy_to_user((void __user *)arg, &wrapper_id, sizeof(int))) {
                 ret = -EFAULT;
         }
 
+        if (CRONO_SUCCESS == ret)
+                CRONO_STAT_INC(crono_dev, unlocks);
+        else
+                CRONO_STAT_INC(crono_dev, unlock_errors);
+
         return ret;
 }
 
-static int crono_mmap_contig(struct file *file, struct vm_area_struct *vma) {
-        // `mmap` `offset` (last) argument should be aligned on a page boundary,
-        // so the buffer id is sent to `mmap` multiplied by PAGE_SIZE, however,
-        // it's recieved here divided by PATE_SIZE already
-        int bw_id = vma->vm_pgoff;
+static int _crono_miscdev_ioctl_build_sg_desc_table(struct file *filp,
+                                                    unsigned long arg) {
         int ret = CRONO_SUCCESS;
-        phys_addr_t virttophys;
-        CRONO_CONTIG_BUFFER_INFO_WRAPPER *found_buff_wrapper = NULL;
-
-        pr_debug("Mapping Buffer Wrapper <%d>, offset: <%lu>", bw_id,
-                 vma->vm_pgoff);
-
-        if (CRONO_SUCCESS != get_bw(bw_id, &found_buff_wrapper)) {
-                pr_err("Buffer wrapper <%d> is not found", bw_id);
-                return -EINVAL;
-        }
+        struct crono_miscdev *crono_dev = NULL;
+        CRONO_SG_BUFFER_INFO_WRAPPER *sg_bw = NULL;
+        CRONO_CONTIG_BUFFER_INFO_WRAPPER *table_bw = NULL;
+        CRONO_SG_DESC_TABLE_INFO desc_info;
+        CRONO_CONTIG_BUFFER_INFO table_info;
+        size_t entry_size;
 
-        virttophys = virt_to_phys(found_buff_wrapper->buff_info.addr);
-        pr_debug("virt_to_phys from 0x%p to 0x%llx",
-                 found_buff_wrapper->buff_info.addr, virttophys);
+        pr_debug("Building SG descriptor table...");
 
-        // we are using pgoff as a buffer index only
+        // Get crono device pointer in internal structure
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(filp, &crono_dev))) {
+                return ret;
+        }
+        if (copy_from_user(&desc_info, (void __user *)arg,
+                           sizeof(CRONO_SG_DESC_TABLE_INFO))) {
+                pr_err("Error copying user data");
+                return -EFAULT;
+        }
+        // The reference keeps the DMA segments mapped until the table is filled
+        if (CRONO_SUCCESS != (ret = _crono_get_mapped_sg_bw(
+                                  desc_info.sg_id, crono_dev->dma_dev, &sg_bw)))
+                return ret;
+
+        // Resolve the format of the device family, and the table size
+        if (CRONO_DESC_FORMAT_DEVICE_DEFAULT == desc_info.format) {
+                if (crono_dev->device_id < CRONO_DEVICE_DEV_ID_MAX_COUNT)
+                        desc_info.format =
+                            crono_device_desc_formats[crono_dev->device_id];
+                if (CRONO_DESC_FORMAT_DEVICE_DEFAULT == desc_info.format)
+                        desc_info.format = CRONO_DESC_FORMAT_PAGE_LIST;
+        }
+        switch (desc_info.format) {
+        case CRONO_DESC_FORMAT_PAGE_LIST:
+                desc_info.entries_count = sg_bw->buff_info.pages_count;
+                entry_size = sizeof(DMA_ADDR);
+                break;
+        case CRONO_DESC_FORMAT_EXTENT_LIST:
+                desc_info.entries_count = sg_bw->mapped_nents;
+                entry_size = sizeof(CRONO_DESC_EXTENT);
+                break;
+        default:
+                pr_err("Error, unsupported descriptor table format <%u>",
+                       desc_info.format);
+                _crono_put_buff_wrapper(sg_bw);
+                return -EINVAL;
+        }
+
+        // Allocate the table as a contiguous buffer owned by the process, so
+        // it's mapped, unlocked and cleaned up as any other contiguous buffer.
+        memset(&table_info, 0, sizeof(CRONO_CONTIG_BUFFER_INFO));
+        table_info.size = desc_info.entries_count * entry_size;
+        if (CRONO_SUCCESS !=
+            (ret = _crono_alloc_contig_buff_wrapper(
+                 crono_dev->dma_dev, &table_info, &table_bw))) {
+                _crono_put_buff_wrapper(sg_bw);
+                return ret;
+        }
+
+        // Fill the table from the DMA segments directly
+        _crono_fill_desc_table(sg_bw, desc_info.format,
+                               table_bw->buff_info.addr);
+        _crono_put_buff_wrapper(sg_bw);
+
+        // Copy back all data to userspace memory
+        desc_info.table = table_bw->buff_info;
+        if (copy_to_user((void __user *)arg, &desc_info,
+                         sizeof(CRONO_SG_DESC_TABLE_INFO))) {
+                pr_err("Error copying descriptor table information back to "
+                       "user space");
+                ret = -EFAULT;
+                goto build_err;
+        }
+
+        pr_debug("Done building SG descriptor table: buffer <%d>, format <%u>, "
+                 "entries <%u>, table wrapper id <%d>",
+                 desc_info.sg_id, desc_info.format, desc_info.entries_count,
+                 desc_info.table.id);
+        return CRONO_SUCCESS;
+
+build_err:
+        _crono_drop_buff_wrapper(table_bw);
+        return ret;
+}
+
+static void _crono_fill_desc_table(CRONO_SG_BUFFER_INFO_WRAPPER *bw,
+                                   uint32_t format, void *table) {
+        DMA_ADDR *page_entry = (DMA_ADDR *)table;
+        CRONO_DESC_EXTENT *extent_entry = (CRONO_DESC_EXTENT *)table;
+        struct scatterlist *sg;
+        uint32_t ipage = 0;
+        int i;
+
+        for_each_sg(((struct sg_table *)bw->sgt)->sgl, sg, bw->mapped_nents,
+                    i) {
+                dma_addr_t addr = sg_dma_address(sg);
+                unsigned int len = sg_dma_len(sg);
+
+                if (CRONO_DESC_FORMAT_EXTENT_LIST == format) {
+                        extent_entry[i].addr = addr;
+                        extent_entry[i].size = len;
+                        continue;
+                }
+                // Page list, never exceeds the pages count of the table
+                for (; len > 0 && ipage < bw->buff_info.pages_count; ipage++) {
+                        page_entry[ipage] = addr;
+                        addr += PAGE_SIZE;
+                        len = len > PAGE_SIZE ? len - PAGE_SIZE : 0;
+                }
+        }
+}
+
+static uint32_t
+_crono_count_bounced_segments(CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
+        struct device *dev = bw->ntrn.devp;
+        struct iommu_domain *domain = iommu_get_domain_for_dev(dev);
+        struct scatterlist *sg;
+        uint32_t count = 0;
+        int i;
+
+        // Behind a translating IOMMU, DMA addresses are IOVAs, and full pages
+        // are never bounced. Otherwise, every segment is mapped to its own
+        // physical address, unless `swiotlb` bounced it.
+        if (NULL != domain && IOMMU_DOMAIN_IDENTITY != domain->type)
+                return 0;
+        for_each_sg(((struct sg_table *)bw->sgt)->sgl, sg, bw->mapped_nents,
+                    i) {
+                if (sg_dma_address(sg) != phys_to_dma(dev, sg_phys(sg)))
+                        count++;
+        }
+        return count;
+}
+
+static int _crono_get_single_iova(CRONO_SG_BUFFER_INFO_WRAPPER *bw,
+                                  DMA_ADDR *iova_base, uint64_t *iova_size) {
+        struct scatterlist *sg;
+        dma_addr_t next_addr = 0;
+        uint64_t size = 0;
+        int i;
+
+        // The IOMMU maps the whole SG list to one IOVA range, and merges
+        // adjacent segments up to the maximum segment size. Without an IOMMU,
+        // every segment keeps its own physical address.
+        for_each_sg(((struct sg_table *)bw->sgt)->sgl, sg, bw->mapped_nents,
+                    i) {
+                if (i > 0 && sg_dma_address(sg) != next_addr) {
+                        pr_err("Buffer wrapper <%d> is not mapped to a single "
+                               "DMA range, segment <%d> is not contiguous, "
+                               "is IOMMU enabled?",
+                               bw->buff_info.id, i);
+                        return -EOPNOTSUPP;
+                }
+                next_addr = sg_dma_address(sg) + sg_dma_len(sg);
+                size += sg_dma_len(sg);
+        }
+        *iova_base = sg_dma_address(((struct sg_table *)bw->sgt)->sgl);
+        *iova_size = size;
+
+        if (!IS_ALIGNED(*iova_base, CRONO_SINGLE_IOVA_ALIGNMENT)) {
+                pr_err("Buffer wrapper <%d> DMA range <0x%llx> is not aligned "
+                       "to <0x%x>",
+                       bw->buff_info.id, *iova_base,
+                       CRONO_SINGLE_IOVA_ALIGNMENT);
+                return -ERANGE;
+        }
+        pr_debug("Buffer wrapper <%d> is mapped to a single DMA range: base "
+                 "<0x%llx>, size <%llu>",
+                 bw->buff_info.id, *iova_base, *iova_size);
+        return CRONO_SUCCESS;
+}
+
+static int _crono_miscdev_ioctl_sync_sg_buffer(struct file *filp,
+                                               unsigned long arg,
+                                               bool for_cpu) {
+        int ret = CRONO_SUCCESS;
+        struct device *devp = NULL;
+        CRONO_SG_BUFFER_INFO_WRAPPER *bw = NULL;
+        CRONO_SG_BUFFER_SYNC_INFO sync_info;
+        struct scatterlist *sg;
+        uint64_t seg_start = 0, seg_end, sync_end;
+        int i;
+
+        if (CRONO_SUCCESS != (ret = _crono_get_dev_from_filp(filp, &devp))) {
+                return ret;
+        }
+        if (copy_from_user(&sync_info, (void __user *)arg,
+                           sizeof(CRONO_SG_BUFFER_SYNC_INFO))) {
+                pr_err("Error copying user data");
+                return -EFAULT;
+        }
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_mapped_sg_bw(sync_info.id, devp, &bw)))
+                return ret;
+        if (sync_info.offset > bw->buff_info.size ||
+            sync_info.size > bw->buff_info.size - sync_info.offset) {
+                pr_err("Sync range offset <%llu>, size <%llu> exceeds buffer "
+                       "wrapper <%d> size <%zu>",
+                       sync_info.offset, sync_info.size, sync_info.id,
+                       bw->buff_info.size);
+                _crono_put_buff_wrapper(bw);
+                return -EINVAL;
+        }
+        sync_end = sync_info.offset + sync_info.size;
+
+        // Sync the CPU side entries that cover the range, one entry at a
+        // time. The DMA segments may merge entries of scattered pages, which
+        // `dma_sync_single_for_xxx` can't sync.
+        for_each_sg(((struct sg_table *)bw->sgt)->sgl, sg,
+                    ((struct sg_table *)bw->sgt)->orig_nents, i) {
+                seg_end = seg_start + sg->length;
+                if (seg_end > sync_info.offset) {
+                        if (for_cpu)
+                                dma_sync_sg_for_cpu(devp, sg, 1, bw->dma_dir);
+                        else
+                                dma_sync_sg_for_device(devp, sg, 1,
+                                                       bw->dma_dir);
+                }
+                if (seg_end >= sync_end)
+                        break;
+                seg_start = seg_end;
+        }
+        _crono_put_buff_wrapper(bw);
+        return CRONO_SUCCESS;
+}
+
+static void _crono_tph_init(struct crono_miscdev *crono_dev) {
+#ifdef KERNEL_6_13_OR_LATER
+        // The device firmware selects the Steering Tag table entry per DMA
+        if (!pcie_tph || pcie_enable_tph(crono_dev->dev, PCI_TPH_ST_DS_MODE))
+                return;
+        crono_dev->tph_enabled = true;
+        pr_debug("Device <%s>: TLP Processing Hints enabled", crono_dev->name);
+#endif
+}
+
+static int _crono_miscdev_ioctl_set_buffer_tph(struct file *filp,
+                                               unsigned long arg) {
+        int ret = CRONO_SUCCESS;
+        struct crono_miscdev *crono_dev = NULL;
+        CRONO_SG_BUFFER_INFO_WRAPPER *bw = NULL;
+        CRONO_SG_BUFFER_TPH_INFO tph_info;
+#ifdef KERNEL_6_13_OR_LATER
+        u16 tag;
+#endif
+
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(filp, &crono_dev))) {
+                return ret;
+        }
+        if (copy_from_user(&tph_info, (void __user *)arg,
+                           sizeof(CRONO_SG_BUFFER_TPH_INFO))) {
+                pr_err("Error copying user data");
+                return -EFAULT;
+        }
+        if (CRONO_SUCCESS != (ret = _crono_get_mapped_sg_bw(
+                                  tph_info.id, crono_dev->dma_dev, &bw)))
+                return ret;
+        // The buffer is only validated, the tag is set in the device table
+        _crono_put_buff_wrapper(bw);
+        if (tph_info.cpu >= nr_cpu_ids || !cpu_online(tph_info.cpu)) {
+                pr_err("Invalid CPU <%u> to steer buffer wrapper <%d> to",
+                       tph_info.cpu, tph_info.id);
+                return -EINVAL;
+        }
+
+        // Not supported, the DMA is not steered
+        tph_info.steering_tag = -1;
+#ifdef KERNEL_6_13_OR_LATER
+        if (crono_dev->tph_enabled &&
+            !pcie_tph_get_cpu_st(crono_dev->dev, TPH_MEM_TYPE_VM,
+                                 tph_info.cpu, &tag)) {
+                ret = pcie_tph_set_st_entry(crono_dev->dev, tph_info.st_index,
+                                            tag);
+                if (ret) {
+                        pr_err("Error setting Steering Tag entry <%u> of "
+                               "device <%s>, <%d>",
+                               tph_info.st_index, crono_dev->name, ret);
+                        return ret;
+                }
+                tph_info.steering_tag = tag;
+        }
+#endif
+        if (copy_to_user((void __user *)arg, &tph_info,
+                         sizeof(CRONO_SG_BUFFER_TPH_INFO))) {
+                pr_err("Error copying TPH information to user space");
+                return -EFAULT;
+        }
+        pr_debug("Buffer wrapper <%d> is steered to CPU <%u>, tag <%d>",
+                 tph_info.id, tph_info.cpu, tph_info.steering_tag);
+        return CRONO_SUCCESS;
+}
+
+static int _crono_miscdev_ioctl_get_dev_caps(struct file *filp,
+                                             unsigned long arg) {
+        int ret = CRONO_SUCCESS;
+        struct crono_miscdev *crono_dev = NULL;
+        struct iommu_domain *domain;
+        CRONO_DEV_CAPS caps;
+
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(filp, &crono_dev))) {
+                return ret;
+        }
+        memset(&caps, 0, sizeof(caps));
+        if (crono_dev->tph_enabled)
+                caps.caps |= CRONO_DEV_CAP_TPH;
+        domain = iommu_get_domain_for_dev(crono_dev->dma_dev);
+        if (NULL != domain && IOMMU_DOMAIN_IDENTITY != domain->type)
+                caps.caps |= CRONO_DEV_CAP_IOMMU;
+        if (NULL != crono_dev->emu_pdev)
+                caps.caps |= CRONO_DEV_CAP_EMULATED;
+        if (NULL != crono_dev->status_page) {
+                caps.caps |= CRONO_DEV_CAP_STATUS_PAGE;
+                caps.status_page_size = PAGE_SIZE;
+                caps.status_page_dma = crono_dev->status_page_dma;
+        }
+        if (copy_to_user((void __user *)arg, &caps, sizeof(CRONO_DEV_CAPS))) {
+                pr_err("Error copying capabilities to user space");
+                return -EFAULT;
+        }
+        return CRONO_SUCCESS;
+}
+
+static int crono_miscdev_mmap(struct file *file, struct vm_area_struct *vma) {
+        // `mmap` `offset` (last) argument should be aligned on a page boundary,
+        // so the type and id are sent to `mmap` multiplied by PAGE_SIZE,
+        // however, it's recieved here divided by PATE_SIZE already
+        unsigned long type = CRONO_MMAP_PGOFF_TYPE(vma->vm_pgoff);
+        int id = CRONO_MMAP_PGOFF_ID(vma->vm_pgoff);
+        u64 start_ns = ktime_get_ns();
+        int ret;
+
+        switch (type) {
+        case CRONO_MMAP_TYPE_CONTIG:
+                ret = crono_mmap_contig(file, vma);
+                break;
+        case CRONO_MMAP_TYPE_SG_ADDR_TABLE:
+                ret = crono_mmap_sg_addr_table(file, vma);
+                break;
+        case CRONO_MMAP_TYPE_BLOCK_ARENA:
+                ret = crono_mmap_block_arena(file, vma);
+                break;
+        case CRONO_MMAP_TYPE_STATUS_PAGE:
+                ret = crono_mmap_status_page(file, vma);
+                break;
+        case CRONO_MMAP_TYPE_RING:
+                ret = crono_mmap_ring(file, vma);
+                break;
+        case CRONO_MMAP_TYPE_RING_ADDR_TABLE:
+                ret = crono_mmap_ring_addr_table(file, vma);
+                break;
+        default:
+                pr_err("Error, unsupported mmap type <%lu>", type);
+                ret = -EINVAL;
+                break;
+        }
+        trace_crono_mmap(iminor(file_inode(file)), type, id,
+                         vma->vm_end - vma->vm_start, ret,
+                         ktime_get_ns() - start_ns);
+        return ret;
+}
+
+static void crono_vma_contig_open(struct vm_area_struct *vma) {
+        CRONO_CONTIG_BUFFER_INFO_WRAPPER *bw = vma->vm_private_data;
+
+        // The mapping is split or copied on fork
+        kref_get(&(bw->ntrn.ref));
+}
+
+static void crono_vma_contig_close(struct vm_area_struct *vma) {
+        _crono_put_buff_wrapper(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct crono_contig_vm_ops = {
+    .open = crono_vma_contig_open,
+    .close = crono_vma_contig_close,
+};
+
+static int crono_mmap_contig(struct file *file, struct vm_area_struct *vma) {
+        int bw_id = CRONO_MMAP_PGOFF_ID(vma->vm_pgoff);
+        int ret = CRONO_SUCCESS;
+        CRONO_CONTIG_BUFFER_INFO_WRAPPER *found_buff_wrapper = NULL;
+        struct crono_reserved_pool *pool;
+
+        pr_debug("Mapping Buffer Wrapper <%d>, offset: <%lu>", bw_id,
+                 vma->vm_pgoff);
+
+        if (CRONO_SUCCESS != get_bw(bw_id, false, &found_buff_wrapper)) {
+                pr_err("Buffer wrapper <%d> is not found", bw_id);
+                return -EINVAL;
+        }
+        if (found_buff_wrapper->block) {
+                // Not page aligned, its pages are shared with other blocks
+                pr_err("Block <%d> is mapped with the blocks arena", bw_id);
+                _crono_put_buff_wrapper(found_buff_wrapper);
+                return -EINVAL;
+        }
+
+        if (vma->vm_end - vma->vm_start >
+            PAGE_ALIGN(found_buff_wrapper->buff_info.size)) {
+                pr_err("Mapping size <%lu> exceeds buffer wrapper <%d> size "
+                       "<%zu>",
+                       vma->vm_end - vma->vm_start, bw_id,
+                       found_buff_wrapper->buff_info.size);
+                _crono_put_buff_wrapper(found_buff_wrapper);
+                return -EINVAL;
+        }
+
+        // `dma_mmap_coherent` maps the memory as allocated, which might not
+        // be in the linear mapping, e.g. remapped uncached. Buffers of the
+        // device pool are mapped at their page offset in the pool allocation,
+        // pgoff is used as a buffer index otherwise.
+        if (found_buff_wrapper->pool) {
+                pool = CRONO_MISCDEV_OF_BW(found_buff_wrapper)->contig_pool;
+                vma->vm_pgoff =
+                    ((uint8_t *)found_buff_wrapper->buff_info.addr -
+                     (uint8_t *)pool->addr) >>
+                    PAGE_SHIFT;
+                ret = dma_mmap_coherent(pool->dev, vma, pool->addr,
+                                        pool->dma_handle, pool->size);
+        } else {
+                vma->vm_pgoff = 0;
+                ret = dma_mmap_coherent(found_buff_wrapper->ntrn.devp, vma,
+                                        found_buff_wrapper->buff_info.addr,
+                                        found_buff_wrapper->dma_handle,
+                                        found_buff_wrapper->buff_info.size);
+        }
+        if (ret) {
+                _crono_put_buff_wrapper(found_buff_wrapper);
+        } else {
+                // The mapping keeps the reference, so the memory is freed, or
+                // cached for other processes, only when no longer mapped
+                vma->vm_private_data = found_buff_wrapper;
+                vma->vm_ops = &crono_contig_vm_ops;
+        }
+
+        pr_debug("Mapping Buffer Wrapper <%d> returned code <%d>", bw_id, ret);
+        return ret;
+}
+
+static int crono_mmap_block_arena(struct file *file,
+                                  struct vm_area_struct *vma) {
+        int ret;
+        struct crono_miscdev *crono_dev = NULL;
+        unsigned long size = vma->vm_end - vma->vm_start;
+
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(file, &crono_dev))) {
+                return ret;
+        }
+        if (NULL == crono_dev->block_arena) {
+                pr_err("Device <%s> has no blocks arena", crono_dev->name);
+                return -EINVAL;
+        }
+        if (size > crono_dev->block_arena->size) {
+                pr_err("Mapping size <%lu> exceeds blocks arena size <%zu>",
+                       size, crono_dev->block_arena->size);
+                return -EINVAL;
+        }
+
+        // Same as contiguous buffers, the arena is `dma_alloc_coherent` memory
+        vma->vm_pgoff = 0;
+        return dma_mmap_coherent(crono_dev->block_arena->dev, vma,
+                                 crono_dev->block_arena->addr,
+                                 crono_dev->block_arena->dma_handle,
+                                 crono_dev->block_arena->size);
+}
+
+static int crono_mmap_status_page(struct file *file,
+                                  struct vm_area_struct *vma) {
+        int ret;
+        struct crono_miscdev *crono_dev = NULL;
+        unsigned long size = vma->vm_end - vma->vm_start;
+
+        // The page is written by the module only
+        if (vma->vm_flags & VM_WRITE) {
+                pr_err("Status page can only be mapped read-only");
+                return -EPERM;
+        }
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(file, &crono_dev))) {
+                return ret;
+        }
+        if (NULL == crono_dev->status_page) {
+                pr_err("Device <%s> has no status page", crono_dev->name);
+                return -EOPNOTSUPP;
+        }
+        if (size > PAGE_SIZE) {
+                pr_err("Mapping size <%lu> exceeds status page size <%lu>",
+                       size, PAGE_SIZE);
+                return -EINVAL;
+        }
+
+        // Prevent `mprotect` from making the mapping writable later on
+        crono_vm_flags_clear(vma, VM_MAYWRITE);
+        vma->vm_pgoff = 0;
+        return dma_mmap_coherent(crono_dev->dma_dev, vma,
+                                 crono_dev->status_page,
+                                 crono_dev->status_page_dma, PAGE_SIZE);
+}
+
+static void _crono_status_page_init(struct crono_miscdev *crono_dev) {
+        // The page is written by the emulation thread, the cards don't write
+        // it, and a page that never changes is not exposed
+        if (NULL == crono_dev->emu_pdev)
+                return;
+        // Zeroed by `dma_alloc_coherent`
+        crono_dev->status_page =
+            dma_alloc_coherent(crono_dev->dma_dev, PAGE_SIZE,
+                               &crono_dev->status_page_dma, GFP_KERNEL);
+        if (NULL == crono_dev->status_page) {
+                pr_warn("Device <%s>: error allocating the status page",
+                        crono_dev->name);
+                return;
+        }
+        crono_dev->status_page->buffer_id = -1;
+}
+
+static void _crono_status_page_exit(struct crono_miscdev *crono_dev) {
+        if (NULL == crono_dev->status_page)
+                return;
+        dma_free_coherent(crono_dev->dma_dev, PAGE_SIZE, crono_dev->status_page,
+                          crono_dev->status_page_dma);
+        crono_dev->status_page = NULL;
+}
+
+static void _crono_status_page_update(struct crono_miscdev *crono_dev,
+                                      int buffer_id, u64 write_offset) {
+        CRONO_STATUS_PAGE *status = crono_dev->status_page;
+        u64 seq;
+
+        if (NULL == status)
+                return;
+
+        // Odd `seq` while updating, readers retry meanwhile
+        seq = status->seq;
+        WRITE_ONCE(status->seq, seq + 1);
+        smp_wmb();
+        WRITE_ONCE(status->buffer_id, buffer_id);
+        WRITE_ONCE(status->error_flags, crono_dev->emu_errors);
+        WRITE_ONCE(status->write_offset, write_offset);
+        WRITE_ONCE(status->wraps, crono_dev->emu_wraps);
+        WRITE_ONCE(status->bytes_written, crono_dev->emu_bytes);
+        smp_wmb();
+        WRITE_ONCE(status->seq, seq + 2);
+}
+
+// _____________________________________________________________________________
+// Streaming Ring
+//
+static void _crono_ring_init(struct crono_miscdev *crono_dev) {
+        mutex_init(&crono_dev->ring_lock);
+        init_waitqueue_head(&crono_dev->ring_wait);
+}
+
+static struct crono_ring_page *_crono_ring_page(struct crono_ring *ring,
+                                                u64 pos) {
+        return &ring->pages[(pos >> PAGE_SHIFT) % ring->pages_count];
+}
+
+static void _crono_ring_unmap(struct crono_ring *ring) {
+        u32 ipage;
+
+        for (ipage = 0; ipage < ring->pages_count; ipage++)
+                dma_unmap_page(ring->dev, ring->pages[ipage].dma_handle,
+                               PAGE_SIZE, DMA_FROM_DEVICE);
+}
+
+static void _crono_ring_release(struct kref *ref) {
+        struct crono_ring *ring = container_of(ref, struct crono_ring, ref);
+        u32 ipage;
+
+        // Pages still in pipes, or mapped to userspace, are freed later by
+        // their last reference
+        for (ipage = 0; ipage < ring->pages_count; ipage++)
+                put_page(ring->pages[ipage].page);
+        kvfree(ring->pages);
+        vfree(ring->dma_table);
+        kfree(ring);
+}
+
+static struct crono_ring *_crono_ring_alloc(struct crono_miscdev *crono_dev,
+                                            u32 pages_count) {
+        struct crono_ring *ring;
+        struct crono_ring_page *rpage;
+        u32 ipage;
+
+        ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+        if (NULL == ring)
+                return NULL;
+        kref_init(&ring->ref);
+        ring->dev = crono_dev->dma_dev;
+        ring->size = (u64)pages_count << PAGE_SHIFT;
+        ring->pages = kvcalloc(pages_count, sizeof(*ring->pages), GFP_KERNEL);
+        ring->dma_table = vmalloc_user(pages_count * sizeof(DMA_ADDR));
+        if (NULL == ring->pages || NULL == ring->dma_table)
+                goto alloc_err;
+
+        // Pages are allocated near the device, and mapped one by one, the
+        // device gets their DMA addresses from `dma_table`
+        for (ipage = 0; ipage < pages_count; ipage++) {
+                rpage = &ring->pages[ipage];
+                rpage->ring = ring;
+                rpage->page = alloc_pages_node(dev_to_node(ring->dev),
+                                               GFP_KERNEL | __GFP_ZERO, 0);
+                if (NULL == rpage->page)
+                        goto alloc_err;
+                rpage->dma_handle = dma_map_page(ring->dev, rpage->page, 0,
+                                                 PAGE_SIZE, DMA_FROM_DEVICE);
+                if (dma_mapping_error(ring->dev, rpage->dma_handle)) {
+                        __free_page(rpage->page);
+                        rpage->page = NULL;
+                        goto alloc_err;
+                }
+                ring->dma_table[ipage] = rpage->dma_handle;
+                ring->pages_count++;
+        }
+        return ring;
+
+alloc_err:
+        pr_err("Error allocating ring of <%u> pages for device <%s>",
+               pages_count, crono_dev->name);
+        _crono_ring_unmap(ring);
+        kref_put(&ring->ref, _crono_ring_release);
+        return NULL;
+}
+
+static void _crono_ring_free(struct crono_miscdev *crono_dev) {
+        struct crono_ring *ring;
+
+        mutex_lock(&crono_dev->ring_lock);
+        ring = crono_dev->ring;
+        crono_dev->ring = NULL;
+        crono_dev->ring_head = 0;
+        crono_dev->ring_tail = 0;
+        mutex_unlock(&crono_dev->ring_lock);
+        if (NULL == ring)
+                return;
+
+        // Readers waiting for data return
+        wake_up_interruptible(&crono_dev->ring_wait);
+        _crono_ring_unmap(ring);
+        kref_put(&ring->ref, _crono_ring_release);
+}
+
+static u64 _crono_ring_space(struct crono_miscdev *crono_dev, u64 max) {
+        struct crono_ring *ring = crono_dev->ring;
+        u64 pos = crono_dev->ring_head;
+        u64 end = min(crono_dev->ring_tail + ring->size, pos + max);
+
+        // Pages spliced to pipes are written after the pipes release them
+        while (pos < end) {
+                if (atomic_read(&_crono_ring_page(ring, pos)->pipe_refs))
+                        break;
+                pos = (pos & PAGE_MASK) + PAGE_SIZE;
+        }
+        return min(pos, end) - crono_dev->ring_head;
+}
+
+static void _crono_ring_sync(struct crono_miscdev *crono_dev, u64 pos,
+                             u64 len, bool for_cpu) {
+        struct crono_ring_page *rpage;
+        u64 chunk;
+
+        while (len) {
+                rpage = _crono_ring_page(crono_dev->ring, pos);
+                chunk = min_t(u64, len, PAGE_SIZE - (pos & ~PAGE_MASK));
+                if (for_cpu)
+                        dma_sync_single_for_cpu(
+                            crono_dev->ring->dev,
+                            rpage->dma_handle + (pos & ~PAGE_MASK), chunk,
+                            DMA_FROM_DEVICE);
+                else
+                        dma_sync_single_for_device(
+                            crono_dev->ring->dev,
+                            rpage->dma_handle + (pos & ~PAGE_MASK), chunk,
+                            DMA_FROM_DEVICE);
+                pos += chunk;
+                len -= chunk;
+        }
+}
+
+static void _crono_ring_write(struct crono_ring *ring, u64 pos,
+                              const void *src, size_t len) {
+        struct crono_ring_page *rpage;
+        size_t chunk;
+
+        while (len) {
+                rpage = _crono_ring_page(ring, pos);
+                chunk = min_t(size_t, len, PAGE_SIZE - (pos & ~PAGE_MASK));
+                memcpy((uint8_t *)page_address(rpage->page) +
+                           (pos & ~PAGE_MASK),
+                       src, chunk);
+                src = (const uint8_t *)src + chunk;
+                pos += chunk;
+                len -= chunk;
+        }
+}
+
+static bool _crono_ring_empty(struct crono_miscdev *crono_dev) {
+        return (NULL != READ_ONCE(crono_dev->ring)) &&
+               (READ_ONCE(crono_dev->ring_head) ==
+                READ_ONCE(crono_dev->ring_tail));
+}
+
+static int _crono_ring_wait(struct crono_miscdev *crono_dev, bool nonblock) {
+        if (!_crono_ring_empty(crono_dev))
+                return CRONO_SUCCESS;
+        if (nonblock)
+                return -EAGAIN;
+        return wait_event_interruptible(crono_dev->ring_wait,
+                                        !_crono_ring_empty(crono_dev));
+}
+
+static int _crono_miscdev_ioctl_ring_setup(struct file *filp,
+                                           unsigned long arg) {
+        int ret = CRONO_SUCCESS;
+        struct crono_miscdev *crono_dev = NULL;
+        struct crono_ring *ring;
+        CRONO_RING_SETUP_INFO setup_info;
+
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(filp, &crono_dev))) {
+                return ret;
+        }
+        if (copy_from_user(&setup_info, (void __user *)arg,
+                           sizeof(CRONO_RING_SETUP_INFO))) {
+                pr_err("Error copying user data");
+                return -EFAULT;
+        }
+        if (0 == setup_info.pages_count ||
+            setup_info.pages_count > CRONO_RING_MAX_PAGES ||
+            0 != setup_info.flags) {
+                pr_err("Invalid ring of <%u> pages, flags <0x%x>",
+                       setup_info.pages_count, setup_info.flags);
+                return -EINVAL;
+        }
+        if (NULL == crono_dev->emu_pdev) {
+                // The cards don't report the ring head, the written data would
+                // never be readable
+                pr_err("Device <%s> doesn't support streaming rings",
+                       crono_dev->name);
+                return -EOPNOTSUPP;
+        }
+
+        mutex_lock(&crono_dev->ring_lock);
+        if (NULL != crono_dev->ring) {
+                mutex_unlock(&crono_dev->ring_lock);
+                pr_err("Device <%s> ring is already set up", crono_dev->name);
+                return -EBUSY;
+        }
+        ring = _crono_ring_alloc(crono_dev, setup_info.pages_count);
+        if (NULL == ring) {
+                mutex_unlock(&crono_dev->ring_lock);
+                return -ENOMEM;
+        }
+        crono_dev->ring = ring;
+        crono_dev->ring_head = 0;
+        crono_dev->ring_tail = 0;
+        mutex_unlock(&crono_dev->ring_lock);
+
+        setup_info.size = ring->size;
+        if (copy_to_user((void __user *)arg, &setup_info,
+                         sizeof(CRONO_RING_SETUP_INFO))) {
+                pr_err("Error copying ring information to user space");
+                _crono_ring_free(crono_dev);
+                return -EFAULT;
+        }
+        pr_debug("Device <%s> ring of <%llu> bytes is set up", crono_dev->name,
+                 ring->size);
+        return CRONO_SUCCESS;
+}
+
+static int _crono_miscdev_ioctl_ring_move(struct file *filp,
+                                          unsigned long arg, bool produce) {
+        int ret = CRONO_SUCCESS;
+        struct crono_miscdev *crono_dev = NULL;
+        CRONO_RING_POS pos;
+
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(filp, &crono_dev))) {
+                return ret;
+        }
+        if (copy_from_user(&pos, (void __user *)arg, sizeof(CRONO_RING_POS))) {
+                pr_err("Error copying user data");
+                return -EFAULT;
+        }
+        if (produce && NULL == crono_dev->emu_pdev) {
+                // The head is owned by the device, only emulated devices let
+                // userspace play the device
+                pr_err("Device <%s> ring head can't be moved by userspace",
+                       crono_dev->name);
+                return -EPERM;
+        }
+
+        mutex_lock(&crono_dev->ring_lock);
+        if (NULL == crono_dev->ring) {
+                pr_err("Device <%s> has no ring", crono_dev->name);
+                ret = -EINVAL;
+                goto unlock;
+        }
+        if (produce) {
+                if (pos.bytes > _crono_ring_space(crono_dev, pos.bytes)) {
+                        ret = -ENOSPC;
+                        goto unlock;
+                }
+                // Make the written data visible to all the consumers
+                _crono_ring_sync(crono_dev, crono_dev->ring_head, pos.bytes,
+                                 true);
+                crono_dev->ring_head += pos.bytes;
+        } else {
+                if (pos.bytes > crono_dev->ring_head - crono_dev->ring_tail) {
+                        ret = -EINVAL;
+                        goto unlock;
+                }
+                _crono_ring_sync(crono_dev, crono_dev->ring_tail, pos.bytes,
+                                 false);
+                crono_dev->ring_tail += pos.bytes;
+        }
+        pos.head = crono_dev->ring_head;
+        pos.tail = crono_dev->ring_tail;
+        pos.space = _crono_ring_space(crono_dev, crono_dev->ring->size);
+
+unlock:
+        mutex_unlock(&crono_dev->ring_lock);
+        if (ret)
+                return ret;
+        if (produce && pos.bytes)
+                wake_up_interruptible(&crono_dev->ring_wait);
+        if (copy_to_user((void __user *)arg, &pos, sizeof(CRONO_RING_POS))) {
+                pr_err("Error copying ring position to user space");
+                return -EFAULT;
+        }
+        return CRONO_SUCCESS;
+}
+
+static ssize_t crono_miscdev_read(struct file *filp, char __user *buf,
+                                  size_t count, loff_t *ppos) {
+        int ret = CRONO_SUCCESS;
+        struct crono_miscdev *crono_dev = NULL;
+        struct crono_ring *ring;
+        struct crono_ring_page *rpage;
+        u64 tail, pos, avail, chunk;
+        ssize_t done;
+        bool consumed;
+
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(filp, &crono_dev))) {
+                return ret;
+        }
+
+retry:
+        if (CRONO_SUCCESS !=
+            (ret = _crono_ring_wait(crono_dev, filp->f_flags & O_NONBLOCK))) {
+                return ret;
+        }
+
+        // Take the readable range, and a reference keeping the ring pages
+        mutex_lock(&crono_dev->ring_lock);
+        ring = crono_dev->ring;
+        if (NULL == ring) {
+                mutex_unlock(&crono_dev->ring_lock);
+                return -EINVAL;
+        }
+        kref_get(&ring->ref);
+        tail = crono_dev->ring_tail;
+        avail = min_t(u64, count, crono_dev->ring_head - tail);
+        mutex_unlock(&crono_dev->ring_lock);
+
+        // Copy with no lock held, faulting `buf` in takes `mmap_lock`, which
+        // is held by the ring mmap handlers taking `ring_lock`
+        ret = CRONO_SUCCESS;
+        pos = tail;
+        done = 0;
+        while (done < avail) {
+                rpage = _crono_ring_page(ring, pos);
+                chunk = min_t(u64, avail - done,
+                              PAGE_SIZE - (pos & ~PAGE_MASK));
+                if (copy_to_user(buf + done,
+                                 (uint8_t *)page_address(rpage->page) +
+                                     (pos & ~PAGE_MASK),
+                                 chunk)) {
+                        ret = -EFAULT;
+                        break;
+                }
+                pos += chunk;
+                done += chunk;
+        }
+
+        // Consume the copied data, unless another reader did meanwhile, then
+        // the device might have overwritten it while copying
+        mutex_lock(&crono_dev->ring_lock);
+        consumed =
+            (ring == crono_dev->ring) && (tail == crono_dev->ring_tail);
+        if (consumed) {
+                _crono_ring_sync(crono_dev, tail, done, false);
+                crono_dev->ring_tail = pos;
+        }
+        mutex_unlock(&crono_dev->ring_lock);
+        kref_put(&ring->ref, _crono_ring_release);
+        if (!consumed)
+                goto retry;
+        return done ? done : ret;
+}
+
+static __poll_t crono_miscdev_poll(struct file *filp,
+                                   struct poll_table_struct *wait) {
+        struct crono_miscdev *crono_dev = NULL;
+
+        if (CRONO_SUCCESS != _crono_get_crono_dev_from_filp(filp, &crono_dev))
+                return 0;
+        poll_wait(filp, &crono_dev->ring_wait, wait);
+        if ((NULL != READ_ONCE(crono_dev->ring)) &&
+            !_crono_ring_empty(crono_dev))
+                return EPOLLIN | EPOLLRDNORM;
+        return 0;
+}
+
+#ifdef KERNEL_5_8_OR_LATER
+static void _crono_ring_pipe_buf_release(struct pipe_inode_info *pipe,
+                                         struct pipe_buffer *buf) {
+        struct crono_ring_page *rpage = (struct crono_ring_page *)buf->private;
+
+        atomic_dec(&rpage->pipe_refs);
+        put_page(buf->page);
+        kref_put(&rpage->ring->ref, _crono_ring_release);
+}
+
+static bool _crono_ring_pipe_buf_get(struct pipe_inode_info *pipe,
+                                     struct pipe_buffer *buf) {
+        struct crono_ring_page *rpage = (struct crono_ring_page *)buf->private;
+
+        if (!try_get_page(buf->page))
+                return false;
+        atomic_inc(&rpage->pipe_refs);
+        kref_get(&rpage->ring->ref);
+        return true;
+}
+
+// The pages belong to the ring, they can't be stolen
+static const struct pipe_buf_operations crono_ring_pipe_buf_ops = {
+    .release = _crono_ring_pipe_buf_release,
+    .get = _crono_ring_pipe_buf_get,
+};
+
+static void _crono_ring_spd_release(struct splice_pipe_desc *spd,
+                                    unsigned int i) {
+        struct crono_ring_page *rpage =
+            (struct crono_ring_page *)spd->partial[i].private;
+
+        atomic_dec(&rpage->pipe_refs);
+        put_page(spd->pages[i]);
+        kref_put(&rpage->ring->ref, _crono_ring_release);
+}
+
+static ssize_t crono_miscdev_splice_read(struct file *filp, loff_t *ppos,
+                                         struct pipe_inode_info *pipe,
+                                         size_t len, unsigned int flags) {
+        int ret = CRONO_SUCCESS;
+        struct crono_miscdev *crono_dev = NULL;
+        struct crono_ring_page *rpage;
+        struct page *pages[PIPE_DEF_BUFFERS];
+        struct partial_page partial[PIPE_DEF_BUFFERS];
+        struct splice_pipe_desc spd = {
+            .pages = pages,
+            .partial = partial,
+            .nr_pages_max = PIPE_DEF_BUFFERS,
+            .ops = &crono_ring_pipe_buf_ops,
+            .spd_release = _crono_ring_spd_release,
+        };
+        u64 pos, avail, chunk;
+        ssize_t spliced;
+
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(filp, &crono_dev))) {
+                return ret;
+        }
+        if (CRONO_SUCCESS !=
+            (ret = _crono_ring_wait(crono_dev,
+                                    (flags & SPLICE_F_NONBLOCK) ||
+                                        (filp->f_flags & O_NONBLOCK)))) {
+                return ret;
+        }
+
+        mutex_lock(&crono_dev->ring_lock);
+        if (NULL == crono_dev->ring) {
+                mutex_unlock(&crono_dev->ring_lock);
+                return -EINVAL;
+        }
+
+        // Pass the ring pages to the pipe, with no copy, one buffer per page
+        pos = crono_dev->ring_tail;
+        avail = min_t(u64, len, crono_dev->ring_head - pos);
+        while (avail && spd.nr_pages < PIPE_DEF_BUFFERS) {
+                rpage = _crono_ring_page(crono_dev->ring, pos);
+                chunk = min_t(u64, avail, PAGE_SIZE - (pos & ~PAGE_MASK));
+                get_page(rpage->page);
+                atomic_inc(&rpage->pipe_refs);
+                kref_get(&crono_dev->ring->ref);
+                pages[spd.nr_pages] = rpage->page;
+                partial[spd.nr_pages].offset = pos & ~PAGE_MASK;
+                partial[spd.nr_pages].len = chunk;
+                partial[spd.nr_pages].private = (unsigned long)rpage;
+                spd.nr_pages++;
+                pos += chunk;
+                avail -= chunk;
+        }
+        spliced = splice_to_pipe(pipe, &spd);
+        if (spliced > 0) {
+                _crono_ring_sync(crono_dev, crono_dev->ring_tail, spliced,
+                                 false);
+                crono_dev->ring_tail += spliced;
+        }
+        mutex_unlock(&crono_dev->ring_lock);
+        return spliced;
+}
+#endif // #ifdef KERNEL_5_8_OR_LATER
+
+static int crono_mmap_ring(struct file *file, struct vm_area_struct *vma) {
+        int ret;
+        struct crono_miscdev *crono_dev = NULL;
+        struct crono_ring *ring;
+        unsigned long size = vma->vm_end - vma->vm_start, addr;
+        u32 ipage = 0;
+
+        // The ring is written by the device only
+        if (vma->vm_flags & VM_WRITE) {
+                pr_err("Ring can only be mapped read-only");
+                return -EPERM;
+        }
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(file, &crono_dev))) {
+                return ret;
+        }
+
+        // `read()` takes `ring_lock` then faults on the user buffer, so the
+        // pages are inserted holding a ring reference rather than the lock
+        mutex_lock(&crono_dev->ring_lock);
+        ring = crono_dev->ring;
+        if (NULL != ring)
+                kref_get(&ring->ref);
+        mutex_unlock(&crono_dev->ring_lock);
+        if ((NULL == ring) || (size > ring->size)) {
+                pr_err("Mapping size <%lu> exceeds the device <%s> ring", size,
+                       crono_dev->name);
+                ret = -EINVAL;
+                goto put_ring;
+        }
+
+        // Prevent `mprotect` from making the mapping writable later on
+        crono_vm_flags_clear(vma, VM_MAYWRITE);
         vma->vm_pgoff = 0;
-        ret = remap_pfn_range(vma, vma->vm_start, virttophys >> PAGE_SHIFT,
-                              found_buff_wrapper->buff_info.size,
-                              vma->vm_page_prot);
 
-        pr_debug("Mapping Buffer Wrapper <%d> returned code <%d>", bw_id, ret);
+        // `vm_insert_page` takes a reference on every page, so the pages stay
+        // valid after the ring is freed, until `munmap`
+        for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE) {
+                ret = vm_insert_page(vma, addr, ring->pages[ipage++].page);
+                if (ret)
+                        break;
+        }
+put_ring:
+        if (NULL != ring)
+                kref_put(&ring->ref, _crono_ring_release);
+        return ret;
+}
+
+static int crono_mmap_ring_addr_table(struct file *file,
+                                      struct vm_area_struct *vma) {
+        int ret;
+        struct crono_miscdev *crono_dev = NULL;
+        struct crono_ring *ring;
+
+        // The table is filled by the module only
+        if (vma->vm_flags & VM_WRITE) {
+                pr_err("Addresses table can only be mapped read-only");
+                return -EPERM;
+        }
+        if (CRONO_SUCCESS !=
+            (ret = _crono_get_crono_dev_from_filp(file, &crono_dev))) {
+                return ret;
+        }
+        mutex_lock(&crono_dev->ring_lock);
+        ring = crono_dev->ring;
+        if (NULL != ring)
+                kref_get(&ring->ref);
+        mutex_unlock(&crono_dev->ring_lock);
+        if (NULL == ring) {
+                pr_err("Device <%s> has no ring", crono_dev->name);
+                return -EINVAL;
+        }
+        crono_vm_flags_clear(vma, VM_MAYWRITE);
+        vma->vm_pgoff = 0;
+        ret = remap_vmalloc_range(vma, ring->dma_table, 0);
+        kref_put(&ring->ref, _crono_ring_release);
         return ret;
 }
 
-static int get_bw(int bw_id, CRONO_CONTIG_BUFFER_INFO_WRAPPER **ppBW) {
+static bool _crono_emu_write_ring(struct crono_miscdev *crono_dev,
+                                  CRONO_EMULATED_PACKET *packet, u64 due,
+                                  u64 *written, u64 *head) {
+        struct crono_ring *ring;
+        u64 space;
+
+        mutex_lock(&crono_dev->ring_lock);
+        ring = crono_dev->ring;
+        if (NULL == ring) {
+                mutex_unlock(&crono_dev->ring_lock);
+                return false;
+        }
+        space = _crono_ring_space(crono_dev, due * sizeof(*packet));
+        for (*written = 0; (*written < due) && (space >= sizeof(*packet));
+             (*written)++) {
+                packet->seq = ++crono_dev->emu_seq;
+                _crono_ring_write(ring, crono_dev->ring_head, packet,
+                                  sizeof(*packet));
+                crono_dev->ring_head += sizeof(*packet);
+                if (0 == (crono_dev->ring_head % ring->size))
+                        crono_dev->emu_wraps++;
+                space -= sizeof(*packet);
+        }
+        *head = crono_dev->ring_head;
+        mutex_unlock(&crono_dev->ring_lock);
+        if (*written)
+                wake_up_interruptible(&crono_dev->ring_wait);
+        return true;
+}
+
+static int get_bw(int bw_id, bool detach,
+                  CRONO_CONTIG_BUFFER_INFO_WRAPPER **ppBW) {
         int ret = CRONO_SUCCESS;
         CRONO_CONTIG_BUFFER_INFO_WRAPPER *found_buff_wrapper = NULL;
         CRONO_CONTIG_BUFFER_INFO_WRAPPER *temp_buff_wrapper = NULL;
@@ -1654,23 +4069,27 @@ static int get_bw(int bw_id, CRONO_CONTIG_BUFFER_INFO_WRAPPER **ppBW) {
 
         // Find the related buffer_wrapper in the list
         _crono_debug_list_wrappers();
+        mutex_lock(&crono_buff_wrappers_lock);
         list_for_each_safe(pos, n, &contig_buff_wrappers_head) {
                 temp_buff_wrapper = list_entry(
                     pos, CRONO_CONTIG_BUFFER_INFO_WRAPPER, ntrn.list);
                 if (temp_buff_wrapper->buff_info.id == bw_id)
                         found_buff_wrapper = temp_buff_wrapper;
         }
+        if (NULL != found_buff_wrapper) {
+                // Pass the list reference, or take a new one for the caller
+                if (detach)
+                        list_del_init(&(found_buff_wrapper->ntrn.list));
+                else
+                        kref_get(&(found_buff_wrapper->ntrn.ref));
+        }
+        mutex_unlock(&crono_buff_wrappers_lock);
         if (NULL == found_buff_wrapper) {
-                // Not found, just display a warning but operation is
-                // considered successful
-                pr_warn("Buffer Wrapper of id <%d> is not found in "
-                        "internal list",
-                        bw_id);
-
-                // Returning error will cause any coming opn to fail returning
-                // error EFAULT 14
-                // Case might happen when closing after multiple opens
-                return CRONO_SUCCESS;
+                // Callers dereference the found wrapper
+                pr_debug("Buffer Wrapper of id <%d> is not found in "
+                         "internal list",
+                         bw_id);
+                return -ENODATA;
         } else {
                 pr_debug("Found wrapper of id <%d> in the internal list",
                          found_buff_wrapper->buff_info.id);
@@ -1678,3 +4097,946 @@ static int get_bw(int bw_id, CRONO_CONTIG_BUFFER_INFO_WRAPPER **ppBW) {
         *ppBW = found_buff_wrapper;
         return ret;
 }
+
+static int crono_mmap_sg_addr_table(struct file *file,
+                                    struct vm_area_struct *vma) {
+        int bw_id = CRONO_MMAP_PGOFF_ID(vma->vm_pgoff);
+        int ret = CRONO_SUCCESS;
+        struct device *devp = NULL;
+        CRONO_SG_BUFFER_INFO_WRAPPER *found_buff_wrapper = NULL;
+
+        pr_debug("Mapping addresses table of SG Buffer Wrapper <%d>", bw_id);
+
+        // The table is filled by the module only
+        if (vma->vm_flags & VM_WRITE) {
+                pr_err("Addresses table can only be mapped read-only");
+                return -EPERM;
+        }
+        if (CRONO_SUCCESS != (ret = _crono_get_dev_from_filp(file, &devp))) {
+                return ret;
+        }
+        if (CRONO_SUCCESS != get_sg_bw(bw_id, false, &found_buff_wrapper)) {
+                pr_err("Buffer wrapper <%d> is not found for the device",
+                       bw_id);
+                return -EINVAL;
+        }
+        if (found_buff_wrapper->ntrn.devp != devp) {
+                pr_err("Buffer wrapper <%d> is not found for the device",
+                       bw_id);
+                ret = -EINVAL;
+                goto map_end;
+        }
+        if (NULL == found_buff_wrapper->userspace_pages) {
+                pr_err("Buffer wrapper <%d> has no addresses table", bw_id);
+                ret = -EINVAL;
+                goto map_end;
+        }
+
+        // Prevent `mprotect` from making the mapping writable later on
+        crono_vm_flags_clear(vma, VM_MAYWRITE);
+
+        // `remap_vmalloc_range` takes a reference on every mapped page, so the
+        // pages stay valid, even if the buffer is unlocked before `munmap`.
+        // `remap_vmalloc_range` fails if the mapping exceeds the table size.
+        vma->vm_pgoff = 0;
+        ret = remap_vmalloc_range(vma, found_buff_wrapper->userspace_pages, 0);
+
+        pr_debug("Mapping addresses table of SG Buffer Wrapper <%d> returned "
+                 "code <%d>",
+                 bw_id, ret);
+map_end:
+        _crono_put_buff_wrapper(found_buff_wrapper);
+        return ret;
+}
+
+static int get_sg_bw(int bw_id, bool detach,
+                     CRONO_SG_BUFFER_INFO_WRAPPER **ppBW) {
+        CRONO_SG_BUFFER_INFO_WRAPPER *temp_buff_wrapper = NULL;
+        struct list_head *pos;
+
+        mutex_lock(&crono_buff_wrappers_lock);
+        list_for_each(pos, &sg_buff_wrappers_head) {
+                temp_buff_wrapper =
+                    list_entry(pos, CRONO_SG_BUFFER_INFO_WRAPPER, ntrn.list);
+                if (temp_buff_wrapper->buff_info.id == bw_id) {
+                        // Pass the list reference, or take a new one for the
+                        // caller
+                        if (detach)
+                                list_del_init(&(temp_buff_wrapper->ntrn.list));
+                        else
+                                kref_get(&(temp_buff_wrapper->ntrn.ref));
+                        mutex_unlock(&crono_buff_wrappers_lock);
+                        *ppBW = temp_buff_wrapper;
+                        return CRONO_SUCCESS;
+                }
+        }
+        mutex_unlock(&crono_buff_wrappers_lock);
+        pr_debug("SG Buffer Wrapper of id <%d> is not found in internal list",
+                 bw_id);
+        return -ENODATA;
+}
+
+static int _crono_get_mapped_sg_bw(int bw_id, struct device *devp,
+                                   CRONO_SG_BUFFER_INFO_WRAPPER **ppBW) {
+        if (CRONO_SUCCESS != get_sg_bw(bw_id, false, ppBW)) {
+                *ppBW = NULL;
+        } else if ((*ppBW)->ntrn.devp != devp || 0 == (*ppBW)->mapped_nents) {
+                _crono_put_buff_wrapper(*ppBW);
+                *ppBW = NULL;
+        }
+        if (NULL == *ppBW) {
+                pr_err("Mapped buffer wrapper <%d> is not found for the device",
+                       bw_id);
+                return -EINVAL;
+        }
+        return CRONO_SUCCESS;
+}
+
+static struct crono_reserved_pool *
+_crono_reserve_pool(struct crono_miscdev *crono_dev, size_t size,
+                    int min_alloc_order) {
+        struct device *dev = crono_dev->dma_dev;
+        struct crono_reserved_pool *reserved;
+        struct gen_pool *pool;
+        dma_addr_t dma_handle;
+        unsigned int ipool;
+        void *addr;
+
+        size = PAGE_ALIGN(size);
+        if (0 == size)
+                return NULL;
+
+        // Same mask the contiguous buffers are allocated with
+        if (dma_set_coherent_mask(dev, DMA_BIT_MASK(32))) {
+                pr_warn("Device <%s>: error setting coherent mask, memory is "
+                        "not reserved",
+                        crono_dev->name);
+                return NULL;
+        }
+        addr = dma_alloc_coherent(dev, size, &dma_handle, GFP_KERNEL);
+        if (NULL == addr) {
+                pr_warn("Device <%s>: error reserving memory of size <%zu>",
+                        crono_dev->name, size);
+                return NULL;
+        }
+
+        pool = gen_pool_create(min_alloc_order, dev_to_node(dev));
+        if (NULL == pool) {
+                pr_warn("Device <%s>: error creating pool", crono_dev->name);
+                goto free_mem;
+        }
+        if (gen_pool_add_virt(pool, (unsigned long)addr, dma_handle, size,
+                              dev_to_node(dev))) {
+                pr_warn("Device <%s>: error adding memory to pool",
+                        crono_dev->name);
+                gen_pool_destroy(pool);
+                goto free_mem;
+        }
+
+        mutex_lock(&crono_miscdev_pool_lock);
+        // Reuse the record of a pool released by a failed initialization
+        for (ipool = 0; ipool < crono_reserved_pools_count; ipool++)
+                if (NULL == crono_reserved_pools[ipool].pool)
+                        break;
+        if (ipool >= ARRAY_SIZE(crono_reserved_pools)) {
+                mutex_unlock(&crono_miscdev_pool_lock);
+                pr_warn("Device <%s>: no record is left for the pool",
+                        crono_dev->name);
+                gen_pool_destroy(pool);
+                goto free_mem;
+        }
+        if (ipool == crono_reserved_pools_count)
+                crono_reserved_pools_count++;
+        reserved = &crono_reserved_pools[ipool];
+        reserved->pool = pool;
+        reserved->dev = dev;
+        reserved->addr = addr;
+        reserved->dma_handle = dma_handle;
+        reserved->size = size;
+        mutex_unlock(&crono_miscdev_pool_lock);
+        pr_info("Device <%s>: reserved <%zu> bytes at DMA address <0x%llx>, "
+                "allocation order <%d>",
+                crono_dev->name, size, (u64)dma_handle, min_alloc_order);
+        return reserved;
+
+free_mem:
+        dma_free_coherent(dev, size, addr, dma_handle);
+        return NULL;
+}
+
+static void _crono_release_pool(struct crono_reserved_pool *reserved) {
+        struct crono_reserved_pool released;
+
+        if (NULL == reserved)
+                return;
+        mutex_lock(&crono_miscdev_pool_lock);
+        released = *reserved;
+        memset(reserved, 0, sizeof(*reserved));
+        mutex_unlock(&crono_miscdev_pool_lock);
+
+        gen_pool_destroy(released.pool);
+        dma_free_coherent(released.dev, released.size, released.addr,
+                          released.dma_handle);
+}
+
+static void _crono_reserved_pools_exit(void) {
+        unsigned int ipool;
+
+        for (ipool = 0; ipool < crono_reserved_pools_count; ipool++) {
+                // Released by a failed initialization
+                if (NULL == crono_reserved_pools[ipool].pool)
+                        continue;
+                gen_pool_destroy(crono_reserved_pools[ipool].pool);
+                dma_free_coherent(crono_reserved_pools[ipool].dev,
+                                  crono_reserved_pools[ipool].size,
+                                  crono_reserved_pools[ipool].addr,
+                                  crono_reserved_pools[ipool].dma_handle);
+                memset(&crono_reserved_pools[ipool], 0,
+                       sizeof(crono_reserved_pools[ipool]));
+        }
+        crono_reserved_pools_count = 0;
+}
+
+static void _crono_contig_cache_init(struct crono_miscdev *crono_dev) {
+        mutex_init(&crono_dev->contig_cache_lock);
+        INIT_LIST_HEAD(&crono_dev->contig_cache_dirty);
+        INIT_LIST_HEAD(&crono_dev->contig_cache_clean);
+        crono_dev->contig_cache_bytes = 0;
+        INIT_WORK(&crono_dev->contig_cache_work, _crono_contig_cache_zero_work);
+        crono_dev->contig_cache_enabled = true;
+}
+
+static bool _crono_contig_cache_put(struct crono_miscdev *crono_dev,
+                                    void *addr, dma_addr_t dma_handle,
+                                    size_t size) {
+        unsigned long limit = READ_ONCE(contig_cache_size);
+        struct crono_contig_cache_entry *entry;
+
+        if (NULL == crono_dev || !crono_dev->contig_cache_enabled ||
+            NULL == crono_zero_wq || 0 == limit)
+                return false;
+        entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+        if (NULL == entry)
+                return false;
+        entry->addr = addr;
+        entry->dma_handle = dma_handle;
+        entry->size = size;
+
+        mutex_lock(&crono_dev->contig_cache_lock);
+        if (crono_dev->contig_cache_bytes + size > limit) {
+                mutex_unlock(&crono_dev->contig_cache_lock);
+                kfree(entry);
+                return false;
+        }
+        crono_dev->contig_cache_bytes += size;
+        list_add_tail(&entry->list, &crono_dev->contig_cache_dirty);
+        mutex_unlock(&crono_dev->contig_cache_lock);
+
+        queue_work(crono_zero_wq, &crono_dev->contig_cache_work);
+        pr_debug("Cached contiguous buffer of size <%zu>", size);
+        return true;
+}
+
+static void *_crono_contig_cache_get(struct crono_miscdev *crono_dev,
+                                     size_t size, dma_addr_t *dma_handle) {
+        struct crono_contig_cache_entry *entry, *found = NULL;
+        void *addr;
+
+        if (!crono_dev->contig_cache_enabled)
+                return NULL;
+        mutex_lock(&crono_dev->contig_cache_lock);
+        list_for_each_entry(entry, &crono_dev->contig_cache_clean, list) {
+                if (entry->size == size) {
+                        found = entry;
+                        list_del(&found->list);
+                        crono_dev->contig_cache_bytes -= size;
+                        break;
+                }
+        }
+        mutex_unlock(&crono_dev->contig_cache_lock);
+        if (NULL == found)
+                return NULL;
+
+        addr = found->addr;
+        *dma_handle = found->dma_handle;
+        kfree(found);
+        CRONO_STAT_INC(crono_dev, contig_cache_hits);
+        pr_debug("Allocated contiguous buffer of size <%zu> from cache", size);
+        return addr;
+}
+
+static void _crono_contig_cache_zero_work(struct work_struct *work) {
+        struct crono_miscdev *crono_dev =
+            container_of(work, struct crono_miscdev, contig_cache_work);
+        struct crono_contig_cache_entry *entry;
+        size_t offset, chunk;
+
+        for (;;) {
+                // The entry is zeroed out of the lists, still counted in
+                // `contig_cache_bytes`
+                mutex_lock(&crono_dev->contig_cache_lock);
+                entry = list_first_entry_or_null(
+                    &crono_dev->contig_cache_dirty,
+                    struct crono_contig_cache_entry, list);
+                if (entry)
+                        list_del(&entry->list);
+                mutex_unlock(&crono_dev->contig_cache_lock);
+                if (NULL == entry)
+                        return;
+
+                for (offset = 0; offset < entry->size; offset += chunk) {
+                        chunk = min_t(size_t, entry->size - offset,
+                                      CRONO_CONTIG_CACHE_ZERO_CHUNK);
+                        memset((u8 *)entry->addr + offset, 0, chunk);
+                        cond_resched();
+                }
+
+                mutex_lock(&crono_dev->contig_cache_lock);
+                list_add_tail(&entry->list, &crono_dev->contig_cache_clean);
+                mutex_unlock(&crono_dev->contig_cache_lock);
+        }
+}
+
+static void _crono_contig_cache_drain(struct crono_miscdev *crono_dev) {
+        struct crono_contig_cache_entry *entry, *tmp;
+        LIST_HEAD(head);
+
+        if (!crono_dev->contig_cache_enabled)
+                return;
+        crono_dev->contig_cache_enabled = false;
+        cancel_work_sync(&crono_dev->contig_cache_work);
+
+        mutex_lock(&crono_dev->contig_cache_lock);
+        list_splice_init(&crono_dev->contig_cache_dirty, &head);
+        list_splice_init(&crono_dev->contig_cache_clean, &head);
+        crono_dev->contig_cache_bytes = 0;
+        mutex_unlock(&crono_dev->contig_cache_lock);
+
+        list_for_each_entry_safe(entry, tmp, &head, list) {
+                dma_free_coherent(crono_dev->dma_dev, entry->size, entry->addr,
+                                  entry->dma_handle);
+                kfree(entry);
+        }
+}
+
+static ssize_t contig_pool_avail_show(struct device *dev,
+                                      struct device_attribute *attr,
+                                      char *buf) {
+        struct crono_miscdev *crono_dev = CRONO_MISCDEV_FROM_SYSFS_DEV(dev);
+
+        return scnprintf(buf, PAGE_SIZE, "%zu\n",
+                         crono_dev->contig_pool
+                             ? gen_pool_avail(crono_dev->contig_pool->pool)
+                             : 0);
+}
+
+static ssize_t block_arena_avail_show(struct device *dev,
+                                      struct device_attribute *attr,
+                                      char *buf) {
+        struct crono_miscdev *crono_dev = CRONO_MISCDEV_FROM_SYSFS_DEV(dev);
+
+        return scnprintf(buf, PAGE_SIZE, "%zu\n",
+                         crono_dev->block_arena
+                             ? gen_pool_avail(crono_dev->block_arena->pool)
+                             : 0);
+}
+
+static ssize_t probe_ns_show(struct device *dev, struct device_attribute *attr,
+                             char *buf) {
+        struct crono_miscdev *crono_dev = CRONO_MISCDEV_FROM_SYSFS_DEV(dev);
+
+        return scnprintf(buf, PAGE_SIZE, "%llu\n", crono_dev->probe_ns);
+}
+
+static const char *_crono_pcie_speed_str(u32 speed) {
+        // Link speed encoding of the Link Capabilities and Status registers
+        static const char *const speeds[] = {
+            "Unknown",   "2.5 GT/s",  "5.0 GT/s", "8.0 GT/s",
+            "16.0 GT/s", "32.0 GT/s", "64.0 GT/s"};
+
+        return speed < ARRAY_SIZE(speeds) ? speeds[speed] : speeds[0];
+}
+
+static void _crono_pcie_check_link(struct pci_dev *dev) {
+        u16 lnksta = 0;
+        u32 lnkcap = 0;
+        u32 speed, width, max_speed, max_width;
+
+        if (!pci_is_pcie(dev))
+                return;
+        pcie_capability_read_word(dev, PCI_EXP_LNKSTA, &lnksta);
+        pcie_capability_read_dword(dev, PCI_EXP_LNKCAP, &lnkcap);
+        speed = lnksta & PCI_EXP_LNKSTA_CLS;
+        width = (lnksta & PCI_EXP_LNKSTA_NLW) >> PCI_EXP_LNKSTA_NLW_SHIFT;
+        max_speed = lnkcap & PCI_EXP_LNKCAP_SLS;
+        max_width = (lnkcap & PCI_EXP_LNKCAP_MLW) >> 4;
+        if ((speed >= max_speed) && (width >= max_width))
+                return;
+        pr_warn("Device <%s>: PCIe link <%s x%u> is below its capability "
+                "<%s x%u>, DMA bandwidth is limited",
+                pci_name(dev), _crono_pcie_speed_str(speed), width,
+                _crono_pcie_speed_str(max_speed), max_width);
+}
+
+static struct pci_dev *_crono_pcie_root_port(struct pci_dev *dev) {
+        struct pci_dev *bridge = pci_upstream_bridge(dev);
+
+        while ((NULL != bridge) &&
+               !(pci_is_pcie(bridge) &&
+                 (PCI_EXP_TYPE_ROOT_PORT == pci_pcie_type(bridge))))
+                bridge = pci_upstream_bridge(bridge);
+        return bridge;
+}
+
+static int _crono_pcie_ext_tags(struct pci_dev *dev) {
+        u16 devctl = 0, devctl2 = 0;
+
+        pcie_capability_read_word(dev, PCI_EXP_DEVCTL, &devctl);
+        pcie_capability_read_word(dev, PCI_EXP_DEVCTL2, &devctl2);
+#ifdef PCI_EXP_DEVCTL2_10BIT_TAG_REQ_EN
+        if (devctl2 & PCI_EXP_DEVCTL2_10BIT_TAG_REQ_EN)
+                return 2;
+#endif
+        return (devctl & PCI_EXP_DEVCTL_EXT_TAG) ? 1 : 0;
+}
+
+static void _crono_pcie_set_ext_tags(struct pci_dev *dev,
+                                     struct pci_dev *root) {
+        u32 devcap = 0, devcap2 = 0, root_devcap2 = 0;
+
+        if (0 == pcie_extended_tags) {
+                pcie_capability_clear_word(dev, PCI_EXP_DEVCTL,
+                                           PCI_EXP_DEVCTL_EXT_TAG);
+#ifdef PCI_EXP_DEVCTL2_10BIT_TAG_REQ_EN
+                pcie_capability_clear_word(dev, PCI_EXP_DEVCTL2,
+                                           PCI_EXP_DEVCTL2_10BIT_TAG_REQ_EN);
+#endif
+                return;
+        }
+        pcie_capability_read_dword(dev, PCI_EXP_DEVCAP, &devcap);
+        if (!(devcap & PCI_EXP_DEVCAP_EXT_TAG) ||
+            pci_find_host_bridge(dev->bus)->no_ext_tags) {
+                pr_warn("Device <%s>: extended tags are not supported",
+                        pci_name(dev));
+                return;
+        }
+        pcie_capability_set_word(dev, PCI_EXP_DEVCTL, PCI_EXP_DEVCTL_EXT_TAG);
+        if (pcie_extended_tags < 2)
+                return;
+
+        // 10-bit tags need a completer supporting them, the root port for DMA
+        pcie_capability_read_dword(dev, PCI_EXP_DEVCAP2, &devcap2);
+        if (NULL != root)
+                pcie_capability_read_dword(root, PCI_EXP_DEVCAP2,
+                                           &root_devcap2);
+#ifdef PCI_EXP_DEVCTL2_10BIT_TAG_REQ_EN
+        if ((devcap2 & PCI_EXP_DEVCAP2_10BIT_TAG_REQ) &&
+            (root_devcap2 & PCI_EXP_DEVCAP2_10BIT_TAG_COMP)) {
+                pcie_capability_set_word(dev, PCI_EXP_DEVCTL2,
+                                         PCI_EXP_DEVCTL2_10BIT_TAG_REQ_EN);
+                return;
+        }
+#endif
+        pr_warn("Device <%s>: 10-bit tags are not supported, 8-bit extended "
+                "tags are used",
+                pci_name(dev));
+}
+
+static void _crono_pcie_tune(struct pci_dev *dev) {
+        struct pci_dev *root, *bridge;
+        int ret, mps;
+
+        if (!pci_is_pcie(dev))
+                return;
+        root = _crono_pcie_root_port(dev);
+        bridge = pci_upstream_bridge(dev);
+
+        // MPS must not be larger than the one of the link partner
+        if (pcie_max_payload_size) {
+                if ((NULL != bridge) &&
+                    (pcie_max_payload_size > pcie_get_mps(bridge)))
+                        pr_warn("Device <%s>: Max Payload Size <%d> is larger "
+                                "than the upstream bridge one <%d>",
+                                pci_name(dev), pcie_max_payload_size,
+                                pcie_get_mps(bridge));
+                else if ((ret = pcie_set_mps(dev, pcie_max_payload_size)))
+                        pr_warn("Device <%s>: error setting Max Payload Size "
+                                "<%d>, <%d>",
+                                pci_name(dev), pcie_max_payload_size, ret);
+        }
+        // `pcie_set_readrq` applies the platform MRRS limits
+        if (pcie_max_read_request_size &&
+            (ret = pcie_set_readrq(dev, pcie_max_read_request_size)))
+                pr_warn("Device <%s>: error setting Max Read Request Size "
+                        "<%d>, <%d>",
+                        pci_name(dev), pcie_max_read_request_size, ret);
+
+        // The link partner returns completions up to its own MPS, with a
+        // smaller device MPS the read requests must not be larger than it,
+        // as done by `PCIE_BUS_PERFORMANCE`
+        mps = pcie_get_mps(dev);
+        if ((pcie_max_payload_size || pcie_max_read_request_size) &&
+            (NULL != bridge) && (mps < pcie_get_mps(bridge)) &&
+            (pcie_get_readrq(dev) > mps)) {
+                if ((ret = pcie_set_readrq(dev, mps)))
+                        pr_warn("Device <%s>: error limiting Max Read Request "
+                                "Size to Max Payload Size <%d>, <%d>",
+                                pci_name(dev), mps, ret);
+                else
+                        pr_info("Device <%s>: Max Read Request Size limited "
+                                "to Max Payload Size <%d>, smaller than the "
+                                "upstream bridge one <%d>",
+                                pci_name(dev), mps, pcie_get_mps(bridge));
+        }
+
+        if (0 == pcie_relaxed_ordering) {
+                pcie_capability_clear_word(dev, PCI_EXP_DEVCTL,
+                                           PCI_EXP_DEVCTL_RELAX_EN);
+        } else if (pcie_relaxed_ordering > 0) {
+                // Root ports known to corrupt data with relaxed ordering
+                if ((NULL != root) &&
+                    (root->dev_flags & PCI_DEV_FLAGS_NO_RELAXED_ORDERING))
+                        pr_warn("Device <%s>: relaxed ordering is not "
+                                "supported by the root port",
+                                pci_name(dev));
+                else
+                        pcie_capability_set_word(dev, PCI_EXP_DEVCTL,
+                                                 PCI_EXP_DEVCTL_RELAX_EN);
+        }
+        if (pcie_extended_tags >= 0)
+                _crono_pcie_set_ext_tags(dev, root);
+
+        pr_debug("Device <%s>: MPS <%d>, MRRS <%d>, relaxed ordering <%d>, "
+                 "extended tags <%d>",
+                 pci_name(dev), pcie_get_mps(dev), pcie_get_readrq(dev),
+                 pcie_relaxed_ordering_enabled(dev), _crono_pcie_ext_tags(dev));
+}
+
+static umode_t _crono_pcie_attr_visible(struct kobject *kobj,
+                                        struct attribute *attr, int n) {
+        struct crono_miscdev *crono_dev =
+            CRONO_MISCDEV_FROM_SYSFS_DEV(kobj_to_dev(kobj));
+
+        // Emulated devices have no PCIe link
+        if ((NULL == crono_dev->dev) || !pci_is_pcie(crono_dev->dev))
+                return 0;
+        return attr->mode;
+}
+
+static ssize_t current_link_speed_show(struct device *dev,
+                                       struct device_attribute *attr,
+                                       char *buf) {
+        u16 lnksta = 0;
+
+        pcie_capability_read_word(CRONO_MISCDEV_FROM_SYSFS_DEV(dev)->dev,
+                                  PCI_EXP_LNKSTA, &lnksta);
+        return scnprintf(buf, PAGE_SIZE, "%s\n",
+                         _crono_pcie_speed_str(lnksta & PCI_EXP_LNKSTA_CLS));
+}
+
+static ssize_t current_link_width_show(struct device *dev,
+                                       struct device_attribute *attr,
+                                       char *buf) {
+        u16 lnksta = 0;
+
+        pcie_capability_read_word(CRONO_MISCDEV_FROM_SYSFS_DEV(dev)->dev,
+                                  PCI_EXP_LNKSTA, &lnksta);
+        return scnprintf(
+            buf, PAGE_SIZE, "%u\n",
+            (lnksta & PCI_EXP_LNKSTA_NLW) >> PCI_EXP_LNKSTA_NLW_SHIFT);
+}
+
+static ssize_t max_link_speed_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf) {
+        u32 lnkcap = 0;
+
+        pcie_capability_read_dword(CRONO_MISCDEV_FROM_SYSFS_DEV(dev)->dev,
+                                   PCI_EXP_LNKCAP, &lnkcap);
+        return scnprintf(buf, PAGE_SIZE, "%s\n",
+                         _crono_pcie_speed_str(lnkcap & PCI_EXP_LNKCAP_SLS));
+}
+
+static ssize_t max_link_width_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf) {
+        u32 lnkcap = 0;
+
+        pcie_capability_read_dword(CRONO_MISCDEV_FROM_SYSFS_DEV(dev)->dev,
+                                   PCI_EXP_LNKCAP, &lnkcap);
+        return scnprintf(buf, PAGE_SIZE, "%u\n",
+                         (lnkcap & PCI_EXP_LNKCAP_MLW) >> 4);
+}
+
+static ssize_t max_payload_size_show(struct device *dev,
+                                     struct device_attribute *attr,
+                                     char *buf) {
+        return scnprintf(buf, PAGE_SIZE, "%d\n",
+                         pcie_get_mps(CRONO_MISCDEV_FROM_SYSFS_DEV(dev)->dev));
+}
+
+static ssize_t max_read_request_size_show(struct device *dev,
+                                          struct device_attribute *attr,
+                                          char *buf) {
+        return scnprintf(
+            buf, PAGE_SIZE, "%d\n",
+            pcie_get_readrq(CRONO_MISCDEV_FROM_SYSFS_DEV(dev)->dev));
+}
+
+static ssize_t relaxed_ordering_show(struct device *dev,
+                                     struct device_attribute *attr,
+                                     char *buf) {
+        u16 devctl = 0;
+
+        pcie_capability_read_word(CRONO_MISCDEV_FROM_SYSFS_DEV(dev)->dev,
+                                  PCI_EXP_DEVCTL, &devctl);
+        return scnprintf(buf, PAGE_SIZE, "%d\n",
+                         !!(devctl & PCI_EXP_DEVCTL_RELAX_EN));
+}
+
+static ssize_t extended_tags_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf) {
+        return scnprintf(
+            buf, PAGE_SIZE, "%d\n",
+            _crono_pcie_ext_tags(CRONO_MISCDEV_FROM_SYSFS_DEV(dev)->dev));
+}
+
+static ssize_t numa_node_show(struct device *dev,
+                              struct device_attribute *attr, char *buf) {
+        return scnprintf(
+            buf, PAGE_SIZE, "%d\n",
+            dev_to_node(&CRONO_MISCDEV_FROM_SYSFS_DEV(dev)->dev->dev));
+}
+
+static ssize_t irq_mode_show(struct device *dev, struct device_attribute *attr,
+                             char *buf) {
+        struct pci_dev *pdev = CRONO_MISCDEV_FROM_SYSFS_DEV(dev)->dev;
+
+        if (pdev->msix_enabled)
+                return scnprintf(buf, PAGE_SIZE, "msix\n");
+        if (pdev->msi_enabled)
+                return scnprintf(buf, PAGE_SIZE, "msi\n");
+        return scnprintf(buf, PAGE_SIZE, "%s\n", pdev->irq ? "intx" : "none");
+}
+
+static ssize_t bounced_buffers_show(struct device *dev,
+                                    struct device_attribute *attr, char *buf) {
+        struct crono_miscdev *crono_dev = CRONO_MISCDEV_FROM_SYSFS_DEV(dev);
+
+        return scnprintf(buf, PAGE_SIZE, "%d\n",
+                         atomic_read(&crono_dev->bounced_buffers_count));
+}
+
+static ssize_t bounced_segments_show(struct device *dev,
+                                     struct device_attribute *attr, char *buf) {
+        struct crono_miscdev *crono_dev = CRONO_MISCDEV_FROM_SYSFS_DEV(dev);
+
+        return scnprintf(buf, PAGE_SIZE, "%d\n",
+                         atomic_read(&crono_dev->bounced_segments_count));
+}
+
+// _____________________________________________________________________________
+// Statistics
+//
+static s64 _crono_stat_sum(struct crono_miscdev *crono_dev, size_t offset) {
+        s64 sum = 0;
+        int cpu;
+
+        if (NULL == crono_dev || NULL == crono_dev->stats)
+                return 0;
+        for_each_possible_cpu(cpu) {
+                sum += *(s64 *)((char *)per_cpu_ptr(crono_dev->stats, cpu) +
+                                offset);
+        }
+        return sum;
+}
+
+static void _crono_stat_latency(struct crono_miscdev *crono_dev,
+                                enum crono_stat_op op, u64 start_ns) {
+        int bucket = fls64(ktime_get_ns() - start_ns);
+
+        if (bucket >= CRONO_STAT_HIST_BUCKETS)
+                bucket = CRONO_STAT_HIST_BUCKETS - 1;
+        CRONO_STAT_INC(crono_dev, hist[op][bucket]);
+}
+
+static int crono_debugfs_histograms_show(struct seq_file *s, void *unused) {
+        static const char *const op_names[CRONO_STAT_OP_COUNT] = {
+            "pin", "gen_sg", "map", "unpin", "cleanup"};
+        struct crono_miscdev *crono_dev = s->private;
+        int op, bucket;
+        s64 count;
+
+        for (op = 0; op < CRONO_STAT_OP_COUNT; op++) {
+                seq_printf(s, "%s:\n", op_names[op]);
+                for (bucket = 0; bucket < CRONO_STAT_HIST_BUCKETS; bucket++) {
+                        count = CRONO_STAT_READ(crono_dev, hist[op][bucket]);
+                        if (0 == count)
+                                continue;
+                        // Bucket `n` counts durations less than 2^n ns
+                        if (bucket < CRONO_STAT_HIST_BUCKETS - 1)
+                                seq_printf(s, "  < 2^%-2d ns: %lld\n", bucket,
+                                           count);
+                        else
+                                seq_printf(s, " >= 2^%-2d ns: %lld\n",
+                                           bucket - 1, count);
+                }
+        }
+        return 0;
+}
+
+static int crono_debugfs_buffers_show(struct seq_file *s, void *unused) {
+        CRONO_SG_BUFFER_INFO_WRAPPER *sg_bw;
+        CRONO_CONTIG_BUFFER_INFO_WRAPPER *contig_bw;
+
+        seq_puts(s, "device type id pid size extents\n");
+        mutex_lock(&crono_buff_wrappers_lock);
+        list_for_each_entry(sg_bw, &sg_buff_wrappers_head, ntrn.list) {
+                seq_printf(s, "%s sg %d %d %zu %d\n",
+                           CRONO_MISCDEV_OF_BW(sg_bw)->name,
+                           sg_bw->buff_info.id, sg_bw->ntrn.app_pid,
+                           sg_bw->buff_info.size, sg_bw->mapped_nents);
+        }
+        list_for_each_entry(contig_bw, &contig_buff_wrappers_head, ntrn.list) {
+                seq_printf(s, "%s contig %d %d %zu 1\n",
+                           CRONO_MISCDEV_OF_BW(contig_bw)->name,
+                           contig_bw->buff_info.id, contig_bw->ntrn.app_pid,
+                           contig_bw->buff_info.size);
+        }
+        mutex_unlock(&crono_buff_wrappers_lock);
+        return 0;
+}
+
+// _____________________________________________________________________________
+// Emulated Devices
+//
+static void _crono_emu_init(void) {
+        unsigned int iemu;
+        int ret = CRONO_SUCCESS;
+        struct platform_device *pdev;
+        struct crono_miscdev *new_crono_miscdev = NULL, *crono_dev = NULL;
+
+        if (0 == emulated_devices)
+                return;
+        if ((emulated_device_id < 0) ||
+            (emulated_device_id >= CRONO_DEVICE_DEV_ID_MAX_COUNT)) {
+                pr_err("Error emulated Device ID <0x%02x> not supported",
+                       emulated_device_id);
+                return;
+        }
+        pr_info("Registering <%u> emulated devices...", emulated_devices);
+
+        for (iemu = 0; iemu < emulated_devices; iemu++) {
+                // The platform device is used for DMA, as the PCI device is
+                pdev = platform_device_register_simple(CRONO_EMU_DEVICE_NAME,
+                                                       iemu, NULL, 0);
+                if (IS_ERR(pdev)) {
+                        pr_err("Error registering emulated device <%u>, <%ld>",
+                               iemu, PTR_ERR(pdev));
+                        return;
+                }
+                ret = dma_coerce_mask_and_coherent(&pdev->dev,
+                                                   DMA_BIT_MASK(64));
+                if (ret)
+                        goto emu_err;
+
+                // Initialize crono_miscdev, and register its miscdev
+                new_crono_miscdev = _crono_miscdev_claim();
+                if (NULL == new_crono_miscdev) {
+                        ret = -ENOSPC;
+                        goto emu_err;
+                }
+                new_crono_miscdev->dma_dev = &pdev->dev;
+                new_crono_miscdev->emu_pdev = pdev;
+                new_crono_miscdev->device_id = emulated_device_id;
+                new_crono_miscdev->dbdf.domain = CRONO_EMU_DOMAIN;
+                new_crono_miscdev->dbdf.dev = iemu;
+                new_crono_miscdev->emu_bw_id = -1;
+                if (CRONO_SUCCESS !=
+                    (ret = _crono_miscdev_register(new_crono_miscdev,
+                                                   &crono_dev)))
+                        goto emu_err;
+                crono_emu_pdevs[crono_emu_pdevs_count++] = pdev;
+
+                // Start writing packets, the device is usable without
+                crono_dev->emu_thread = kthread_run(
+                    _crono_emu_thread, crono_dev, "crono_emu/%u", iemu);
+                if (IS_ERR(crono_dev->emu_thread)) {
+                        pr_err("Error starting emulated device <%s> thread, "
+                               "<%ld>",
+                               crono_dev->name,
+                               PTR_ERR(crono_dev->emu_thread));
+                        crono_dev->emu_thread = NULL;
+                }
+                pr_info("Done registering emulated device <%s>, minor: <%d>",
+                        crono_dev->name, crono_dev->miscdev.minor);
+        }
+        return;
+
+emu_err:
+        pr_err("Error initializing emulated device <%u>, <%d>", iemu, ret);
+        platform_device_unregister(pdev);
+}
+
+static void _crono_emu_stop(struct crono_miscdev *crono_dev) {
+        if (NULL == crono_dev->emu_thread)
+                return;
+        kthread_stop(crono_dev->emu_thread);
+        crono_dev->emu_thread = NULL;
+}
+
+static void _crono_emu_exit(void) {
+        unsigned int iemu;
+
+        for (iemu = 0; iemu < crono_emu_pdevs_count; iemu++) {
+                platform_device_unregister(crono_emu_pdevs[iemu]);
+                crono_emu_pdevs[iemu] = NULL;
+        }
+        crono_emu_pdevs_count = 0;
+}
+
+static CRONO_SG_BUFFER_INFO_WRAPPER *
+_crono_emu_next_bw(struct crono_miscdev *crono_dev) {
+        CRONO_SG_BUFFER_INFO_WRAPPER *bw, *next = NULL, *first = NULL;
+
+        list_for_each_entry(bw, &sg_buff_wrappers_head, ntrn.list) {
+                // Only the device buffers mapped for the device to write
+                if ((bw->ntrn.devp != crono_dev->dma_dev) ||
+                    (bw->mapped_nents <= 0) ||
+                    (DMA_TO_DEVICE == bw->dma_dir) ||
+                    (bw->buff_info.size < sizeof(CRONO_EMULATED_PACKET)))
+                        continue;
+                if ((bw->buff_info.id == crono_dev->emu_bw_id) &&
+                    (crono_dev->emu_offset + sizeof(CRONO_EMULATED_PACKET) <=
+                     bw->buff_info.size))
+                        return bw;
+                if ((bw->buff_info.id > crono_dev->emu_bw_id) &&
+                    ((NULL == next) || (bw->buff_info.id < next->buff_info.id)))
+                        next = bw;
+                if ((NULL == first) || (bw->buff_info.id < first->buff_info.id))
+                        first = bw;
+        }
+        // Wrap around to the first buffer after the last one
+        if ((NULL == next) && (NULL != first)) {
+                next = first;
+                crono_dev->emu_wraps++;
+        }
+        if (NULL != next) {
+                crono_dev->emu_bw_id = next->buff_info.id;
+                crono_dev->emu_offset = 0;
+        }
+        return next;
+}
+
+static void _crono_emu_write(CRONO_SG_BUFFER_INFO_WRAPPER *bw, size_t offset,
+                             const void *src, size_t len) {
+        size_t pos, chunk;
+        struct page *page;
+        void *vaddr;
+
+        // Position from the start of the first pinned page
+        pos = ((unsigned long)bw->buff_info.addr & ~PAGE_MASK) + offset;
+        while (len) {
+                page = (struct page *)bw->kernel_pages[pos >> PAGE_SHIFT];
+                chunk = min_t(size_t, len, PAGE_SIZE - (pos & ~PAGE_MASK));
+                vaddr = kmap(page);
+                memcpy((uint8_t *)vaddr + (pos & ~PAGE_MASK), src, chunk);
+                kunmap(page);
+                flush_dcache_page(page);
+                src = (const uint8_t *)src + chunk;
+                pos += chunk;
+                len -= chunk;
+        }
+}
+
+static int _crono_emu_thread(void *data) {
+        struct crono_miscdev *crono_dev = (struct crono_miscdev *)data;
+        CRONO_SG_BUFFER_INFO_WRAPPER *bw;
+        CRONO_EMULATED_PACKET packet;
+        unsigned long rate;
+        u64 now_ns, elapsed_ns, due, ipacket, offset, count, i;
+        size_t start;
+        u32 errors;
+        int buffer_id;
+
+        pr_debug("Emulated device <%s> thread started", crono_dev->name);
+        crono_dev->emu_last_ns = ktime_get_ns();
+        while (!kthread_should_stop()) {
+                usleep_range(CRONO_EMU_PERIOD_US, CRONO_EMU_PERIOD_US + 100);
+
+                // Packets due since the last written ones
+                now_ns = ktime_get_ns();
+                rate = READ_ONCE(emulated_packet_rate);
+                elapsed_ns = min_t(u64, now_ns - crono_dev->emu_last_ns,
+                                   NSEC_PER_SEC);
+                due = div64_u64(elapsed_ns * rate, NSEC_PER_SEC);
+                if (0 == due) {
+                        if (0 == rate)
+                                crono_dev->emu_last_ns = now_ns;
+                        continue;
+                }
+                errors = 0;
+                if (due > CRONO_EMU_MAX_BURST) {
+                        // Overloaded, drop the packets of this period
+                        due = CRONO_EMU_MAX_BURST;
+                        crono_dev->emu_last_ns = now_ns;
+                        errors |= CRONO_STATUS_ERR_OVERRUN;
+                } else {
+                        crono_dev->emu_last_ns +=
+                            div64_u64(due * NSEC_PER_SEC, rate);
+                }
+
+                // Write the packets into the ring, or into the buffers
+                buffer_id = -1;
+                packet.timestamp = now_ns;
+                if (_crono_emu_write_ring(crono_dev, &packet, due, &ipacket,
+                                          &offset)) {
+                        // The driver-managed ring takes precedence
+                        if (ipacket < due)
+                                errors |= CRONO_STATUS_ERR_OVERRUN;
+                } else {
+                        offset = 0;
+                        for (ipacket = 0; ipacket < due; ipacket += count) {
+                                // Reserve the packets fitting in the buffer
+                                // under the lock, the reference keeps it
+                                // pinned while copying with no lock held
+                                mutex_lock(&crono_buff_wrappers_lock);
+                                bw = _crono_emu_next_bw(crono_dev);
+                                if (NULL == bw) {
+                                        mutex_unlock(&crono_buff_wrappers_lock);
+                                        break; // No buffer is locked
+                                }
+                                kref_get(&(bw->ntrn.ref));
+                                start = crono_dev->emu_offset;
+                                count = min_t(u64, due - ipacket,
+                                              (bw->buff_info.size - start) /
+                                                  sizeof(packet));
+                                crono_dev->emu_offset += count * sizeof(packet);
+                                buffer_id = bw->buff_info.id;
+                                offset = crono_dev->emu_offset;
+                                mutex_unlock(&crono_buff_wrappers_lock);
+
+                                for (i = 0; i < count; i++) {
+                                        packet.seq = ++crono_dev->emu_seq;
+                                        _crono_emu_write(
+                                            bw, start + i * sizeof(packet),
+                                            &packet, sizeof(packet));
+                                }
+                                _crono_put_buff_wrapper(bw);
+                        }
+                        if (ipacket < due)
+                                errors |= CRONO_STATUS_ERR_NO_BUFFER;
+                }
+                mutex_lock(&crono_buff_wrappers_lock);
+                crono_dev->emu_errors |= errors;
+                crono_dev->emu_bytes += ipacket * sizeof(packet);
+                _crono_status_page_update(crono_dev, buffer_id, offset);
+                mutex_unlock(&crono_buff_wrappers_lock);
+        }
+        pr_debug("Emulated device <%s> thread stopped, <%llu> packets written",
+                 crono_dev->name, crono_dev->emu_seq);
+        return CRONO_SUCCESS;
+}
+
+#ifdef CRONO_KUNIT_TEST
+// Included rather than linked, so the tests reach the static functions
+#include "crono_kunit.c"
+#endif
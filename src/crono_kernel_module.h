@@ -3,20 +3,59 @@
 // _____________________________________________________________________________
 
 #include <asm/unistd.h>
+#include <linux/capability.h>
+#include <linux/debugfs.h>
+#include <linux/dma-direct.h>
 #include <linux/dma-mapping.h>
 #include <linux/fcntl.h>
+#include <linux/genalloc.h>
+#include <linux/highmem.h>
+#include <linux/hugetlb.h>
+#include <linux/iommu.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/pci.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/poll.h>
+#ifdef KERNEL_6_13_OR_LATER
+#include <linux/pci-tph.h>
+#endif
+#include <linux/percpu.h>
+#include <linux/platform_device.h>
 #include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/shmem_fs.h>
+#include <linux/splice.h>
 #include <linux/syscalls.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #ifdef OLD_KERNEL_FOR_PIN
 #include <linux/uaccess.h>
 #endif
 
+#ifdef CRONO_KUNIT_TEST
+#include <kunit/test.h>
+#include <kunit/static_stub.h>
+// Calls the replacement of `fn` installed by the running KUnit test, if any
+#define CRONO_KUNIT_STUB_REDIRECT(fn, args...)                                 \
+        KUNIT_STATIC_STUB_REDIRECT(fn, args)
+#else
+#define CRONO_KUNIT_STUB_REDIRECT(fn, args...)                                 \
+        do {                                                                   \
+        } while (0)
+#endif
+
 /**
  * Structure used to hold a clenup command information. One object per
  * command.
@@ -45,6 +84,113 @@ enum { CRONO_KERNEL_PCI_CARDS = 8 }; // Slots max X Functions max
  */
 #define CRONO_MAX_MSCDEV_COUNT 32
 
+/**
+ * PCI domain set in the DBDF of the emulated devices, the device number is the
+ * emulated device index.
+ */
+#define CRONO_EMU_DOMAIN 0xFF
+
+/**
+ * Emulated devices write their packets every `CRONO_EMU_PERIOD_US`, with at
+ * most `CRONO_EMU_MAX_BURST` packets per period.
+ */
+#define CRONO_EMU_PERIOD_US 1000
+#define CRONO_EMU_MAX_BURST 65536
+
+/**
+ * Operations timed in the latency histograms of `struct crono_dev_stats`.
+ */
+enum crono_stat_op {
+        CRONO_STAT_OP_PIN,     // Pinning the SG buffer pages
+        CRONO_STAT_OP_GEN_SG,  // Allocating the SG table from the pages
+        CRONO_STAT_OP_MAP,     // DMA mapping the SG table
+        CRONO_STAT_OP_UNPIN,   // Unpinning the SG buffer pages
+        CRONO_STAT_OP_CLEANUP, // Releasing the buffers of a closed device file
+        CRONO_STAT_OP_COUNT
+};
+
+/**
+ * Count of log2 buckets of the latency histograms. Bucket `n` counts durations
+ * of [2^(n-1), 2^n) nanoseconds, the last bucket counts all longer durations.
+ */
+#define CRONO_STAT_HIST_BUCKETS 36
+
+/**
+ * Per-CPU device statistics, updated lock-free using `CRONO_STAT_xxx`, and
+ * summed over all CPUs when read. Gauges are signed, as a buffer might be
+ * counted on a CPU and uncounted on another.
+ */
+struct crono_dev_stats {
+        s64 pinned_bytes;   // Bytes of pinned SG buffers pages
+        s64 sg_buffers;     // Live SG buffers
+        s64 contig_buffers; // Live contiguous buffers
+        u64 locks;          // Successful lock ioctls, both buffer types
+        u64 lock_errors;
+        u64 unlocks; // Successful unlock ioctls, both buffer types
+        u64 unlock_errors;
+        u64 maps; // Successful DMA mappings of SG buffers
+        u64 map_errors;
+        u64 contig_cache_hits; // Contiguous buffers allocated from the cache
+        u64 hist[CRONO_STAT_OP_COUNT][CRONO_STAT_HIST_BUCKETS];
+};
+
+/**
+ * Freed contiguous buffer kept in the device cache, to be zeroed in the
+ * background and reused by the next allocation of the same size.
+ */
+struct crono_contig_cache_entry {
+        struct list_head list;
+        void *addr;
+        dma_addr_t dma_handle;
+        size_t size;
+};
+
+/**
+ * Size of the memory zeroed by the cache worker between rescheduling points.
+ */
+#define CRONO_CONTIG_CACHE_ZERO_CHUNK (1024 * 1024)
+
+struct crono_ring;
+
+/**
+ * Page of a streaming ring, set as the `private` of the pipe buffers spliced
+ * from it.
+ */
+struct crono_ring_page {
+        struct page *page;
+        dma_addr_t dma_handle;
+        atomic_t pipe_refs; // Count of pipe buffers referencing the page, it's
+                            // not written by the device until they are
+                            // released.
+        struct crono_ring *ring;
+};
+
+/**
+ * Streaming ring of a device, order-0 pages mapped for the device to write.
+ * Referenced by the device, and by every pipe buffer spliced from it, so it
+ * outlives the device if a pipe still holds its pages.
+ */
+struct crono_ring {
+        struct kref ref;
+        struct device *dev;
+        u32 pages_count;
+        u64 size;
+        DMA_ADDR *dma_table; // DMA address of every page, allocated by
+                             // `vmalloc_user` to be mapped to userspace.
+        struct crono_ring_page *pages;
+};
+
+/**
+ * Coherent memory reserved for a device, and the pool allocating from it.
+ */
+struct crono_reserved_pool {
+        struct gen_pool *pool;
+        struct device *dev;
+        void *addr;
+        dma_addr_t dma_handle;
+        size_t size;
+};
+
 /**
  * Device information used during the driver lifetime.
  */
@@ -75,9 +221,16 @@ struct crono_miscdev {
          * Filled by probing function, and used mainly by `dma_map_sg`.
          * No need to deallocate it, as it points to the kernel structure passed
          * in probing function, assuming this is safe.
+         * NULL for emulated devices.
          */
         struct pci_dev *dev;
 
+        /**
+         * Device used for DMA, `&dev->dev` for PCI devices, or the platform
+         * device of emulated devices. Its driver data is the `crono_miscdev`.
+         */
+        struct device *dma_dev;
+
         /**
          * Device cleanup commands
          */
@@ -88,8 +241,140 @@ struct crono_miscdev {
          * A counter of the number of times `open()` is called for this device.
          */
         uint32_t open_count;
+
+        /**
+         * Count of SG buffers locked with bounce buffered DMA segments, and
+         * count of these segments. Shown in sysfs.
+         */
+        atomic_t bounced_buffers_count;
+        atomic_t bounced_segments_count;
+
+        /**
+         * Per-CPU statistics, allocated when the miscdev is registered.
+         */
+        struct crono_dev_stats __percpu *stats;
+
+        /**
+         * debugfs directory `crono/<name>` of the device.
+         */
+        struct dentry *debugfs_dir;
+
+        /**
+         * Pool of the contiguous buffers, and arena of the contiguous blocks,
+         * over the coherent memory reserved when the miscdev is registered,
+         * NULL if not reserved.
+         */
+        struct crono_reserved_pool *contig_pool;
+        struct crono_reserved_pool *block_arena;
+
+        /**
+         * Cache of the freed contiguous buffers, `dirty` buffers are zeroed by
+         * `contig_cache_work` then moved to `clean`, to be reused.
+         * `contig_cache_bytes` counts both lists and the buffer being zeroed.
+         * Protected by `contig_cache_lock`. Disabled after the device is
+         * reset, so buffers released later are freed.
+         */
+        bool contig_cache_enabled;
+        struct mutex contig_cache_lock;
+        struct list_head contig_cache_dirty;
+        struct list_head contig_cache_clean;
+        size_t contig_cache_bytes;
+        struct work_struct contig_cache_work;
+
+        /**
+         * Time spent in `crono_driver_probe` in nanoseconds, shown in sysfs.
+         */
+        u64 probe_ns;
+
+        /**
+         * The record is claimed by a device, set and cleared under
+         * `crono_miscdev_pool_lock`.
+         */
+        bool claimed;
+
+        /**
+         * TLP Processing Hints are enabled, in Device Specific mode, the
+         * Steering Tags are programmed by `IOCTL_CRONO_SET_BUFFER_TPH`.
+         */
+        bool tph_enabled;
+
+        /**
+         * Status page of the device, `CRONO_STATUS_PAGE`, one page of
+         * coherent memory mapped read-only to userspace. NULL if not
+         * allocated.
+         */
+        CRONO_STATUS_PAGE *status_page;
+        dma_addr_t status_page_dma;
+
+        /**
+         * Streaming ring, NULL if not set up, and its `head` and `tail`, the
+         * bytes produced and consumed since it's set up. Protected by
+         * `ring_lock`, `ring_wait` is woken up when data is produced or the
+         * ring is freed.
+         */
+        struct mutex ring_lock;
+        struct crono_ring *ring;
+        u64 ring_head;
+        u64 ring_tail;
+        wait_queue_head_t ring_wait;
+
+        /**
+         * Emulated devices only, NULL for PCI devices.
+         * The platform device and the thread writing packets into its buffers.
+         */
+        struct platform_device *emu_pdev;
+        struct task_struct *emu_thread;
+        /**
+         * Emulation state, accessed by `emu_thread` only: the buffer wrapper
+         * id and offset of the next packet, the count of packets written, and
+         * the time of the last written packets.
+         */
+        int emu_bw_id;
+        size_t emu_offset;
+        u64 emu_seq;
+        u64 emu_last_ns;
+        /**
+         * Emulation progress shown in the status page: the wraps to the first
+         * buffer, the bytes written, and the `CRONO_STATUS_ERR_xxx` errors
+         * since the device is opened. Protected by `crono_buff_wrappers_lock`.
+         */
+        u64 emu_wraps;
+        u64 emu_bytes;
+        u32 emu_errors;
 };
 
+/**
+ * Update the per-CPU statistics `field` of `crono_dev`, which might be NULL,
+ * e.g. for buffers released after the device is removed.
+ */
+#define CRONO_STAT_ADD(crono_dev, field, val)                                  \
+        do {                                                                   \
+                if ((crono_dev) && (crono_dev)->stats)                         \
+                        this_cpu_add((crono_dev)->stats->field, (val));        \
+        } while (0)
+#define CRONO_STAT_INC(crono_dev, field) CRONO_STAT_ADD(crono_dev, field, 1)
+
+/**
+ * Sum of the per-CPU statistics `field` of `crono_dev` over all CPUs.
+ */
+#define CRONO_STAT_READ(crono_dev, field)                                      \
+        _crono_stat_sum(crono_dev, offsetof(struct crono_dev_stats, field))
+
+/**
+ * Get the `struct crono_miscdev` of the device owning the buffer wrapper
+ * `bw`, set as the DMA device driver data when the miscdev is registered.
+ */
+#define CRONO_MISCDEV_OF_BW(bw)                                                \
+        ((struct crono_miscdev *)dev_get_drvdata((bw)->ntrn.devp))
+
+/**
+ * Get the `struct crono_miscdev` of the miscdev `struct device` passed to
+ * sysfs attributes, `misc_register` sets its driver data to the miscdevice.
+ */
+#define CRONO_MISCDEV_FROM_SYSFS_DEV(dev)                                      \
+        container_of((struct miscdevice *)dev_get_drvdata(dev),                \
+                     struct crono_miscdev, miscdev)
+
 /**
  * Internal driver device ID of cronologic devices based on PCI Device ID
  */
@@ -121,9 +406,11 @@ typedef uint64_t DMA_ADDR;
 typedef struct {
         int bwt;
         struct list_head list; // Linux list node info
-        struct pci_dev *devp;  // Owner device
+        struct device *devp;   // Owner device, used for DMA
         int app_pid; // Process ID of the userspace application that owns the
                      // buffer
+        struct kref ref; // One reference while in a list, and one for every
+                         // user that found the wrapper in it
 } CRONO_BUFFER_INFO_WRAPPER_INTERNAL;
 
 /**
@@ -137,10 +424,18 @@ typedef struct {
         void *sgt; // Scatter/Gather Table that holds the pinned pages.
         DMA_ADDR *userspace_pages; // Kernel memory has physical addresses of
                                    // userspace pages. Pages count =
-                                   // `buff_info.pages_count`
+                                   // `buff_info.pages_count`. Allocated by
+                                   // `vmalloc_user` to be mapped to userspace.
         size_t pinned_size;        // Actual size pinned of the buffer in bytes.
+        int mapped_nents; // Number of DMA segments returned by `dma_map_sg`.
+        uint32_t flags;   // `CRONO_SG_LOCK_FLAG_xxx` passed when locking.
+        enum dma_data_direction dma_dir; // Direction the buffer is mapped with.
+        unsigned long dma_attrs; // `DMA_ATTR_xxx` the buffer is mapped with.
         uint32_t pinned_pages_nr; // Number of actual pages pinned, needed to be
                                   // known if pin failed.
+        struct mm_struct *mm; // Memory of the process charged with the
+                              // `pages_count` pages of the buffer, NULL if
+                              // not charged.
 
         CRONO_SG_BUFFER_INFO buff_info;
 
@@ -149,11 +444,33 @@ typedef struct {
 typedef struct {
         CRONO_BUFFER_INFO_WRAPPER_INTERNAL ntrn;
         dma_addr_t dma_handle;
+        struct gen_pool *pool; // Pool the buffer is allocated from, NULL if
+                               // allocated by `dma_alloc_coherent`.
+        bool block; // A block of the device blocks arena, mapped with the
+                    // whole arena only.
 
         CRONO_CONTIG_BUFFER_INFO buff_info;
 
 } CRONO_CONTIG_BUFFER_INFO_WRAPPER;
 
+/**
+ * Get the object type and id from `vm_pgoff` of the miscdev `mmap`, as
+ * constructed by `CRONO_MMAP_OFFSET`.
+ */
+#define CRONO_MMAP_PGOFF_TYPE(pgoff) ((pgoff) >> CRONO_MMAP_TYPE_SHIFT)
+#define CRONO_MMAP_PGOFF_ID(pgoff)                                             \
+        ((pgoff) & ((1UL << CRONO_MMAP_TYPE_SHIFT) - 1))
+
+/**
+ * `vm_flags` is read-only starting kernel 6.3, and should be modified using
+ * `vm_flags_clear`.
+ */
+#ifdef KERNEL_6_3_OR_LATER
+#define crono_vm_flags_clear(vma, flags) vm_flags_clear(vma, flags)
+#else
+#define crono_vm_flags_clear(vma, flags) ((vma)->vm_flags &= ~(flags))
+#endif
+
 /**
  * Function displays information about the list of wrappers found in list
  * `buff_wrappers_head`.
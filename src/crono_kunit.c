@@ -0,0 +1,704 @@
+// KUnit tests of the driver.
+// Included at the end of `crono_kernel_module.c` when built with
+// `CRONO_KUNIT=1`, so the tests reach its static functions. The tests run
+// when the module is loaded, results are found in `dmesg` and
+// `/sys/kernel/debug/kunit/crono/results`, including the timing of the SG
+// lock path steps.
+
+// _____________________________________________________________________________
+// Fixtures
+//
+enum crono_kunit_step {
+        CRONO_KUNIT_STEP_UNMAP = 1,
+        CRONO_KUNIT_STEP_UNPIN,
+};
+
+#define CRONO_KUNIT_MAX_STEPS 4
+#define CRONO_KUNIT_MAX_LISTED 4
+
+// Fake userspace address of the buffers locked by the lock path tests, the
+// pinning stub translates it to the index of the test pages
+#define CRONO_KUNIT_USER_ADDR 0x10000000UL
+
+struct crono_kunit_priv {
+        // Release steps, in the order they are called
+        int steps[CRONO_KUNIT_MAX_STEPS];
+        int steps_nr;
+
+        // Wrappers added to the driver lists, removed upon test exit
+        CRONO_SG_BUFFER_INFO_WRAPPER *listed[CRONO_KUNIT_MAX_LISTED];
+        int listed_nr;
+
+        // Devices and processes the wrappers belong to
+        struct device *devp[2];
+        struct mm_struct *mm[2];
+
+        unsigned long saved_dev_limit;
+        unsigned long saved_proc_limit;
+
+        // Lock path, set by `crono_kunit_init_lock_path`
+        struct crono_miscdev *crono_dev; // Of a DMA capable root device
+        struct page **pages;             // Handed out by the pinning stub
+        int pages_nr;
+        int pin_limit;   // Pages pinned before the pinning stub fails, or -1
+        int pinned_nr;   // Pages handed out by the pinning stub
+        int unpinned_nr; // Pages released by the unpinning stub
+        int dev_calls_nr;
+        int fail_dev_call; // Failing call of the device stub, or 0
+
+        // Wrappers locked by the test, dropped upon test exit
+        CRONO_SG_BUFFER_INFO_WRAPPER **locked;
+        int locked_nr;
+};
+
+static int crono_kunit_init(struct kunit *test) {
+        struct crono_kunit_priv *priv;
+        struct crono_miscdev *crono_dev;
+        int i;
+
+        priv = kunit_kzalloc(test, sizeof(*priv), GFP_KERNEL);
+        KUNIT_ASSERT_NOT_NULL(test, priv);
+        for (i = 0; i < ARRAY_SIZE(priv->devp); i++) {
+                // Only the miscdev name is used, in the limits errors
+                crono_dev = kunit_kzalloc(test, sizeof(*crono_dev), GFP_KERNEL);
+                KUNIT_ASSERT_NOT_NULL(test, crono_dev);
+                snprintf(crono_dev->name, CRONO_DEV_NAME_MAX_SIZE,
+                         "crono_kunit_%d", i);
+                priv->devp[i] =
+                    kunit_kzalloc(test, sizeof(struct device), GFP_KERNEL);
+                KUNIT_ASSERT_NOT_NULL(test, priv->devp[i]);
+                dev_set_drvdata(priv->devp[i], crono_dev);
+
+                // Compared by address only
+                priv->mm[i] =
+                    kunit_kzalloc(test, sizeof(struct mm_struct), GFP_KERNEL);
+                KUNIT_ASSERT_NOT_NULL(test, priv->mm[i]);
+        }
+        priv->saved_dev_limit = READ_ONCE(max_pinned_bytes_per_device);
+        priv->saved_proc_limit = READ_ONCE(max_pinned_bytes_per_process);
+        test->priv = priv;
+
+        return CRONO_SUCCESS;
+}
+
+static void crono_kunit_exit(struct kunit *test) {
+        struct crono_kunit_priv *priv = test->priv;
+        int i;
+
+        mutex_lock(&crono_buff_wrappers_lock);
+        for (i = 0; i < priv->listed_nr; i++)
+                list_del_init(&priv->listed[i]->ntrn.list);
+        mutex_unlock(&crono_buff_wrappers_lock);
+
+        // The stubs are still active, so the test pages are not unpinned
+        for (i = 0; i < priv->locked_nr; i++) {
+                if (priv->locked[i])
+                        _crono_drop_buff_wrapper(priv->locked[i]);
+        }
+        for (i = 0; i < priv->pages_nr; i++)
+                __free_pages(priv->pages[i], 1);
+        if (priv->crono_dev) {
+                if (!IS_ERR_OR_NULL(priv->crono_dev->dma_dev))
+                        root_device_unregister(priv->crono_dev->dma_dev);
+                free_percpu(priv->crono_dev->stats);
+        }
+
+        WRITE_ONCE(max_pinned_bytes_per_device, priv->saved_dev_limit);
+        WRITE_ONCE(max_pinned_bytes_per_process, priv->saved_proc_limit);
+}
+
+/**
+ * Allocate an SG buffer wrapper of `pages_count` pages, the wrapper is freed
+ * upon test exit.
+ */
+static CRONO_SG_BUFFER_INFO_WRAPPER *
+crono_kunit_alloc_sg_bw(struct kunit *test, struct device *devp,
+                        struct mm_struct *mm, uint32_t pages_count) {
+        CRONO_SG_BUFFER_INFO_WRAPPER *bw;
+
+        bw = kunit_kzalloc(test, sizeof(*bw), GFP_KERNEL);
+        KUNIT_ASSERT_NOT_NULL(test, bw);
+        INIT_LIST_HEAD(&bw->ntrn.list);
+        bw->ntrn.bwt = BWT_SG;
+        bw->ntrn.devp = devp;
+        bw->mm = mm;
+        bw->buff_info.pages_count = pages_count;
+
+        return bw;
+}
+
+/**
+ * Add `bw` to the driver list `head`, as if it's locked or waiting for the
+ * deferred teardown.
+ */
+static void crono_kunit_list_bw(struct kunit *test, struct list_head *head,
+                                CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
+        struct crono_kunit_priv *priv = test->priv;
+
+        KUNIT_ASSERT_LT(test, priv->listed_nr, CRONO_KUNIT_MAX_LISTED);
+        mutex_lock(&crono_buff_wrappers_lock);
+        list_add_tail(&bw->ntrn.list, head);
+        mutex_unlock(&crono_buff_wrappers_lock);
+        priv->listed[priv->listed_nr++] = bw;
+}
+
+static int crono_kunit_check_limits(CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
+        int ret;
+
+        mutex_lock(&crono_buff_wrappers_lock);
+        ret = _crono_check_pinned_limits(bw);
+        mutex_unlock(&crono_buff_wrappers_lock);
+
+        return ret;
+}
+
+// _____________________________________________________________________________
+// Release Ordering
+//
+static void crono_kunit_record_step(struct kunit *test, int step) {
+        struct crono_kunit_priv *priv = test->priv;
+
+        if (priv->steps_nr < CRONO_KUNIT_MAX_STEPS)
+                priv->steps[priv->steps_nr] = step;
+        priv->steps_nr++;
+}
+
+static int crono_kunit_unmap_stub(CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
+        struct kunit *test = kunit_get_current_test();
+
+        crono_kunit_record_step(test, CRONO_KUNIT_STEP_UNMAP);
+        // Nothing is DMA mapped, only free the table
+        crono_kvfree(bw->sgt);
+        bw->sgt = NULL;
+
+        return CRONO_SUCCESS;
+}
+
+static int crono_kunit_unpin_stub(CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
+        struct kunit *test = kunit_get_current_test();
+
+        struct crono_kunit_priv *priv = test->priv;
+
+        // The DMA mapping must be gone before its pages are unpinned
+        KUNIT_EXPECT_NULL(test, bw->sgt);
+        crono_kunit_record_step(test, CRONO_KUNIT_STEP_UNPIN);
+        priv->unpinned_nr += bw->pinned_pages_nr;
+
+        return CRONO_SUCCESS;
+}
+
+/**
+ * Allocate a wrapper with pinned pages, and mapped if `mapped`, that
+ * `_crono_release_sg_buff_wrapper` releases through the test stubs.
+ */
+static CRONO_SG_BUFFER_INFO_WRAPPER *
+crono_kunit_alloc_released_bw(struct kunit *test, bool mapped) {
+        CRONO_SG_BUFFER_INFO_WRAPPER *bw;
+
+        kunit_activate_static_stub(test, _crono_unmap_sg_buff_wrapper,
+                                   crono_kunit_unmap_stub);
+        kunit_activate_static_stub(test, _crono_unpin_sg_buff_wrapper,
+                                   crono_kunit_unpin_stub);
+
+        // No miscdev and no process, so nothing is counted or uncharged
+        bw = crono_kunit_alloc_sg_bw(
+            test, kunit_kzalloc(test, sizeof(struct device), GFP_KERNEL), NULL,
+            2);
+        KUNIT_ASSERT_NOT_NULL(test, bw->ntrn.devp);
+        bw->pinned_pages_nr = bw->buff_info.pages_count;
+        bw->kernel_pages =
+            kvcalloc(bw->pinned_pages_nr, sizeof(void *), GFP_KERNEL);
+        KUNIT_ASSERT_NOT_NULL(test, bw->kernel_pages);
+        if (mapped) {
+                bw->sgt = kvzalloc(sizeof(struct sg_table), GFP_KERNEL);
+                KUNIT_ASSERT_NOT_NULL(test, bw->sgt);
+        }
+
+        return bw;
+}
+
+static void crono_kunit_release_unmaps_before_unpin(struct kunit *test) {
+        struct crono_kunit_priv *priv = test->priv;
+        CRONO_SG_BUFFER_INFO_WRAPPER *bw;
+
+        bw = crono_kunit_alloc_released_bw(test, true);
+        KUNIT_EXPECT_EQ(test, _crono_release_sg_buff_wrapper(bw),
+                        CRONO_SUCCESS);
+        KUNIT_ASSERT_EQ(test, priv->steps_nr, 2);
+        KUNIT_EXPECT_EQ(test, priv->steps[0], CRONO_KUNIT_STEP_UNMAP);
+        KUNIT_EXPECT_EQ(test, priv->steps[1], CRONO_KUNIT_STEP_UNPIN);
+}
+
+static void crono_kunit_release_unmapped_only_unpins(struct kunit *test) {
+        struct crono_kunit_priv *priv = test->priv;
+        CRONO_SG_BUFFER_INFO_WRAPPER *bw;
+
+        // Locking failed after pinning, before mapping
+        bw = crono_kunit_alloc_released_bw(test, false);
+        KUNIT_EXPECT_EQ(test, _crono_release_sg_buff_wrapper(bw),
+                        CRONO_SUCCESS);
+        KUNIT_ASSERT_EQ(test, priv->steps_nr, 1);
+        KUNIT_EXPECT_EQ(test, priv->steps[0], CRONO_KUNIT_STEP_UNPIN);
+}
+
+static void crono_kunit_release_unpinned(struct kunit *test) {
+        struct crono_kunit_priv *priv = test->priv;
+        CRONO_SG_BUFFER_INFO_WRAPPER *bw;
+
+        // Locking failed before pinning
+        bw = crono_kunit_alloc_released_bw(test, false);
+        crono_kvfree(bw->kernel_pages);
+        bw->kernel_pages = NULL;
+        KUNIT_EXPECT_EQ(test, _crono_release_sg_buff_wrapper(bw),
+                        CRONO_SUCCESS);
+        KUNIT_EXPECT_EQ(test, priv->steps_nr, 0);
+}
+
+// _____________________________________________________________________________
+// Pinned Limits
+//
+static void crono_kunit_limits_unlimited(struct kunit *test) {
+        struct crono_kunit_priv *priv = test->priv;
+
+        WRITE_ONCE(max_pinned_bytes_per_device, 0);
+        WRITE_ONCE(max_pinned_bytes_per_process, 0);
+        crono_kunit_list_bw(test, &sg_buff_wrappers_head,
+                            crono_kunit_alloc_sg_bw(test, priv->devp[0],
+                                                    priv->mm[0], 1024));
+        KUNIT_EXPECT_EQ(test,
+                        crono_kunit_check_limits(crono_kunit_alloc_sg_bw(
+                            test, priv->devp[0], priv->mm[0], 1024)),
+                        CRONO_SUCCESS);
+}
+
+static void crono_kunit_limits_per_device(struct kunit *test) {
+        struct crono_kunit_priv *priv = test->priv;
+
+        WRITE_ONCE(max_pinned_bytes_per_device, 3 * PAGE_SIZE);
+        WRITE_ONCE(max_pinned_bytes_per_process, 0);
+        crono_kunit_list_bw(
+            test, &sg_buff_wrappers_head,
+            crono_kunit_alloc_sg_bw(test, priv->devp[0], priv->mm[0], 2));
+
+        // Reaching the limit is allowed
+        KUNIT_EXPECT_EQ(test,
+                        crono_kunit_check_limits(crono_kunit_alloc_sg_bw(
+                            test, priv->devp[0], priv->mm[1], 1)),
+                        CRONO_SUCCESS);
+        KUNIT_EXPECT_EQ(test,
+                        crono_kunit_check_limits(crono_kunit_alloc_sg_bw(
+                            test, priv->devp[0], priv->mm[1], 2)),
+                        -EDQUOT);
+        // Buffers of other devices are not counted
+        KUNIT_EXPECT_EQ(test,
+                        crono_kunit_check_limits(crono_kunit_alloc_sg_bw(
+                            test, priv->devp[1], priv->mm[0], 2)),
+                        CRONO_SUCCESS);
+}
+
+static void crono_kunit_limits_per_process(struct kunit *test) {
+        struct crono_kunit_priv *priv = test->priv;
+
+        WRITE_ONCE(max_pinned_bytes_per_device, 0);
+        WRITE_ONCE(max_pinned_bytes_per_process, 3 * PAGE_SIZE);
+        crono_kunit_list_bw(
+            test, &sg_buff_wrappers_head,
+            crono_kunit_alloc_sg_bw(test, priv->devp[0], priv->mm[0], 2));
+
+        // Buffers of the process on all devices are counted
+        KUNIT_EXPECT_EQ(test,
+                        crono_kunit_check_limits(crono_kunit_alloc_sg_bw(
+                            test, priv->devp[1], priv->mm[0], 2)),
+                        -EDQUOT);
+        KUNIT_EXPECT_EQ(test,
+                        crono_kunit_check_limits(crono_kunit_alloc_sg_bw(
+                            test, priv->devp[0], priv->mm[1], 2)),
+                        CRONO_SUCCESS);
+}
+
+static void crono_kunit_limits_count_teardown(struct kunit *test) {
+        struct crono_kunit_priv *priv = test->priv;
+        CRONO_SG_BUFFER_INFO_WRAPPER *contig_bw;
+
+        WRITE_ONCE(max_pinned_bytes_per_device, 3 * PAGE_SIZE);
+        WRITE_ONCE(max_pinned_bytes_per_process, 3 * PAGE_SIZE);
+
+        // Contiguous buffers don't pin pages
+        contig_bw =
+            crono_kunit_alloc_sg_bw(test, priv->devp[0], priv->mm[0], 2);
+        contig_bw->ntrn.bwt = BWT_CONTIG;
+        crono_kunit_list_bw(test, &crono_teardown_head, contig_bw);
+        KUNIT_EXPECT_EQ(test,
+                        crono_kunit_check_limits(crono_kunit_alloc_sg_bw(
+                            test, priv->devp[0], priv->mm[0], 2)),
+                        CRONO_SUCCESS);
+
+        // Unlocked buffers are pinned until the deferred teardown
+        crono_kunit_list_bw(
+            test, &crono_teardown_head,
+            crono_kunit_alloc_sg_bw(test, priv->devp[0], priv->mm[0], 2));
+        KUNIT_EXPECT_EQ(test,
+                        crono_kunit_check_limits(crono_kunit_alloc_sg_bw(
+                            test, priv->devp[0], priv->mm[1], 2)),
+                        -EDQUOT);
+        KUNIT_EXPECT_EQ(test,
+                        crono_kunit_check_limits(crono_kunit_alloc_sg_bw(
+                            test, priv->devp[1], priv->mm[0], 2)),
+                        -EDQUOT);
+}
+
+// _____________________________________________________________________________
+// Lock Path
+//
+// The SG buffers are locked through the driver functions on pages allocated
+// by the test, handed out by the pinning stub instead of pinning user pages,
+// and DMA mapped for a root device using the direct mapping.
+//
+#define CRONO_KUNIT_TIMING_ROUNDS 16
+
+enum crono_kunit_lock_step {
+        CRONO_KUNIT_LOCK_INIT,
+        CRONO_KUNIT_LOCK_PIN,
+        CRONO_KUNIT_LOCK_GEN_SG,
+        CRONO_KUNIT_LOCK_RELEASE,
+        CRONO_KUNIT_LOCK_STEPS_COUNT
+};
+
+static int crono_kunit_get_crono_dev_stub(struct file *filp,
+                                          struct crono_miscdev **crono_devpp) {
+        struct crono_kunit_priv *priv = kunit_get_current_test()->priv;
+
+        // The tests have no device file
+        if (++priv->dev_calls_nr == priv->fail_dev_call)
+                return -ENODATA;
+        *crono_devpp = priv->crono_dev;
+
+        return CRONO_SUCCESS;
+}
+
+static int crono_kunit_charge_stub(CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
+        struct crono_kunit_priv *priv = kunit_get_current_test()->priv;
+        struct mm_struct *mm = priv->mm[0];
+
+        // The test thread has no process memory, the fake one is charged
+        // instead, and uncharged by `_crono_uncharge_pinned_vm`
+#ifndef OLD_KERNEL_FOR_PIN
+        atomic64_add(bw->buff_info.pages_count, &mm->pinned_vm);
+#endif
+        mmgrab(mm);
+        bw->mm = mm;
+
+        return CRONO_SUCCESS;
+}
+
+static long crono_kunit_pin_user_pages_stub(unsigned long start,
+                                            unsigned long nr_pages,
+                                            unsigned int gup_flags,
+                                            struct page **pages) {
+        struct kunit *test = kunit_get_current_test();
+        struct crono_kunit_priv *priv = test->priv;
+        unsigned long first = (start - CRONO_KUNIT_USER_ADDR) >> PAGE_SHIFT;
+        unsigned long ipage;
+
+        if (priv->pin_limit >= 0 &&
+            priv->pinned_nr + nr_pages > (unsigned long)priv->pin_limit)
+                return -ENOMEM;
+        KUNIT_EXPECT_LE(test, first + nr_pages, (unsigned long)priv->pages_nr);
+        if (first + nr_pages > priv->pages_nr)
+                return -EFAULT;
+        for (ipage = 0; ipage < nr_pages; ipage++)
+                pages[ipage] = priv->pages[first + ipage];
+        priv->pinned_nr += nr_pages;
+
+        return nr_pages;
+}
+
+/**
+ * Set up the lock path of `pages_nr` test pages, for `locked_nr` wrappers
+ * locked at once.
+ */
+static void crono_kunit_init_lock_path(struct kunit *test, int pages_nr,
+                                       int locked_nr) {
+        struct crono_kunit_priv *priv = test->priv;
+        struct crono_miscdev *crono_dev;
+        struct device *dev;
+
+        crono_dev = kunit_kzalloc(test, sizeof(*crono_dev), GFP_KERNEL);
+        KUNIT_ASSERT_NOT_NULL(test, crono_dev);
+        snprintf(crono_dev->name, CRONO_DEV_NAME_MAX_SIZE, "crono_kunit");
+        priv->crono_dev = crono_dev;
+        crono_dev->stats = alloc_percpu(struct crono_dev_stats);
+        KUNIT_ASSERT_NOT_NULL(test, crono_dev->stats);
+        dev = root_device_register("crono_kunit");
+        crono_dev->dma_dev = dev;
+        KUNIT_ASSERT_NOT_ERR_OR_NULL(test, dev);
+        dev->dma_mask = &dev->coherent_dma_mask;
+        KUNIT_ASSERT_EQ(test, dma_set_mask_and_coherent(dev, DMA_BIT_MASK(64)),
+                        0);
+        dev_set_drvdata(dev, crono_dev);
+
+        // Only the first page of every order 1 block is used, so no two pages
+        // are adjacent, and every page is a DMA segment, as with fragmented
+        // user memory
+        priv->pages =
+            kunit_kcalloc(test, pages_nr, sizeof(struct page *), GFP_KERNEL);
+        KUNIT_ASSERT_NOT_NULL(test, priv->pages);
+        for (; priv->pages_nr < pages_nr; priv->pages_nr++) {
+                priv->pages[priv->pages_nr] = alloc_pages(GFP_KERNEL, 1);
+                KUNIT_ASSERT_NOT_NULL(test, priv->pages[priv->pages_nr]);
+        }
+        priv->locked = kunit_kcalloc(test, locked_nr, sizeof(*priv->locked),
+                                     GFP_KERNEL);
+        KUNIT_ASSERT_NOT_NULL(test, priv->locked);
+        priv->locked_nr = locked_nr;
+        priv->pin_limit = -1;
+
+        // Referenced by the charged wrappers only
+        atomic_set(&priv->mm[0]->mm_count, 1);
+        WRITE_ONCE(max_pinned_bytes_per_device, 0);
+        WRITE_ONCE(max_pinned_bytes_per_process, 0);
+
+        kunit_activate_static_stub(test, _crono_get_crono_dev_from_filp,
+                                   crono_kunit_get_crono_dev_stub);
+        kunit_activate_static_stub(test, _crono_charge_pinned_vm,
+                                   crono_kunit_charge_stub);
+        kunit_activate_static_stub(test, _crono_pin_user_pages,
+                                   crono_kunit_pin_user_pages_stub);
+        kunit_activate_static_stub(test, _crono_unpin_sg_buff_wrapper,
+                                   crono_kunit_unpin_stub);
+}
+
+/**
+ * Fill `lock_info` of the `ibuffer`th buffer of `pages_count` test pages.
+ */
+static void crono_kunit_fill_lock_info(CRONO_SG_BUFFER_LOCK_INFO *lock_info,
+                                       int ibuffer, uint32_t pages_count) {
+        memset(lock_info, 0, sizeof(*lock_info));
+        lock_info->buff_info.addr =
+            (void *)(CRONO_KUNIT_USER_ADDR +
+                     (unsigned long)ibuffer * pages_count * PAGE_SIZE);
+        lock_info->buff_info.size = (size_t)pages_count * PAGE_SIZE;
+        lock_info->buff_info.pages_count = pages_count;
+        lock_info->dma_dir = CRONO_DMA_FROM_DEVICE;
+}
+
+static void crono_kunit_expect_mapped(struct kunit *test,
+                                      CRONO_SG_BUFFER_INFO_WRAPPER *bw) {
+        struct scatterlist *sg;
+        int i;
+
+        KUNIT_EXPECT_EQ(test, bw->pinned_pages_nr,
+                        (int)bw->buff_info.pages_count);
+        KUNIT_ASSERT_EQ(test, bw->mapped_nents, (int)bw->buff_info.pages_count);
+        for_each_sg(((struct sg_table *)bw->sgt)->sgl, sg, bw->mapped_nents,
+                    i) {
+                KUNIT_EXPECT_EQ(test, bw->userspace_pages[i],
+                                sg_dma_address(sg));
+        }
+}
+
+/**
+ * Expect everything the lock path took is given back, after `errors_nr` locks
+ * failed.
+ */
+static void crono_kunit_expect_unwound(struct kunit *test, int errors_nr) {
+        struct crono_kunit_priv *priv = test->priv;
+        struct crono_miscdev *crono_dev = priv->crono_dev;
+
+        KUNIT_EXPECT_EQ(test, priv->unpinned_nr, priv->pinned_nr);
+        KUNIT_EXPECT_EQ(test, CRONO_STAT_READ(crono_dev, pinned_bytes), 0);
+        KUNIT_EXPECT_EQ(test, CRONO_STAT_READ(crono_dev, sg_buffers), 0);
+        KUNIT_EXPECT_EQ(test, CRONO_STAT_READ(crono_dev, lock_errors),
+                        errors_nr);
+#ifndef OLD_KERNEL_FOR_PIN
+        KUNIT_EXPECT_EQ(test, atomic64_read(&priv->mm[0]->pinned_vm), 0);
+#endif
+        KUNIT_EXPECT_EQ(test, atomic_read(&priv->mm[0]->mm_count), 1);
+}
+
+struct crono_kunit_lock_param {
+        uint32_t pages_count; // Pages of every buffer
+        int buffers_nr;       // Buffers locked at once
+};
+
+static const struct crono_kunit_lock_param crono_kunit_lock_params[] = {
+    {1, 1}, {1, 64}, {16, 64}, {256, 4}, {1024, 1}};
+
+static void
+crono_kunit_lock_param_desc(const struct crono_kunit_lock_param *param,
+                            char *desc) {
+        snprintf(desc, KUNIT_PARAM_DESC_SIZE, "%u pages x %d buffers",
+                 param->pages_count, param->buffers_nr);
+}
+
+KUNIT_ARRAY_PARAM(crono_kunit_lock, crono_kunit_lock_params,
+                  crono_kunit_lock_param_desc);
+
+static void crono_kunit_lock_timing(struct kunit *test) {
+        const struct crono_kunit_lock_param *param = test->param_value;
+        struct crono_kunit_priv *priv;
+        CRONO_SG_BUFFER_LOCK_INFO lock_info;
+        CRONO_SG_BUFFER_INFO_WRAPPER *bw;
+        u64 step_ns[CRONO_KUNIT_LOCK_STEPS_COUNT] = {0};
+        u64 start_ns, ops_nr;
+        int round, ibuffer;
+
+        crono_kunit_init_lock_path(test, param->pages_count * param->buffers_nr,
+                                   param->buffers_nr);
+        priv = test->priv;
+        for (round = 0; round < CRONO_KUNIT_TIMING_ROUNDS; round++) {
+                for (ibuffer = 0; ibuffer < param->buffers_nr; ibuffer++) {
+                        crono_kunit_fill_lock_info(&lock_info, ibuffer,
+                                                   param->pages_count);
+                        start_ns = ktime_get_ns();
+                        KUNIT_ASSERT_EQ(test,
+                                        _crono_init_sg_buff_wrapper(
+                                            NULL, &lock_info, &bw),
+                                        CRONO_SUCCESS);
+                        step_ns[CRONO_KUNIT_LOCK_INIT] +=
+                            ktime_get_ns() - start_ns;
+                        priv->locked[ibuffer] = bw;
+
+                        start_ns = ktime_get_ns();
+                        KUNIT_ASSERT_EQ(test,
+                                        _crono_miscdev_ioctl_pin_buffer(
+                                            NULL, bw, GUP_NR_PER_CALL),
+                                        CRONO_SUCCESS);
+                        step_ns[CRONO_KUNIT_LOCK_PIN] +=
+                            ktime_get_ns() - start_ns;
+
+                        start_ns = ktime_get_ns();
+                        KUNIT_ASSERT_EQ(
+                            test, _crono_miscdev_ioctl_generate_sg(NULL, bw),
+                            CRONO_SUCCESS);
+                        step_ns[CRONO_KUNIT_LOCK_GEN_SG] +=
+                            ktime_get_ns() - start_ns;
+                        crono_kunit_expect_mapped(test, bw);
+                }
+                for (ibuffer = 0; ibuffer < param->buffers_nr; ibuffer++) {
+                        bw = priv->locked[ibuffer];
+                        priv->locked[ibuffer] = NULL;
+                        start_ns = ktime_get_ns();
+                        _crono_drop_buff_wrapper(bw);
+                        step_ns[CRONO_KUNIT_LOCK_RELEASE] +=
+                            ktime_get_ns() - start_ns;
+                }
+        }
+        ops_nr = CRONO_KUNIT_TIMING_ROUNDS * param->buffers_nr;
+        KUNIT_EXPECT_EQ(test, priv->pinned_nr,
+                        (int)(ops_nr * param->pages_count));
+        crono_kunit_expect_unwound(test, 0);
+
+        kunit_info(test,
+                   "%u pages x %d buffers: init <%llu>, pin <%llu>, gen_sg "
+                   "<%llu>, release <%llu> ns/op",
+                   param->pages_count, param->buffers_nr,
+                   div64_u64(step_ns[CRONO_KUNIT_LOCK_INIT], ops_nr),
+                   div64_u64(step_ns[CRONO_KUNIT_LOCK_PIN], ops_nr),
+                   div64_u64(step_ns[CRONO_KUNIT_LOCK_GEN_SG], ops_nr),
+                   div64_u64(step_ns[CRONO_KUNIT_LOCK_RELEASE], ops_nr));
+}
+
+/**
+ * Lock a buffer of `pages_count` test pages using `_crono_lock_sg_buffer`,
+ * expected to fail.
+ *
+ * @return The error of `_crono_lock_sg_buffer`.
+ */
+static int crono_kunit_lock_failing(struct kunit *test, uint32_t pages_count,
+                                    uint32_t flags) {
+        struct crono_kunit_priv *priv = test->priv;
+        CRONO_SG_BUFFER_LOCK_INFO lock_info;
+
+        crono_kunit_fill_lock_info(&lock_info, 0, pages_count);
+        lock_info.flags = flags;
+
+        // `arg` is not copied back before the last step
+        return _crono_lock_sg_buffer(NULL, priv->crono_dev, &lock_info, 0,
+                                     sizeof(lock_info), NULL, 0);
+}
+
+static void crono_kunit_lock_init_fails(struct kunit *test) {
+        struct crono_kunit_priv *priv;
+
+        crono_kunit_init_lock_path(test, 2, 1);
+        priv = test->priv;
+
+        // Exceeding the limits fails after the pages are charged
+        WRITE_ONCE(max_pinned_bytes_per_device, PAGE_SIZE);
+        KUNIT_EXPECT_EQ(test, crono_kunit_lock_failing(test, 2, 0), -EDQUOT);
+        KUNIT_EXPECT_EQ(test, priv->pinned_nr, 0);
+        crono_kunit_expect_unwound(test, 1);
+}
+
+static void crono_kunit_lock_pin_fails(struct kunit *test) {
+        struct crono_kunit_priv *priv;
+
+        crono_kunit_init_lock_path(test, GUP_NR_PER_CALL + 1, 1);
+        priv = test->priv;
+
+        // The pages pinned by the first call are unpinned
+        priv->pin_limit = GUP_NR_PER_CALL;
+        KUNIT_EXPECT_EQ(test,
+                        crono_kunit_lock_failing(test, GUP_NR_PER_CALL + 1, 0),
+                        -ENOMEM);
+        KUNIT_EXPECT_EQ(test, CRONO_STAT_READ(priv->crono_dev, maps), 0);
+        crono_kunit_expect_unwound(test, 1);
+}
+
+static void crono_kunit_lock_gen_sg_fails(struct kunit *test) {
+        struct crono_kunit_priv *priv;
+
+        crono_kunit_init_lock_path(test, 2, 1);
+        priv = test->priv;
+
+        // The first call is of `_crono_init_sg_buff_wrapper`
+        priv->fail_dev_call = 2;
+        KUNIT_EXPECT_EQ(test, crono_kunit_lock_failing(test, 2, 0), -ENODATA);
+        KUNIT_EXPECT_EQ(test, priv->pinned_nr, 2);
+        KUNIT_EXPECT_EQ(test, CRONO_STAT_READ(priv->crono_dev, maps), 0);
+        crono_kunit_expect_unwound(test, 1);
+}
+
+static void crono_kunit_lock_fails_mapped(struct kunit *test) {
+        struct crono_kunit_priv *priv;
+
+        crono_kunit_init_lock_path(test, 2, 1);
+        priv = test->priv;
+
+        // The test pages are not adjacent, so are never a single DMA range,
+        // the mapped buffer is unmapped before it's unpinned
+        KUNIT_EXPECT_EQ(test,
+                        crono_kunit_lock_failing(
+                            test, 2, CRONO_SG_LOCK_FLAG_SINGLE_IOVA),
+                        -EOPNOTSUPP);
+        KUNIT_EXPECT_EQ(test, CRONO_STAT_READ(priv->crono_dev, maps), 1);
+        crono_kunit_expect_unwound(test, 1);
+}
+
+// _____________________________________________________________________________
+// Suite
+//
+static struct kunit_case crono_kunit_cases[] = {
+    KUNIT_CASE(crono_kunit_release_unmaps_before_unpin),
+    KUNIT_CASE(crono_kunit_release_unmapped_only_unpins),
+    KUNIT_CASE(crono_kunit_release_unpinned),
+    KUNIT_CASE(crono_kunit_limits_unlimited),
+    KUNIT_CASE(crono_kunit_limits_per_device),
+    KUNIT_CASE(crono_kunit_limits_per_process),
+    KUNIT_CASE(crono_kunit_limits_count_teardown),
+    KUNIT_CASE_PARAM(crono_kunit_lock_timing, crono_kunit_lock_gen_params),
+    KUNIT_CASE(crono_kunit_lock_init_fails),
+    KUNIT_CASE(crono_kunit_lock_pin_fails),
+    KUNIT_CASE(crono_kunit_lock_gen_sg_fails),
+    KUNIT_CASE(crono_kunit_lock_fails_mapped),
+    {}};
+
+static struct kunit_suite crono_kunit_suite = {
+    .name = "crono",
+    .init = crono_kunit_init,
+    .exit = crono_kunit_exit,
+    .test_cases = crono_kunit_cases,
+};
+
+kunit_test_suite(crono_kunit_suite);
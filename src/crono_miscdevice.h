@@ -19,6 +19,215 @@
 static int _crono_miscdev_init(struct pci_dev *dev,
                                const struct pci_device_id *id,
                                struct crono_miscdev **crono_dev);
+
+/**
+ * Claim a free record in `crono_miscdev_pool` under
+ * `crono_miscdev_pool_lock`, so parallel probes get distinct records.
+ * Records given back by `_crono_miscdev_unclaim` are reused first.
+ *
+ * @return the claimed record, or NULL if all records are used.
+ */
+static struct crono_miscdev *_crono_miscdev_claim(void);
+
+/**
+ * Reset the record `crono_dev` of a device that failed to initialize, and
+ * give it back under `crono_miscdev_pool_lock`. The reset record is skipped
+ * by the file operations as its minor is 0.
+ */
+static void _crono_miscdev_unclaim(struct crono_miscdev *crono_dev);
+
+/**
+ * Register the miscdev of a device initialized in the pool, either PCI or
+ * emulated, having its `device_id`, `dbdf` and `dma_dev` set.
+ * The pool record is reset in case of error.
+ *
+ * @param new_crono_miscdev[in/out]: the initialized pool record.
+ * @param crono_dev[out]: set to `new_crono_miscdev` on success.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `errno` in case of error.
+ */
+static int _crono_miscdev_register(struct crono_miscdev *new_crono_miscdev,
+                                   struct crono_miscdev **crono_dev);
+
+/**
+ * Register `emulated_devices` software emulated devices, each as a platform
+ * device used for DMA, with a miscdev like the PCI devices, and a thread
+ * writing `CRONO_EMULATED_PACKET` into its locked SG buffers.
+ * Errors are logged, the devices registered before the error are kept.
+ */
+static void _crono_emu_init(void);
+
+/**
+ * Stop the emulation thread of `crono_dev` if any.
+ * The platform device is unregistered by `_crono_emu_exit`.
+ */
+static void _crono_emu_stop(struct crono_miscdev *crono_dev);
+
+/**
+ * Unregister the platform devices of all emulated devices, called after their
+ * buffers are released.
+ */
+static void _crono_emu_exit(void);
+
+/**
+ * The emulation thread of an emulated device `data` (`struct crono_miscdev`).
+ * Every `CRONO_EMU_PERIOD_US`, writes the packets due according to
+ * `emulated_packet_rate` into the device locked and DMA mapped SG buffers,
+ * the same way the device DMA would.
+ */
+static int _crono_emu_thread(void *data);
+
+/**
+ * Get the emulated device buffer to write the next packet into, the current
+ * buffer if it has room, or the next locked buffer by id, wrapping around.
+ * `crono_buff_wrappers_lock` must be held.
+ *
+ * @return the buffer wrapper, or NULL if the device has no buffer mapped.
+ */
+static CRONO_SG_BUFFER_INFO_WRAPPER *
+_crono_emu_next_bw(struct crono_miscdev *crono_dev);
+
+/**
+ * Copy `len` bytes from `src` into the pinned pages of `bw` at `offset` from
+ * the buffer start, as the device DMA would. Called with a reference of `bw`
+ * held, and with no lock.
+ */
+static void _crono_emu_write(CRONO_SG_BUFFER_INFO_WRAPPER *bw, size_t offset,
+                             const void *src, size_t len);
+
+/**
+ * Allocate the status page of `crono_dev`, `CRONO_STATUS_PAGE` at the start
+ * of one page of coherent memory. The device works without it if the
+ * allocation fails.
+ */
+static void _crono_status_page_init(struct crono_miscdev *crono_dev);
+
+/**
+ * Free the status page of `crono_dev` if allocated.
+ */
+static void _crono_status_page_exit(struct crono_miscdev *crono_dev);
+
+/**
+ * Write the DMA progress of the emulated device `crono_dev` into its status
+ * page, as the device firmware does for the PCI devices. `seq` is odd while
+ * the members are updated.
+ * Must be called with `crono_buff_wrappers_lock` held.
+ */
+static void _crono_status_page_update(struct crono_miscdev *crono_dev,
+                                      int buffer_id, u64 write_offset);
+
+/**
+ * Initialize the streaming ring lock and wait queue of `crono_dev`, the ring
+ * itself is allocated by `IOCTL_CRONO_RING_SETUP`.
+ */
+static void _crono_ring_init(struct crono_miscdev *crono_dev);
+
+/**
+ * Allocate `pages_count` pages near the device of `crono_dev`, map them for
+ * the device DMA writes one by one, and fill the ring addresses table.
+ * Returns NULL on failure.
+ */
+static struct crono_ring *_crono_ring_alloc(struct crono_miscdev *crono_dev,
+                                            u32 pages_count);
+
+/**
+ * Unmap the ring pages from the device.
+ */
+static void _crono_ring_unmap(struct crono_ring *ring);
+
+/**
+ * `kref` release of the ring, called when the device, the pipes, and the
+ * splice descriptors are all done with it.
+ */
+static void _crono_ring_release(struct kref *ref);
+
+/**
+ * Detach the ring of `crono_dev` if any, unmap it from the device, and wake
+ * the waiting readers. The pages are freed once the pipes release them.
+ */
+static void _crono_ring_free(struct crono_miscdev *crono_dev);
+
+/**
+ * Return the count of bytes, up to `max`, that can be written at the ring
+ * head without overwriting unconsumed data, or pages still held by pipes.
+ * Must be called with `ring_lock` held.
+ */
+static u64 _crono_ring_space(struct crono_miscdev *crono_dev, u64 max);
+
+/**
+ * Sync `len` bytes of the ring at `pos` for the CPU if `for_cpu`, or back for
+ * the device otherwise.
+ */
+static void _crono_ring_sync(struct crono_miscdev *crono_dev, u64 pos,
+                             u64 len, bool for_cpu);
+
+/**
+ * Copy `len` bytes from `src` into the ring at `pos`, as the device DMA would.
+ */
+static void _crono_ring_write(struct crono_ring *ring, u64 pos,
+                              const void *src, size_t len);
+
+/**
+ * Wait until the ring of `crono_dev` has data, or is freed.
+ * Returns -EAGAIN if `nonblock` and the ring is empty.
+ */
+static int _crono_ring_wait(struct crono_miscdev *crono_dev, bool nonblock);
+
+/**
+ * Write up to `due` packets of the emulated device `crono_dev` to its ring,
+ * as many as fit. `written` is set to the count of packets written, and `head`
+ * to the ring head.
+ * Returns false if the device has no ring.
+ */
+static bool _crono_emu_write_ring(struct crono_miscdev *crono_dev,
+                                  CRONO_EMULATED_PACKET *packet, u64 due,
+                                  u64 *written, u64 *head);
+
+/**
+ * Allocate the streaming ring of the device of `filp`, and fill its size.
+ * Fails with -EBUSY if the device already has a ring.
+ *
+ * @param arg[in/out]: is a pointer to valid `CRONO_RING_SETUP_INFO` object in
+ * user space memory.
+ */
+static int _crono_miscdev_ioctl_ring_setup(struct file *filp,
+                                           unsigned long arg);
+
+/**
+ * Advance the ring head by `bytes` if `produce`, for emulated devices only, or
+ * the ring tail otherwise, and fill the ring positions.
+ *
+ * @param arg[in/out]: is a pointer to valid `CRONO_RING_POS` object in user
+ * space memory.
+ */
+static int _crono_miscdev_ioctl_ring_move(struct file *filp,
+                                          unsigned long arg, bool produce);
+
+/**
+ * The `read()` function in miscellaneous device driver `file_operations`
+ * structure, copies the ring data at its tail to `buf`, and consumes it.
+ */
+static ssize_t crono_miscdev_read(struct file *filp, char __user *buf,
+                                  size_t count, loff_t *ppos);
+
+/**
+ * The `poll()` function in miscellaneous device driver `file_operations`
+ * structure, the device is readable when its ring has data.
+ */
+static __poll_t crono_miscdev_poll(struct file *filp,
+                                   struct poll_table_struct *wait);
+
+#ifdef KERNEL_5_8_OR_LATER
+/**
+ * The `splice_read()` function in miscellaneous device driver
+ * `file_operations` structure, moves the ring pages at its tail to `pipe`
+ * with no copy, and consumes them. The pages are not overwritten until the
+ * pipe releases them.
+ */
+static ssize_t crono_miscdev_splice_read(struct file *filp, loff_t *ppos,
+                                         struct pipe_inode_info *pipe,
+                                         size_t len, unsigned int flags);
+#endif
 /**
  * The `open()` function in miscellaneous device driver `file_operations`
  * structure.
@@ -55,6 +264,15 @@ static int crono_miscdev_release(struct inode *inode, struct file *file);
 static long crono_miscdev_ioctl(struct file *file, unsigned int cmd,
                                 unsigned long arg);
 
+/**
+ * Emit the `crono_ioctl` tracepoint of the ioctl `cmd` done with `ret`,
+ * started at `start_ns`. The ioctl argument is read back from userspace to
+ * get its buffer id, size and options, so it's called only when the
+ * tracepoint is enabled.
+ */
+static void _crono_trace_ioctl(struct file *filp, unsigned int cmd,
+                               unsigned long arg, int ret, u64 start_ns);
+
 /**
  * Fills the strcutre `dbdf` values from the device `dev` information.
  *
@@ -70,18 +288,295 @@ static int _crono_get_DBDF_from_dev(struct pci_dev *dev,
  * Internal function that locks a memory buffer using ioctl().
  * Calls 'pin_user_pages`.
  *
- * It locks the buffer, and `copy_to_user` is called for all memory.
+ * It locks the buffer, and `copy_to_user` is called for all memory. The pages
+ * addresses are copied only if `upages` is set, otherwise, userspace can map
+ * them using `CRONO_MMAP_TYPE_SG_ADDR_TABLE`.
  *
  * @param filp[in]: the file descriptor passed to ioctl.
  * @param arg[in/out]: is a valid `CRONO_SG_BUFFER_INFO` object pointer in user
  * space memory. The object should have all members set, except the `id`, which
  * will be sit inside this function upon successful return.
+ * It can be `CRONO_SG_BUFFER_LOCK_INFO` object pointer as well, having the
+ * same `CRONO_SG_BUFFER_INFO` members set.
+ * @param arg_size[in]: size of the object pointed to by `arg`.
  *
  * @return `CRONO_SUCCESS` in case of no error, or `errno` in case of error.
  */
 static int _crono_miscdev_ioctl_lock_sg_buffer(struct file *filp,
+                                               unsigned long arg,
+                                               size_t arg_size);
+
+/**
+ * Lock the buffer of `lock_info`, already copied from user space, then copy
+ * `lock_info` back to `arg`, of `arg_size` bytes.
+ * Buffers of a `backing_file` range at `backing_offset` are mapped by the
+ * caller only while locking, their pinned pages are checked to be the file
+ * pages, and their `buff_info.addr` is returned as NULL.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `errno` in case of error.
+ */
+static int _crono_lock_sg_buffer(struct file *filp,
+                                 struct crono_miscdev *crono_dev,
+                                 CRONO_SG_BUFFER_LOCK_INFO *lock_info,
+                                 unsigned long arg, size_t arg_size,
+                                 struct file *backing_file,
+                                 u64 backing_offset);
+
+/**
+ * Check the pinned pages of `bw` are the pages of `file` from `offset`, not of
+ * another mapping that replaced the file range mapped by the module.
+ *
+ * @return `CRONO_SUCCESS`, or `-EAGAIN` if a page is not of the file range.
+ */
+static int _crono_check_file_pages(const CRONO_SG_BUFFER_INFO_WRAPPER *bw,
+                                   struct file *file, u64 offset);
+
+/**
+ * Lock a buffer backed by a range of a memfd, shmem or hugetlbfs file.
+ * The range is mapped temporarily in the caller using `vm_mmap`, its pages
+ * are pinned as any locked buffer, then it's unmapped. The pinned pages stay
+ * in the file page cache, shared with every process mapping the file.
+ *
+ * @param arg[in/out]: is a pointer to valid `CRONO_FD_BUFFER_LOCK_INFO` object
+ * in user space memory.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `errno` in case of error.
+ */
+static int _crono_miscdev_ioctl_lock_fd_buffer(struct file *filp,
                                                unsigned long arg);
 
+/**
+ * Count the DMA segments of the buffer `bw` that are bounce buffered by
+ * `swiotlb`, i.e. mapped to a DMA address other than their own physical
+ * address while no translating IOMMU is used.
+ *
+ * @param bw[in]: a buffer wrapper mapped by `_crono_miscdev_ioctl_generate_sg`.
+ *
+ * @return the count of bounced segments.
+ */
+static uint32_t
+_crono_count_bounced_segments(CRONO_SG_BUFFER_INFO_WRAPPER *bw);
+
+/**
+ * Sum the per-CPU statistics of `crono_dev` at `offset` over all CPUs, used by
+ * `CRONO_STAT_READ`.
+ *
+ * @param crono_dev[in]: the device, might be NULL.
+ * @param offset[in]: offset of an `s64` or `u64` field in
+ * `struct crono_dev_stats`.
+ *
+ * @return the sum, or 0 if `crono_dev` has no statistics.
+ */
+static s64 _crono_stat_sum(struct crono_miscdev *crono_dev, size_t offset);
+
+/**
+ * Count the duration since `start_ns` in the log2 latency histogram of `op`.
+ *
+ * @param crono_dev[in]: the device, might be NULL.
+ * @param op[in]: the timed operation.
+ * @param start_ns[in]: `ktime_get_ns` value when the operation started.
+ */
+static void _crono_stat_latency(struct crono_miscdev *crono_dev,
+                                enum crono_stat_op op, u64 start_ns);
+
+/**
+ * debugfs `show` functions of `crono/<name>/histograms`, listing the latency
+ * histograms of a device, and `crono/buffers`, listing every live buffer with
+ * its owner device and process, size, and DMA extents count.
+ */
+static int crono_debugfs_histograms_show(struct seq_file *s, void *unused);
+static int crono_debugfs_buffers_show(struct seq_file *s, void *unused);
+
+/**
+ * Reserve `size` bytes of coherent memory for `crono_dev`, and create a pool
+ * over it, allocating blocks of `1 << min_alloc_order` bytes granularity.
+ * Errors are logged, and NULL is returned.
+ */
+static struct crono_reserved_pool *
+_crono_reserve_pool(struct crono_miscdev *crono_dev, size_t size,
+                    int min_alloc_order);
+
+/**
+ * Destroy the pool `reserved`, free its memory, and give its record back.
+ * Called for the pools of a device that failed to initialize, as nothing is
+ * allocated from them. Does nothing if `reserved` is NULL.
+ */
+static void _crono_release_pool(struct crono_reserved_pool *reserved);
+
+/**
+ * Destroy the reserved pools, and free their memory. Called after all buffers
+ * are released.
+ */
+static void _crono_reserved_pools_exit(void);
+
+/**
+ * Take a reference of the contiguous buffer wrapper of the mapping `vma`,
+ * copied or split from a mapping already holding one.
+ */
+static void crono_vma_contig_open(struct vm_area_struct *vma);
+
+/**
+ * Put the reference of the contiguous buffer wrapper of the mapping `vma`,
+ * releasing the buffer if unlocked and no longer mapped.
+ */
+static void crono_vma_contig_close(struct vm_area_struct *vma);
+
+/**
+ * Initialize the contiguous buffers cache of `crono_dev`.
+ */
+static void _crono_contig_cache_init(struct crono_miscdev *crono_dev);
+
+/**
+ * Keep the freed contiguous buffer in the cache of `crono_dev`, and queue its
+ * zeroing, if the cache is enabled and `contig_cache_size` is not exceeded.
+ *
+ * @return true if cached, otherwise, the caller frees the buffer.
+ */
+static bool _crono_contig_cache_put(struct crono_miscdev *crono_dev,
+                                    void *addr, dma_addr_t dma_handle,
+                                    size_t size);
+
+/**
+ * Get a zeroed buffer of `size` bytes from the cache of `crono_dev`.
+ *
+ * @return the buffer address, or NULL if none is found.
+ */
+static void *_crono_contig_cache_get(struct crono_miscdev *crono_dev,
+                                     size_t size, dma_addr_t *dma_handle);
+
+/**
+ * Work zeroing the dirty buffers of the cache, queued on the unbound
+ * workqueue `crono_zero`.
+ */
+static void _crono_contig_cache_zero_work(struct work_struct *work);
+
+/**
+ * Disable the cache of `crono_dev`, wait for its work, and free the cached
+ * buffers.
+ */
+static void _crono_contig_cache_drain(struct crono_miscdev *crono_dev);
+
+/**
+ * sysfs `show` function of the miscdev attribute `probe_ns`, the time spent
+ * probing the device in nanoseconds, 0 for emulated devices.
+ */
+static ssize_t probe_ns_show(struct device *dev, struct device_attribute *attr,
+                             char *buf);
+
+/**
+ * sysfs `show` functions of the miscdev attributes `contig_pool_avail` and
+ * `block_arena_avail`.
+ */
+static ssize_t contig_pool_avail_show(struct device *dev,
+                                      struct device_attribute *attr,
+                                      char *buf);
+static ssize_t block_arena_avail_show(struct device *dev,
+                                      struct device_attribute *attr,
+                                      char *buf);
+
+/**
+ * Log a warning if the PCIe link of `dev` is trained below its capability,
+ * either in speed or width, e.g. x4 instead of x8, or Gen2 instead of Gen3.
+ */
+static void _crono_pcie_check_link(struct pci_dev *dev);
+
+/**
+ * Apply the PCIe module parameters `pcie_max_payload_size`,
+ * `pcie_max_read_request_size`, `pcie_relaxed_ordering` and
+ * `pcie_extended_tags` to `dev`, within the limits of the device, its
+ * upstream bridge and its root port. Unsupported values are logged and
+ * skipped, the probe doesn't fail.
+ */
+static void _crono_pcie_tune(struct pci_dev *dev);
+
+/**
+ * Enable or disable the extended tags of `dev` per `pcie_extended_tags`,
+ * 10-bit tags are enabled only if `root` completes them.
+ */
+static void _crono_pcie_set_ext_tags(struct pci_dev *dev,
+                                     struct pci_dev *root);
+
+/**
+ * Return the tags enabled for `dev`: 0 for 5-bit, 1 for 8-bit extended tags,
+ * or 2 for 10-bit tags.
+ */
+static int _crono_pcie_ext_tags(struct pci_dev *dev);
+
+/**
+ * Return the PCIe root port above `dev`, or NULL if not found.
+ */
+static struct pci_dev *_crono_pcie_root_port(struct pci_dev *dev);
+
+/**
+ * Return the text of the PCIe link `speed` as encoded in the Link
+ * Capabilities and Status registers, e.g. "8.0 GT/s".
+ */
+static const char *_crono_pcie_speed_str(u32 speed);
+
+/**
+ * `is_visible` of the `pcie` sysfs attributes group, hides the group for
+ * emulated devices.
+ */
+static umode_t _crono_pcie_attr_visible(struct kobject *kobj,
+                                        struct attribute *attr, int n);
+
+/**
+ * sysfs `show` functions of the `pcie` group attributes of the miscdev: the
+ * negotiated and maximum link speed and width, the Max Payload Size and Max
+ * Read Request Size in bytes, whether relaxed ordering is enabled, the tags
+ * returned by `_crono_pcie_ext_tags`, the NUMA node, and the interrupt mode of
+ * the PCI device.
+ */
+static ssize_t current_link_speed_show(struct device *dev,
+                                       struct device_attribute *attr,
+                                       char *buf);
+static ssize_t current_link_width_show(struct device *dev,
+                                       struct device_attribute *attr,
+                                       char *buf);
+static ssize_t max_link_speed_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf);
+static ssize_t max_link_width_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf);
+static ssize_t max_payload_size_show(struct device *dev,
+                                     struct device_attribute *attr,
+                                     char *buf);
+static ssize_t max_read_request_size_show(struct device *dev,
+                                          struct device_attribute *attr,
+                                          char *buf);
+static ssize_t relaxed_ordering_show(struct device *dev,
+                                     struct device_attribute *attr,
+                                     char *buf);
+static ssize_t extended_tags_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf);
+static ssize_t numa_node_show(struct device *dev,
+                              struct device_attribute *attr, char *buf);
+static ssize_t irq_mode_show(struct device *dev, struct device_attribute *attr,
+                             char *buf);
+
+/**
+ * sysfs `show` functions of the miscdev attributes `bounced_buffers` and
+ * `bounced_segments`.
+ */
+static ssize_t bounced_buffers_show(struct device *dev,
+                                    struct device_attribute *attr, char *buf);
+static ssize_t bounced_segments_show(struct device *dev,
+                                     struct device_attribute *attr, char *buf);
+
+/**
+ * Get the single DMA range the buffer `bw` is mapped to, for
+ * `CRONO_SG_LOCK_FLAG_SINGLE_IOVA`.
+ *
+ * @param bw[in]: a buffer wrapper mapped by `_crono_miscdev_ioctl_generate_sg`.
+ * @param iova_base[out]: DMA address of the buffer start.
+ * @param iova_size[out]: size of the DMA range in bytes.
+ *
+ * @return `CRONO_SUCCESS` in case the mapped segments are contiguous and
+ * aligned to `CRONO_SINGLE_IOVA_ALIGNMENT`, `-EOPNOTSUPP` in case they are not
+ * contiguous, or `-ERANGE` in case they are not aligned.
+ */
+static int _crono_get_single_iova(CRONO_SG_BUFFER_INFO_WRAPPER *bw,
+                                  DMA_ADDR *iova_base, uint64_t *iova_size);
+
 /**
  * @brief
  * Lock contiguous buffer for 32bit using dma_alloc_coherent
@@ -93,6 +588,49 @@ static int _crono_miscdev_ioctl_lock_sg_buffer(struct file *filp,
 static int _crono_miscdev_ioctl_lock_contig_buffer(struct file *filp,
                                                    unsigned long arg);
 
+/**
+ * Program the Steering Tag table entry `st_index` of the device with the tag
+ * of `cpu`, so the device DMA writes into the buffer using that entry land in
+ * the cache of `cpu`. Nothing is programmed, and `steering_tag` is set to -1,
+ * if TPH is not enabled for the device or the platform has no tag for `cpu`.
+ *
+ * @param arg[in/out]: is a pointer to valid `CRONO_SG_BUFFER_TPH_INFO` object
+ * in user space memory.
+ */
+static int _crono_miscdev_ioctl_set_buffer_tph(struct file *filp,
+                                               unsigned long arg);
+
+/**
+ * Fill the `CRONO_DEV_CAPS` at `arg` in user space memory with the
+ * capabilities of the device of `filp`.
+ */
+static int _crono_miscdev_ioctl_get_dev_caps(struct file *filp,
+                                             unsigned long arg);
+
+/**
+ * Enable TLP Processing Hints in Device Specific mode for `crono_dev` if the
+ * module parameter `pcie_tph` is set, and the device and the platform support
+ * it. Available starting kernel 6.13, no-op otherwise.
+ */
+static void _crono_tph_init(struct crono_miscdev *crono_dev);
+
+/**
+ * Allocate a contiguous block from the device blocks arena, zeroed, and add it
+ * to the contiguous buffers list, to be freed by
+ * `IOCTL_CRONO_UNLOCK_CONTIG_BUFFER` or when the process exits.
+ *
+ * @param arg[in/out]: is a pointer to valid `CRONO_CONTIG_BLOCK_INFO` object
+ * in user space memory.
+ */
+static int _crono_miscdev_ioctl_alloc_contig_block(struct file *filp,
+                                                   unsigned long arg);
+
+/**
+ * Add the allocated contiguous buffer wrapper to the list, and set its id.
+ */
+static void
+_crono_add_contig_buff_wrapper(CRONO_CONTIG_BUFFER_INFO_WRAPPER *buff_wrapper);
+
 /**
  * Internal function that unlocks a memory buffer using ioctl().
  * Calls 'unpin_user_pages'
@@ -117,6 +655,63 @@ static int _crono_miscdev_ioctl_unlock_sg_buffer(struct file *filp,
 static int _crono_miscdev_ioctl_unlock_contig_buffer(struct file *filp,
                                                      unsigned long arg);
 
+/**
+ * Internal function that builds the descriptor table of a locked SG buffer
+ * using ioctl().
+ * The table is built from the DMA segments of the buffer SG table, in the
+ * format of the device family (or the requested format), into a new contiguous
+ * DMA buffer that is owned by the calling process.
+ *
+ * @param filp[in]: the file descriptor passed to ioctl.
+ * @param arg[in/out]: is a valid `CRONO_SG_DESC_TABLE_INFO` object pointer in
+ * user space memory, with `sg_id` and `format` set.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `errno` in case of error.
+ */
+static int _crono_miscdev_ioctl_build_sg_desc_table(struct file *filp,
+                                                    unsigned long arg);
+
+/**
+ * Internal function that syncs a byte range of a locked SG buffer using
+ * ioctl(), calling `dma_sync_single_for_cpu` or `dma_sync_single_for_device`
+ * for the parts of the DMA segments covering the range only.
+ *
+ * @param filp[in]: the file descriptor passed to ioctl.
+ * @param arg[in]: is a valid `CRONO_SG_BUFFER_SYNC_INFO` object pointer in user
+ * space memory.
+ * @param for_cpu[in]: `true` to sync for CPU, `false` to sync for device.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `errno` in case of error.
+ */
+static int _crono_miscdev_ioctl_sync_sg_buffer(struct file *filp,
+                                               unsigned long arg,
+                                               bool for_cpu);
+
+/**
+ * Fill the descriptor table `table` of format `format` from the DMA segments
+ * of the mapped buffer `bw`. `table` should be large enough for the format
+ * entries of the buffer.
+ */
+static void _crono_fill_desc_table(CRONO_SG_BUFFER_INFO_WRAPPER *bw,
+                                   uint32_t format, void *table);
+
+/**
+ * Construct a new `CRONO_CONTIG_BUFFER_INFO_WRAPPER` object of `buff_info`, and
+ * allocate its coherent DMA memory of size `buff_info.size` for device `devp`.
+ * Adds the wrapper to the contiguous buffer wrappers list, owned by the current
+ * process.
+ *
+ * @param devp[in]: the device the memory is allocated for.
+ * @param buff_info[in]: the buffer information, `size` is used for allocation.
+ * @param pp_buff_wrapper[out]: the new wrapper, to be released using
+ * `_crono_drop_buff_wrapper`.
+ *
+ * @return `CRONO_SUCCESS` in case of no error, or `errno` in case of error.
+ */
+static int _crono_alloc_contig_buff_wrapper(
+    struct device *devp, const CRONO_CONTIG_BUFFER_INFO *buff_info,
+    CRONO_CONTIG_BUFFER_INFO_WRAPPER **pp_buff_wrapper);
+
 /**
  * Internal function that creates SG list for the buffer in `buff_wrapper`
  * and saves its address in `sgt` member. It also fills the `Page` member.
@@ -184,10 +779,97 @@ _crono_miscdev_ioctl_pin_buffer(struct file *filp,
                                 CRONO_SG_BUFFER_INFO_WRAPPER *buff_wrapper,
                                 unsigned long nr_per_call);
 
+/**
+ * Pin `nr_pages` user pages starting at `start` of the current process into
+ * `pages`, using the pinning API of the kernel version.
+ *
+ * @return Number of pinned pages, might be less than `nr_pages`, or errno.
+ */
+static long _crono_pin_user_pages(unsigned long start, unsigned long nr_pages,
+                                  unsigned int gup_flags,
+                                  struct page **pages);
+
+/**
+ * Charge the `pages_count` pages of `bw` to the pinned memory of the current
+ * process, checked against its `RLIMIT_MEMLOCK` unless it has
+ * `CAP_IPC_LOCK`, and keep a reference of the process memory in `bw->mm`.
+ *
+ * @return `CRONO_SUCCESS`, or `-ENOMEM` if the limit is exceeded.
+ */
+static int _crono_charge_pinned_vm(CRONO_SG_BUFFER_INFO_WRAPPER *bw);
+
+/**
+ * Uncharge the pages charged by `_crono_charge_pinned_vm`, if any.
+ */
+static void _crono_uncharge_pinned_vm(CRONO_SG_BUFFER_INFO_WRAPPER *bw);
+
+/**
+ * Unmap the DMA mapping of `bw` and free its SG table, `bw->sgt` is `NULL` upon
+ * exit. Must run before `_crono_unpin_sg_buff_wrapper`.
+ *
+ * @return `CRONO_SUCCESS`.
+ */
+static int _crono_unmap_sg_buff_wrapper(CRONO_SG_BUFFER_INFO_WRAPPER *bw);
+
+/**
+ * Unpin the `pinned_pages_nr` pages of `bw`.
+ *
+ * @return `CRONO_SUCCESS`.
+ */
+static int _crono_unpin_sg_buff_wrapper(CRONO_SG_BUFFER_INFO_WRAPPER *bw);
+
+/**
+ * Check the memory pinned by the device and by the process of `bw`, including
+ * `bw`, against `max_pinned_bytes_per_device` and
+ * `max_pinned_bytes_per_process`. Called with `crono_buff_wrappers_lock` held,
+ * before `bw` is added to the list.
+ *
+ * @return `CRONO_SUCCESS`, or `-EDQUOT` if a limit is exceeded.
+ */
+static int _crono_check_pinned_limits(const CRONO_SG_BUFFER_INFO_WRAPPER *bw);
+
+/**
+ * Release and free the buffer wrapper of the last reference `ref`.
+ */
+static void _crono_buff_wrapper_kref_release(struct kref *ref);
+
+/**
+ * Put a reference of the buffer wrapper taken by `get_bw` or `get_sg_bw`, the
+ * wrapper is released and freed with its last reference.
+ * Must not be called with `crono_buff_wrappers_lock` held.
+ */
+static void _crono_put_buff_wrapper(void *buff_wrapper);
+
+/**
+ * Delete the buffer wrapper from its list, if still there, and put the list
+ * reference. Used when locking fails after the wrapper is added to the list.
+ */
+static void _crono_drop_buff_wrapper(void *buff_wrapper);
+
+/**
+ * Delete the buffer wrappers of list `head` and put their list references.
+ */
+static void _crono_put_buff_wrappers(struct list_head *head);
+
+/**
+ * Put the list reference of the buffer wrapper, detached from the list by the
+ * caller, or, if `async_teardown` is set, pass it to the teardown list to be
+ * put by `crono_teardown_work`. SG buffers are synced for the CPU first.
+ * The wrapper is not valid upon exit.
+ *
+ * @return `CRONO_SUCCESS`.
+ */
+static int _crono_teardown_buff_wrapper(void *buff_wrapper);
+
+/**
+ * Put the buffer wrappers of the teardown list, releasing and freeing them.
+ */
+static void _crono_teardown_work_fn(struct work_struct *work);
+
 /**
  * For CRONO_SG_BUFFER_INFO_WRAPPER:
  * Unpin, unmap Scatter/Gather list, free all memory allocated for
- * `buff_wrapper`, and remove it from the buffer information wrappers.
+ * `buff_wrapper`. Called with the last reference, off the wrappers lists.
  * `buff_wrapper` should have been initialized using
  * `_crono_init_sg_buff_wrapper`.
  *
@@ -225,12 +907,12 @@ static int _crono_miscdev_ioctl_cleanup_setup(struct file *filp,
  *
  * @param filep[in]: A valid file descriptor of the device file.
  * @param devpp[out]: A valid pointer will contain a pointer to the device
- * structure object in `pci_dev`.
+ * structure used for DMA, of the PCI device or of the emulated device.
  *
  * @returns `CRONO_SUCCESS` in case of success, or `-ENODATA` in case file not
  * found.
  */
-static int _crono_get_dev_from_filp(struct file *filp, struct pci_dev **devpp);
+static int _crono_get_dev_from_filp(struct file *filp, struct device **devpp);
 
 /**
  * Get `crono_miscdev` object from misc device inode `miscdev_inode`.
@@ -259,15 +941,16 @@ static int _crono_get_crono_dev_from_filp(struct file *filp,
 /**
  * @brief Construct a new 'CRONO_SG_BUFFER_INFO_WRAPPER' object from `arg`.
  * Adds the wrapper to the buffer information wrappers list.
- * Call `_crono_release_buff_wrapper` when done working with the wrapper.
+ * Call `_crono_drop_buff_wrapper` if locking the buffer fails afterwards.
  *
  * @param filp[in]: the file descriptor passed to ioctl.
- * @param arg[in]: is a pointer to valid `CRONO_SG_BUFFER_INFO` object in user
- * space memory.
+ * @param lock_info[in]: is a pointer to valid `CRONO_SG_BUFFER_LOCK_INFO`
+ * object in kernel space memory, copied from user space.
  * @param pp_buff_wrapper[out]
  */
 static int
-_crono_init_sg_buff_wrapper(struct file *filp, unsigned long arg,
+_crono_init_sg_buff_wrapper(struct file *filp,
+                            const CRONO_SG_BUFFER_LOCK_INFO *lock_info,
                             CRONO_SG_BUFFER_INFO_WRAPPER **pp_buff_wrapper);
 
 static int crono_driver_probe(struct pci_dev *dev,
@@ -0,0 +1,156 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM crono
+
+#if !defined(__CRONO_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __CRONO_TRACE_H__
+// _____________________________________________________________________________
+
+#include <linux/tracepoint.h>
+
+/**
+ * Tracepoints of the buffers lock, unlock and cleanup paths, enabled under
+ * `/sys/kernel/tracing/events/crono/`, and usable by `perf` and `bpftrace`,
+ * e.g. `perf trace -e 'crono:*'`.
+ * Buffers are identified by their wrapper `id`, devices by their miscdev
+ * `minor`.
+ */
+
+TRACE_EVENT(crono_lock_begin,
+            TP_PROTO(int id, size_t size, u32 pages_count),
+            TP_ARGS(id, size, pages_count),
+            TP_STRUCT__entry(__field(int, id) __field(size_t, size)
+                                 __field(u32, pages_count)),
+            TP_fast_assign(__entry->id = id; __entry->size = size;
+                           __entry->pages_count = pages_count;),
+            TP_printk("id=%d size=%zu pages=%u", __entry->id, __entry->size,
+                      __entry->pages_count));
+
+TRACE_EVENT(crono_lock_end,
+            TP_PROTO(int id, int ret, int mapped_nents),
+            TP_ARGS(id, ret, mapped_nents),
+            TP_STRUCT__entry(__field(int, id) __field(int, ret)
+                                 __field(int, mapped_nents)),
+            TP_fast_assign(__entry->id = id; __entry->ret = ret;
+                           __entry->mapped_nents = mapped_nents;),
+            TP_printk("id=%d ret=%d segments=%d", __entry->id, __entry->ret,
+                      __entry->mapped_nents));
+
+TRACE_EVENT(crono_pin_chunk,
+            TP_PROTO(int id, unsigned long addr, unsigned long nr_pages,
+                     long pinned),
+            TP_ARGS(id, addr, nr_pages, pinned),
+            TP_STRUCT__entry(__field(int, id) __field(unsigned long, addr)
+                                 __field(unsigned long, nr_pages)
+                                     __field(long, pinned)),
+            TP_fast_assign(__entry->id = id; __entry->addr = addr;
+                           __entry->nr_pages = nr_pages;
+                           __entry->pinned = pinned;),
+            TP_printk("id=%d addr=0x%lx pages=%lu pinned=%ld", __entry->id,
+                      __entry->addr, __entry->nr_pages, __entry->pinned));
+
+TRACE_EVENT(crono_sg_alloc,
+            TP_PROTO(int id, u32 pages_count, unsigned int nents),
+            TP_ARGS(id, pages_count, nents),
+            TP_STRUCT__entry(__field(int, id) __field(u32, pages_count)
+                                 __field(unsigned int, nents)),
+            TP_fast_assign(__entry->id = id;
+                           __entry->pages_count = pages_count;
+                           __entry->nents = nents;),
+            TP_printk("id=%d pages=%u nents=%u", __entry->id,
+                      __entry->pages_count, __entry->nents));
+
+TRACE_EVENT(crono_dma_map,
+            TP_PROTO(int id, unsigned int nents, int mapped_nents, int dir),
+            TP_ARGS(id, nents, mapped_nents, dir),
+            TP_STRUCT__entry(__field(int, id) __field(unsigned int, nents)
+                                 __field(int, mapped_nents) __field(int, dir)),
+            TP_fast_assign(__entry->id = id; __entry->nents = nents;
+                           __entry->mapped_nents = mapped_nents;
+                           __entry->dir = dir;),
+            TP_printk("id=%d nents=%u segments=%d dir=%d", __entry->id,
+                      __entry->nents, __entry->mapped_nents, __entry->dir));
+
+TRACE_EVENT(crono_unlock,
+            TP_PROTO(int id, int bwt, size_t size),
+            TP_ARGS(id, bwt, size),
+            TP_STRUCT__entry(__field(int, id) __field(int, bwt)
+                                 __field(size_t, size)),
+            TP_fast_assign(__entry->id = id; __entry->bwt = bwt;
+                           __entry->size = size;),
+            TP_printk("id=%d type=%s size=%zu", __entry->id,
+                      __entry->bwt == BWT_SG ? "sg" : "contig",
+                      __entry->size));
+
+TRACE_EVENT(crono_cleanup_cmd,
+            TP_PROTO(int minor, u32 addr, u32 data),
+            TP_ARGS(minor, addr, data),
+            TP_STRUCT__entry(__field(int, minor) __field(u32, addr)
+                                 __field(u32, data)),
+            TP_fast_assign(__entry->minor = minor; __entry->addr = addr;
+                           __entry->data = data;),
+            TP_printk("minor=%d offset=0x%x data=0x%x", __entry->minor,
+                      __entry->addr, __entry->data));
+
+/**
+ * Every ioctl and mmap of a miscdev, with the arguments needed to replay it by
+ * `tools/crono_replay`, read back from userspace after the command is done,
+ * so ids filled by the module are included.
+ * `id` is the buffer id, `id2` is the descriptor table id of
+ * `IOCTL_CRONO_BUILD_SG_DESC_TABLE`, or the Steering Tag entry of
+ * `IOCTL_CRONO_SET_BUFFER_TPH`, whose `flags` is the CPU, or the file
+ * descriptor of `IOCTL_CRONO_LOCK_FD_BUFFER`, and `size` is the cleanup
+ * commands count of `IOCTL_CRONO_CLEANUP_SETUP`.
+ */
+TRACE_EVENT(crono_ioctl,
+            TP_PROTO(int minor, unsigned int cmd, int id, int id2, u64 offset,
+                     u64 size, u32 flags, u32 dir, u32 attrs, int ret,
+                     u64 duration_ns),
+            TP_ARGS(minor, cmd, id, id2, offset, size, flags, dir, attrs, ret,
+                    duration_ns),
+            TP_STRUCT__entry(__field(int, minor) __field(unsigned int, cmd)
+                                 __field(int, id) __field(int, id2)
+                                     __field(u64, offset) __field(u64, size)
+                                         __field(u32, flags) __field(u32, dir)
+                                             __field(u32, attrs)
+                                                 __field(int, ret)
+                                                     __field(u64,
+                                                             duration_ns)),
+            TP_fast_assign(__entry->minor = minor; __entry->cmd = cmd;
+                           __entry->id = id; __entry->id2 = id2;
+                           __entry->offset = offset; __entry->size = size;
+                           __entry->flags = flags; __entry->dir = dir;
+                           __entry->attrs = attrs; __entry->ret = ret;
+                           __entry->duration_ns = duration_ns;),
+            TP_printk("minor=%d cmd=0x%x id=%d id2=%d offset=%llu size=%llu "
+                      "flags=0x%x dir=%u attrs=0x%x ret=%d ns=%llu",
+                      __entry->minor, __entry->cmd, __entry->id, __entry->id2,
+                      __entry->offset, __entry->size, __entry->flags,
+                      __entry->dir, __entry->attrs, __entry->ret,
+                      __entry->duration_ns));
+
+TRACE_EVENT(crono_mmap,
+            TP_PROTO(int minor, unsigned long type, int id, unsigned long size,
+                     int ret, u64 duration_ns),
+            TP_ARGS(minor, type, id, size, ret, duration_ns),
+            TP_STRUCT__entry(__field(int, minor) __field(unsigned long, type)
+                                 __field(int, id) __field(unsigned long, size)
+                                     __field(int, ret)
+                                         __field(u64, duration_ns)),
+            TP_fast_assign(__entry->minor = minor; __entry->type = type;
+                           __entry->id = id; __entry->size = size;
+                           __entry->ret = ret;
+                           __entry->duration_ns = duration_ns;),
+            TP_printk("minor=%d type=%lu id=%d size=%lu ret=%d ns=%llu",
+                      __entry->minor, __entry->type, __entry->id,
+                      __entry->size, __entry->ret, __entry->duration_ns));
+
+// _____________________________________________________________________________
+#endif // #define __CRONO_TRACE_H__
+
+// Must be outside the include guard, `crono_trace.h` is found in the build
+// directory, added to the include paths.
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE crono_trace
+#include <trace/define_trace.h>
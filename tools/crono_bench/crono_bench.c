@@ -0,0 +1,703 @@
+/**
+ * @file crono_bench.c
+ * @brief Benchmark of the cronologic PCI driver module ioctl ABI.
+ *
+ * Locks and unlocks buffers on a miscdev over a sweep of buffer sizes, buffers
+ * counts, threads counts and backing memory types, and prints one JSON object
+ * per line for every operation and configuration, with the latency
+ * percentiles, the lock throughput, and the pinned memory footprint.
+ *
+ * Usage: crono_bench [-d /dev/crono_xx] [-s sizes] [-n counts] [-t threads]
+ *                    [-b backings] [-o ops] [-i iterations] [-m]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Cleanup command, as defined by the kernel module, needed by
+ * `CRONO_KERNEL_CMDS_INFO`.
+ */
+typedef struct {
+        uint32_t addr;
+        uint32_t data;
+} CRONO_KERNEL_CMD;
+
+#include "crono_linux_kernel.h"
+
+#define CRONO_BENCH_MAX_LIST 32
+#define CRONO_BENCH_THP_SIZE (2UL << 20)
+
+enum crono_bench_backing { BACKING_MALLOC, BACKING_THP, BACKING_HUGETLB };
+static const char *backing_names[] = {"malloc", "thp", "hugetlb"};
+
+enum crono_bench_op { OP_SG, OP_CONTIG, OP_CLEANUP };
+static const char *op_names[] = {"sg", "contig", "cleanup"};
+
+/**
+ * Latency samples of one operation, in nanoseconds.
+ */
+struct crono_bench_samples {
+        uint64_t *ns;
+        size_t count;
+        size_t errors;
+        uint64_t total_ns;
+};
+
+/**
+ * One configuration of the sweep, shared by its threads.
+ */
+struct crono_bench_config {
+        int fd;
+        enum crono_bench_op op;
+        enum crono_bench_backing backing;
+        size_t size;
+        int count;
+        int threads;
+        int iterations;
+        int mmap_table; // Don't copy the pages table, userspace maps it
+        long page_size;
+};
+
+/**
+ * Per thread state and results.
+ */
+struct crono_bench_thread {
+        struct crono_bench_config *cfg;
+        pthread_t thread;
+        void **buffers;
+        DMA_ADDR **pages;
+        struct crono_bench_samples lock;
+        struct crono_bench_samples map;
+        struct crono_bench_samples unlock;
+};
+
+static pthread_barrier_t start_barrier;
+
+// _____________________________________________________________________________
+// Helpers
+//
+static uint64_t now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int samples_init(struct crono_bench_samples *s, size_t capacity) {
+        memset(s, 0, sizeof(*s));
+        s->ns = calloc(capacity ? capacity : 1, sizeof(uint64_t));
+        return s->ns ? 0 : -ENOMEM;
+}
+
+static void samples_add(struct crono_bench_samples *s, uint64_t start_ns,
+                        int ret) {
+        uint64_t ns = now_ns() - start_ns;
+
+        if (ret) {
+                s->errors++;
+                return;
+        }
+        s->ns[s->count++] = ns;
+        s->total_ns += ns;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+        uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const struct crono_bench_samples *s, double p) {
+        size_t index;
+
+        if (0 == s->count)
+                return 0;
+        index = (size_t)(p * (s->count - 1) + 0.5);
+        return s->ns[index] / 1000.0;
+}
+
+/**
+ * Parse a size with an optional `K`, `M` or `G` binary suffix.
+ */
+static size_t parse_size(const char *str) {
+        char *end;
+        size_t size = strtoull(str, &end, 0);
+
+        switch (*end) {
+        case 'G':
+        case 'g':
+                size <<= 10;
+                /* fall through */
+        case 'M':
+        case 'm':
+                size <<= 10;
+                /* fall through */
+        case 'K':
+        case 'k':
+                size <<= 10;
+        }
+        return size;
+}
+
+/**
+ * Parse a comma separated list into `values`, using `parse` for every item.
+ *
+ * @return count of items parsed.
+ */
+static int parse_list(const char *str, size_t *values,
+                      size_t (*parse)(const char *)) {
+        char *copy = strdup(str), *item, *save = NULL;
+        int count = 0;
+
+        for (item = strtok_r(copy, ",", &save);
+             item && count < CRONO_BENCH_MAX_LIST;
+             item = strtok_r(NULL, ",", &save))
+                values[count++] = parse(item);
+        free(copy);
+        return count;
+}
+
+static size_t parse_backing(const char *str) {
+        size_t ib;
+
+        for (ib = 0; ib < sizeof(backing_names) / sizeof(char *); ib++)
+                if (0 == strcmp(str, backing_names[ib]))
+                        return ib;
+        fprintf(stderr, "Unknown backing type <%s>\n", str);
+        exit(EXIT_FAILURE);
+}
+
+static size_t parse_op(const char *str) {
+        size_t iop;
+
+        for (iop = 0; iop < sizeof(op_names) / sizeof(char *); iop++)
+                if (0 == strcmp(str, op_names[iop]))
+                        return iop;
+        fprintf(stderr, "Unknown operation <%s>\n", str);
+        exit(EXIT_FAILURE);
+}
+
+static size_t parse_number(const char *str) { return strtoull(str, NULL, 0); }
+
+/**
+ * Read the `pinned_bytes` statistics attribute of the miscdev `dev_name`.
+ *
+ * @return the attribute value, or -1 if not available.
+ */
+static long long read_pinned_bytes(const char *dev_name) {
+        char path[256];
+        long long value = -1;
+        FILE *f;
+
+        snprintf(path, sizeof(path), "/sys/class/misc/%s/pinned_bytes",
+                 dev_name);
+        f = fopen(path, "r");
+        if (NULL == f)
+                return -1;
+        if (1 != fscanf(f, "%lld", &value))
+                value = -1;
+        fclose(f);
+        return value;
+}
+
+/**
+ * Read the `VmPin` field of `/proc/self/status` in kB.
+ *
+ * @return the field value, or -1 if not available.
+ */
+static long long read_vm_pinned_kb(void) {
+        char line[256];
+        long long value = -1;
+        FILE *f = fopen("/proc/self/status", "r");
+
+        if (NULL == f)
+                return -1;
+        while (fgets(line, sizeof(line), f))
+                if (1 == sscanf(line, "VmPin: %lld kB", &value))
+                        break;
+        fclose(f);
+        return value;
+}
+
+// _____________________________________________________________________________
+// Buffers
+//
+static void *buffer_alloc(enum crono_bench_backing backing, size_t size,
+                          size_t *alloc_size) {
+        void *buf = NULL;
+
+        *alloc_size = size;
+        switch (backing) {
+        case BACKING_MALLOC:
+                if (posix_memalign(&buf, sysconf(_SC_PAGESIZE), size))
+                        return NULL;
+                break;
+        case BACKING_THP:
+                *alloc_size = (size + CRONO_BENCH_THP_SIZE - 1) &
+                              ~(CRONO_BENCH_THP_SIZE - 1);
+                if (posix_memalign(&buf, CRONO_BENCH_THP_SIZE, *alloc_size))
+                        return NULL;
+                madvise(buf, *alloc_size, MADV_HUGEPAGE);
+                break;
+        case BACKING_HUGETLB:
+                *alloc_size = (size + CRONO_BENCH_THP_SIZE - 1) &
+                              ~(CRONO_BENCH_THP_SIZE - 1);
+                buf = mmap(NULL, *alloc_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (MAP_FAILED == buf)
+                        return NULL;
+                break;
+        }
+        // Fault the pages in, so locking measures pinning only
+        memset(buf, 0, *alloc_size);
+        return buf;
+}
+
+static void buffer_free(enum crono_bench_backing backing, void *buf,
+                        size_t size) {
+        if (NULL == buf)
+                return;
+        if (BACKING_HUGETLB == backing) {
+                size = (size + CRONO_BENCH_THP_SIZE - 1) &
+                       ~(CRONO_BENCH_THP_SIZE - 1);
+                munmap(buf, size);
+        } else {
+                free(buf);
+        }
+}
+
+static int sg_lock(struct crono_bench_config *cfg, void *buf, DMA_ADDR *pages,
+                   int *id) {
+        CRONO_SG_BUFFER_INFO info;
+
+        memset(&info, 0, sizeof(info));
+        info.addr = buf;
+        info.size = cfg->size;
+        info.pages_count = (cfg->size + cfg->page_size - 1) / cfg->page_size;
+        if (!cfg->mmap_table) {
+                info.pages = pages;
+                info.upages = (DMA_ADDR)(uintptr_t)pages;
+        }
+        if (ioctl(cfg->fd, IOCTL_CRONO_LOCK_BUFFER, &info))
+                return -errno;
+        *id = info.id;
+        return 0;
+}
+
+static int sg_unlock(struct crono_bench_config *cfg, int id) {
+        return ioctl(cfg->fd, IOCTL_CRONO_UNLOCK_BUFFER, &id) ? -errno : 0;
+}
+
+// _____________________________________________________________________________
+// Benchmark
+//
+static void bench_sg(struct crono_bench_thread *t) {
+        struct crono_bench_config *cfg = t->cfg;
+        int iter, ibuf, ret, *ids = calloc(cfg->count, sizeof(int));
+        uint64_t start;
+
+        for (iter = 0; iter < cfg->iterations; iter++) {
+                for (ibuf = 0; ibuf < cfg->count; ibuf++) {
+                        start = now_ns();
+                        ret = sg_lock(cfg, t->buffers[ibuf], t->pages[ibuf],
+                                      &ids[ibuf]);
+                        samples_add(&t->lock, start, ret);
+                        if (ret)
+                                ids[ibuf] = -1;
+                }
+                for (ibuf = 0; ibuf < cfg->count; ibuf++) {
+                        if (ids[ibuf] < 0)
+                                continue;
+                        start = now_ns();
+                        samples_add(&t->unlock, start, sg_unlock(cfg, ids[ibuf]));
+                }
+        }
+        free(ids);
+}
+
+static void bench_contig(struct crono_bench_thread *t) {
+        struct crono_bench_config *cfg = t->cfg;
+        CRONO_CONTIG_BUFFER_INFO info;
+        int iter, ibuf, ret;
+        uint64_t start;
+        void *addr;
+
+        for (iter = 0; iter < cfg->iterations; iter++) {
+                for (ibuf = 0; ibuf < cfg->count; ibuf++) {
+                        memset(&info, 0, sizeof(info));
+                        info.size = cfg->size;
+                        start = now_ns();
+                        ret = ioctl(cfg->fd, IOCTL_CRONO_LOCK_CONTIG_BUFFER,
+                                    &info)
+                                  ? -errno
+                                  : 0;
+                        samples_add(&t->lock, start, ret);
+                        if (ret)
+                                continue;
+
+                        start = now_ns();
+                        addr = mmap(NULL, cfg->size, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED, cfg->fd,
+                                    CRONO_MMAP_OFFSET(CRONO_MMAP_TYPE_CONTIG,
+                                                      info.id, cfg->page_size));
+                        samples_add(&t->map, start, MAP_FAILED == addr);
+                        if (MAP_FAILED != addr)
+                                munmap(addr, cfg->size);
+
+                        start = now_ns();
+                        samples_add(&t->unlock, start,
+                                    ioctl(cfg->fd,
+                                          IOCTL_CRONO_UNLOCK_CONTIG_BUFFER,
+                                          &info.id)
+                                        ? -errno
+                                        : 0);
+                }
+        }
+}
+
+static void bench_cleanup(struct crono_bench_thread *t) {
+        struct crono_bench_config *cfg = t->cfg;
+        CRONO_KERNEL_CMDS_INFO cmds_info;
+        int iter;
+        uint64_t start;
+
+        // No commands, so no registers are written when the device is closed
+        for (iter = 0; iter < cfg->iterations; iter++) {
+                memset(&cmds_info, 0, sizeof(cmds_info));
+                start = now_ns();
+                samples_add(&t->lock, start,
+                            ioctl(cfg->fd, IOCTL_CRONO_CLEANUP_SETUP,
+                                  &cmds_info)
+                                ? -errno
+                                : 0);
+        }
+}
+
+static void *bench_thread(void *arg) {
+        struct crono_bench_thread *t = arg;
+
+        pthread_barrier_wait(&start_barrier);
+        switch (t->cfg->op) {
+        case OP_SG:
+                bench_sg(t);
+                break;
+        case OP_CONTIG:
+                bench_contig(t);
+                break;
+        case OP_CLEANUP:
+                bench_cleanup(t);
+                break;
+        }
+        return NULL;
+}
+
+/**
+ * Lock all the buffers of all threads at once, and read the pinned memory
+ * footprint.
+ */
+static void measure_footprint(struct crono_bench_config *cfg,
+                              struct crono_bench_thread *threads,
+                              const char *dev_name, long long *pinned_bytes,
+                              long long *vm_pinned_kb) {
+        int ithread, ibuf, *ids;
+
+        *pinned_bytes = *vm_pinned_kb = -1;
+        if (OP_SG != cfg->op)
+                return;
+        ids = calloc((size_t)cfg->threads * cfg->count, sizeof(int));
+        for (ithread = 0; ithread < cfg->threads; ithread++)
+                for (ibuf = 0; ibuf < cfg->count; ibuf++)
+                        if (sg_lock(cfg, threads[ithread].buffers[ibuf],
+                                    threads[ithread].pages[ibuf],
+                                    &ids[ithread * cfg->count + ibuf]))
+                                ids[ithread * cfg->count + ibuf] = -1;
+        *pinned_bytes = read_pinned_bytes(dev_name);
+        *vm_pinned_kb = read_vm_pinned_kb();
+        for (ibuf = 0; ibuf < cfg->threads * cfg->count; ibuf++)
+                if (ids[ibuf] >= 0)
+                        sg_unlock(cfg, ids[ibuf]);
+        free(ids);
+}
+
+static void report(struct crono_bench_config *cfg, const char *op_name,
+                   struct crono_bench_thread *threads,
+                   size_t offset, uint64_t wall_ns, long long pinned_bytes,
+                   long long vm_pinned_kb, int with_throughput) {
+        struct crono_bench_samples all;
+        struct crono_bench_samples *s;
+        size_t capacity = 0;
+        int ithread;
+        double gibps = 0;
+
+        for (ithread = 0; ithread < cfg->threads; ithread++)
+                capacity += ((struct crono_bench_samples *)((char *)&threads[
+                                 ithread] + offset))->count;
+        if (samples_init(&all, capacity))
+                return;
+        for (ithread = 0; ithread < cfg->threads; ithread++) {
+                s = (struct crono_bench_samples *)((char *)&threads[ithread] +
+                                                   offset);
+                memcpy(all.ns + all.count, s->ns, s->count * sizeof(uint64_t));
+                all.count += s->count;
+                all.errors += s->errors;
+                all.total_ns += s->total_ns;
+        }
+        if (0 == all.count && 0 == all.errors) {
+                free(all.ns);
+                return;
+        }
+        qsort(all.ns, all.count, sizeof(uint64_t), cmp_u64);
+
+        // Aggregate throughput of the threads locking concurrently
+        if (with_throughput && all.total_ns)
+                gibps = (double)all.count * cfg->size / (1 << 30) /
+                        (all.total_ns / 1e9 / cfg->threads);
+
+        printf("{\"op\":\"%s\",\"backing\":\"%s\",\"size\":%zu,\"count\":%d,"
+               "\"threads\":%d,\"iterations\":%d,\"samples\":%zu,"
+               "\"errors\":%zu,\"p50_us\":%.3f,\"p99_us\":%.3f,"
+               "\"max_us\":%.3f,\"gib_per_s\":%.3f,\"wall_s\":%.6f,"
+               "\"pinned_bytes\":%lld,\"vm_pinned_kb\":%lld}\n",
+               op_name,
+               OP_SG == cfg->op ? backing_names[cfg->backing] : "none",
+               cfg->size, cfg->count,
+               cfg->threads, cfg->iterations, all.count, all.errors,
+               percentile_us(&all, 0.50), percentile_us(&all, 0.99),
+               all.count ? all.ns[all.count - 1] / 1000.0 : 0, gibps,
+               wall_ns / 1e9, pinned_bytes, vm_pinned_kb);
+        fflush(stdout);
+        free(all.ns);
+}
+
+/**
+ * Run one configuration of the sweep, and report its results.
+ *
+ * @return 0 on success, or -errno if the buffers can't be allocated.
+ */
+static int run_config(struct crono_bench_config *cfg, const char *dev_name) {
+        struct crono_bench_thread *threads;
+        size_t samples = (size_t)cfg->iterations * cfg->count;
+        size_t alloc_size, pages_count;
+        int ithread, ibuf, ret = 0;
+        long long pinned_bytes, vm_pinned_kb;
+        uint64_t start;
+
+        threads = calloc(cfg->threads, sizeof(*threads));
+        if (NULL == threads)
+                return -ENOMEM;
+        pages_count = (cfg->size + cfg->page_size - 1) / cfg->page_size;
+        for (ithread = 0; ithread < cfg->threads; ithread++) {
+                struct crono_bench_thread *t = &threads[ithread];
+
+                t->cfg = cfg;
+                t->buffers = calloc(cfg->count, sizeof(void *));
+                t->pages = calloc(cfg->count, sizeof(DMA_ADDR *));
+                if (NULL == t->buffers || NULL == t->pages ||
+                    samples_init(&t->lock, samples) ||
+                    samples_init(&t->map, samples) ||
+                    samples_init(&t->unlock, samples)) {
+                        ret = -ENOMEM;
+                        goto out;
+                }
+                if (OP_SG != cfg->op)
+                        continue;
+                for (ibuf = 0; ibuf < cfg->count; ibuf++) {
+                        t->buffers[ibuf] =
+                            buffer_alloc(cfg->backing, cfg->size, &alloc_size);
+                        t->pages[ibuf] = calloc(pages_count, sizeof(DMA_ADDR));
+                        if (NULL == t->buffers[ibuf] || NULL == t->pages[ibuf]) {
+                                fprintf(stderr,
+                                        "Error allocating %s buffer of size "
+                                        "%zu\n",
+                                        backing_names[cfg->backing], cfg->size);
+                                ret = -ENOMEM;
+                                goto out;
+                        }
+                }
+        }
+
+        // Run
+        pthread_barrier_init(&start_barrier, NULL, cfg->threads + 1);
+        for (ithread = 0; ithread < cfg->threads; ithread++)
+                pthread_create(&threads[ithread].thread, NULL, bench_thread,
+                               &threads[ithread]);
+        start = now_ns();
+        pthread_barrier_wait(&start_barrier);
+        for (ithread = 0; ithread < cfg->threads; ithread++)
+                pthread_join(threads[ithread].thread, NULL);
+        start = now_ns() - start;
+        pthread_barrier_destroy(&start_barrier);
+
+        // Report
+        measure_footprint(cfg, threads, dev_name, &pinned_bytes,
+                          &vm_pinned_kb);
+        switch (cfg->op) {
+        case OP_SG:
+                report(cfg, "sg_lock", threads,
+                       offsetof(struct crono_bench_thread, lock), start,
+                       pinned_bytes, vm_pinned_kb, 1);
+                report(cfg, "sg_unlock", threads,
+                       offsetof(struct crono_bench_thread, unlock), start,
+                       pinned_bytes, vm_pinned_kb, 0);
+                break;
+        case OP_CONTIG:
+                report(cfg, "contig_lock", threads,
+                       offsetof(struct crono_bench_thread, lock), start,
+                       pinned_bytes, vm_pinned_kb, 1);
+                report(cfg, "contig_mmap", threads,
+                       offsetof(struct crono_bench_thread, map), start,
+                       pinned_bytes, vm_pinned_kb, 0);
+                report(cfg, "contig_unlock", threads,
+                       offsetof(struct crono_bench_thread, unlock), start,
+                       pinned_bytes, vm_pinned_kb, 0);
+                break;
+        case OP_CLEANUP:
+                report(cfg, "cleanup_setup", threads,
+                       offsetof(struct crono_bench_thread, lock), start,
+                       pinned_bytes, vm_pinned_kb, 0);
+                break;
+        }
+
+out:
+        for (ithread = 0; ithread < cfg->threads; ithread++) {
+                struct crono_bench_thread *t = &threads[ithread];
+
+                for (ibuf = 0; t->buffers && ibuf < cfg->count; ibuf++)
+                        buffer_free(cfg->backing, t->buffers[ibuf], cfg->size);
+                for (ibuf = 0; t->pages && ibuf < cfg->count; ibuf++)
+                        free(t->pages[ibuf]);
+                free(t->buffers);
+                free(t->pages);
+                free(t->lock.ns);
+                free(t->map.ns);
+                free(t->unlock.ns);
+        }
+        free(threads);
+        return ret;
+}
+
+static void usage(const char *prog) {
+        fprintf(stderr,
+                "Usage: %s [options]\n"
+                "  -d path   miscdev, default is the first /dev/crono_*\n"
+                "  -s list   buffer sizes, K/M/G suffixes, default "
+                "4K,64K,1M,16M\n"
+                "  -n list   buffers per thread, default 1,8\n"
+                "  -t list   threads, default 1,4\n"
+                "  -b list   backings of SG buffers: malloc,thp,hugetlb, "
+                "default malloc\n"
+                "  -o list   operations: sg,contig,cleanup, default sg\n"
+                "  -i count  iterations per configuration, default 100\n"
+                "  -m        don't copy the pages table when locking, as if "
+                "it's mapped\n",
+                prog);
+}
+
+int main(int argc, char *argv[]) {
+        size_t sizes[CRONO_BENCH_MAX_LIST] = {4 << 10, 64 << 10, 1 << 20,
+                                              16 << 20};
+        size_t counts[CRONO_BENCH_MAX_LIST] = {1, 8};
+        size_t threads[CRONO_BENCH_MAX_LIST] = {1, 4};
+        size_t backings[CRONO_BENCH_MAX_LIST] = {BACKING_MALLOC};
+        size_t ops[CRONO_BENCH_MAX_LIST] = {OP_SG};
+        int sizes_nr = 4, counts_nr = 2, threads_nr = 2, backings_nr = 1;
+        int ops_nr = 1, ic, ib, io, opt;
+        struct crono_bench_config cfg;
+        const char *dev_path = NULL, *dev_name;
+        glob_t devs;
+
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.iterations = 100;
+        cfg.page_size = sysconf(_SC_PAGESIZE);
+        while (-1 != (opt = getopt(argc, argv, "d:s:n:t:b:o:i:mh"))) {
+                switch (opt) {
+                case 'd':
+                        dev_path = optarg;
+                        break;
+                case 's':
+                        sizes_nr = parse_list(optarg, sizes, parse_size);
+                        break;
+                case 'n':
+                        counts_nr = parse_list(optarg, counts, parse_number);
+                        break;
+                case 't':
+                        threads_nr = parse_list(optarg, threads, parse_number);
+                        break;
+                case 'b':
+                        backings_nr = parse_list(optarg, backings,
+                                                 parse_backing);
+                        break;
+                case 'o':
+                        ops_nr = parse_list(optarg, ops, parse_op);
+                        break;
+                case 'i':
+                        cfg.iterations = atoi(optarg);
+                        break;
+                case 'm':
+                        cfg.mmap_table = 1;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        // Open the device
+        memset(&devs, 0, sizeof(devs));
+        if (NULL == dev_path) {
+                if (glob("/dev/crono_*", 0, NULL, &devs) ||
+                    0 == devs.gl_pathc) {
+                        fprintf(stderr, "No cronologic miscdev is found\n");
+                        return EXIT_FAILURE;
+                }
+                dev_path = devs.gl_pathv[0];
+        }
+        dev_name = strrchr(dev_path, '/') ? strrchr(dev_path, '/') + 1
+                                          : dev_path;
+        cfg.fd = open(dev_path, O_RDWR);
+        if (cfg.fd < 0) {
+                fprintf(stderr, "Error %d opening <%s>\n", errno, dev_path);
+                globfree(&devs);
+                return EXIT_FAILURE;
+        }
+
+        // Sweep, the backing applies to SG buffers only, and the sizes and
+        // counts don't apply to the cleanup setup
+        for (io = 0; io < ops_nr; io++) {
+                cfg.op = ops[io];
+                for (ib = 0; ib < backings_nr; ib++) {
+                        if (OP_SG != cfg.op && ib > 0)
+                                break;
+                        cfg.backing = backings[ib];
+                        for (ic = 0; ic < sizes_nr * counts_nr * threads_nr;
+                             ic++) {
+                                cfg.size = sizes[ic / (counts_nr * threads_nr)];
+                                cfg.count = counts[ic / threads_nr % counts_nr];
+                                cfg.threads = threads[ic % threads_nr];
+                                if (OP_CLEANUP == cfg.op &&
+                                    ic >= threads_nr)
+                                        break;
+                                if (0 == cfg.size || 0 == cfg.count ||
+                                    0 == cfg.threads)
+                                        continue;
+                                run_config(&cfg, dev_name);
+                        }
+                }
+        }
+
+        close(cfg.fd);
+        globfree(&devs);
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,791 @@
+/**
+ * @file crono_replay.c
+ * @brief Replay of the ioctl and mmap workload recorded from a cronologic
+ * miscdev.
+ *
+ * Reads the `crono:crono_ioctl` and `crono:crono_mmap` tracepoints text, as
+ * found in `/sys/kernel/tracing/trace`, and re-issues the recorded commands on
+ * a miscdev, as fast as possible or with the recorded timing scaled, then
+ * prints one JSON object per line for every operation with its latency
+ * percentiles.
+ * The buffers ids recorded are translated to the ids of the replayed buffers.
+ * Failed commands are not replayed, and cleanup setups are replayed with no
+ * commands, so no registers are written when the device is closed.
+ * Buffers locked from a file are replayed on a memfd of the recorded range,
+ * and commands unknown to the replay are counted and reported as skipped.
+ *
+ * Usage: crono_replay [-d /dev/crono_xx] [-p pid] [-s scale] [trace file]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Cleanup command, as defined by the kernel module, needed by
+ * `CRONO_KERNEL_CMDS_INFO`.
+ */
+typedef struct {
+        uint32_t addr;
+        uint32_t data;
+} CRONO_KERNEL_CMD;
+
+#include "crono_linux_kernel.h"
+
+enum crono_replay_op {
+        OP_SG_LOCK,
+        OP_SG_UNLOCK,
+        OP_CONTIG_LOCK,
+        OP_CONTIG_UNLOCK,
+        OP_CLEANUP_SETUP,
+        OP_BUILD_SG_DESC_TABLE,
+        OP_SYNC_FOR_CPU,
+        OP_SYNC_FOR_DEVICE,
+        OP_ALLOC_CONTIG_BLOCK,
+        OP_MMAP_CONTIG,
+        OP_MMAP_SG_ADDR_TABLE,
+        OP_MMAP_BLOCK_ARENA,
+        OP_WAIT_TEARDOWN,
+        OP_SET_BUFFER_TPH,
+        OP_RING_SETUP,
+        OP_RING_PRODUCE,
+        OP_RING_CONSUME,
+        OP_FD_LOCK,
+        OP_MMAP_STATUS_PAGE,
+        OP_MMAP_RING,
+        OP_MMAP_RING_ADDR_TABLE,
+        OP_UNKNOWN,
+        OP_COUNT
+};
+static const char *op_names[OP_COUNT] = {
+    "sg_lock",          "sg_unlock",          "contig_lock",
+    "contig_unlock",    "cleanup_setup",      "build_sg_desc_table",
+    "sync_for_cpu",     "sync_for_device",    "alloc_contig_block",
+    "mmap_contig",      "mmap_sg_addr_table", "mmap_block_arena",
+    "wait_teardown",    "set_buffer_tph",     "ring_setup",
+    "ring_produce",     "ring_consume",       "fd_lock",
+    "mmap_status_page", "mmap_ring",          "mmap_ring_addr_table",
+    "unknown"};
+
+/**
+ * A recorded ioctl or mmap, parsed from the tracepoint text.
+ */
+struct crono_replay_event {
+        double timestamp; // Seconds
+        int is_mmap;
+        unsigned int cmd; // ioctl command, or mmap type
+        int id;
+        int id2;
+        uint64_t offset;
+        uint64_t size;
+        uint32_t flags;
+        uint32_t dir;
+        uint32_t attrs;
+        int ret;
+};
+
+/**
+ * Latency samples of one operation, in nanoseconds.
+ */
+struct crono_replay_samples {
+        uint64_t *ns;
+        size_t count;
+        size_t capacity;
+        size_t errors;
+        size_t skipped;
+};
+
+/**
+ * Recorded buffer id translated to the replayed buffer.
+ */
+struct crono_replay_buffer {
+        int recorded_id;
+        int id;
+        void *addr; // SG buffers memory, allocated by the replay
+        DMA_ADDR *pages;
+        struct crono_replay_buffer *next;
+};
+
+static struct crono_replay_samples samples[OP_COUNT];
+static struct crono_replay_buffer *sg_buffers = NULL;
+static struct crono_replay_buffer *contig_buffers = NULL;
+static int fd = -1;
+static long page_size;
+
+// _____________________________________________________________________________
+// Helpers
+//
+static uint64_t now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void samples_add(enum crono_replay_op op, uint64_t start_ns, int ret) {
+        struct crono_replay_samples *s = &samples[op];
+        uint64_t ns = now_ns() - start_ns;
+        uint64_t *grown;
+
+        if (ret) {
+                s->errors++;
+                return;
+        }
+        if (s->count == s->capacity) {
+                s->capacity = s->capacity ? s->capacity * 2 : 1024;
+                grown = realloc(s->ns, s->capacity * sizeof(uint64_t));
+                if (NULL == grown) {
+                        s->errors++;
+                        return;
+                }
+                s->ns = grown;
+        }
+        s->ns[s->count++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+        uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const struct crono_replay_samples *s, double p) {
+        if (0 == s->count)
+                return 0;
+        return s->ns[(size_t)(p * (s->count - 1) + 0.5)] / 1000.0;
+}
+
+static struct crono_replay_buffer *buffer_find(struct crono_replay_buffer *head,
+                                               int recorded_id) {
+        for (; head; head = head->next)
+                if (head->recorded_id == recorded_id)
+                        return head;
+        return NULL;
+}
+
+static void buffer_add(struct crono_replay_buffer **head,
+                       struct crono_replay_buffer *bw) {
+        bw->next = *head;
+        *head = bw;
+}
+
+static void buffer_remove(struct crono_replay_buffer **head,
+                          struct crono_replay_buffer *bw) {
+        for (; *head; head = &(*head)->next) {
+                if (*head == bw) {
+                        *head = bw->next;
+                        break;
+                }
+        }
+        free(bw->addr);
+        free(bw->pages);
+        free(bw);
+}
+
+// _____________________________________________________________________________
+// Parsing
+//
+/**
+ * Parse a tracepoint text line.
+ *
+ * @return 1 if the line is a crono ioctl or mmap event, 0 otherwise.
+ */
+static int parse_event(const char *line, struct crono_replay_event *ev,
+                       int *pid) {
+        const char *event, *p;
+        int is_mmap;
+
+        if ((event = strstr(line, ": crono_ioctl: ")))
+                is_mmap = 0;
+        else if ((event = strstr(line, ": crono_mmap: ")))
+                is_mmap = 1;
+        else
+                return 0;
+        memset(ev, 0, sizeof(*ev));
+        ev->is_mmap = is_mmap;
+        ev->id = ev->id2 = -1;
+
+        // `comm-pid [cpu] flags timestamp: event: fields`
+        for (p = event; p > line && ' ' != p[-1]; p--)
+                ;
+        ev->timestamp = strtod(p, NULL);
+        *pid = -1;
+        if ((p = strstr(line, " [")) && p < event) {
+                while (p > line && ' ' == p[-1])
+                        p--;
+                while (p > line && p[-1] >= '0' && p[-1] <= '9')
+                        p--;
+                if (p > line && '-' == p[-1])
+                        *pid = atoi(p);
+        }
+
+        event = strchr(event + 2, ':') + 2;
+        if (is_mmap)
+                return 4 == sscanf(event,
+                                   "minor=%*d type=%u id=%d size=%" SCNu64
+                                   " ret=%d",
+                                   &ev->cmd, &ev->id, &ev->size, &ev->ret);
+        return 9 == sscanf(event,
+                           "minor=%*d cmd=%x id=%d id2=%d offset=%" SCNu64
+                           " size=%" SCNu64 " flags=%x dir=%u attrs=%x ret=%d",
+                           &ev->cmd, &ev->id, &ev->id2, &ev->offset,
+                           &ev->size, &ev->flags, &ev->dir, &ev->attrs,
+                           &ev->ret);
+}
+
+// _____________________________________________________________________________
+// Replay
+//
+static void replay_sg_lock(const struct crono_replay_event *ev) {
+        CRONO_SG_BUFFER_LOCK_INFO info;
+        struct crono_replay_buffer *bw = calloc(1, sizeof(*bw));
+        uint64_t start;
+        int ret;
+
+        memset(&info, 0, sizeof(info));
+        info.buff_info.size = ev->size;
+        info.buff_info.pages_count = (ev->size + page_size - 1) / page_size;
+        if (NULL == bw || posix_memalign(&bw->addr, page_size, ev->size) ||
+            NULL == (bw->pages = calloc(info.buff_info.pages_count,
+                                        sizeof(DMA_ADDR)))) {
+                samples[OP_SG_LOCK].errors++;
+                if (bw) {
+                        free(bw->addr);
+                        free(bw);
+                }
+                return;
+        }
+        memset(bw->addr, 0, ev->size);
+        info.buff_info.addr = bw->addr;
+        info.buff_info.pages = bw->pages;
+        info.buff_info.upages = (DMA_ADDR)(uintptr_t)bw->pages;
+        info.flags = ev->flags;
+        info.dma_dir = ev->dir;
+        info.dma_attrs = ev->attrs;
+
+        start = now_ns();
+        ret = ioctl(fd,
+                    IOCTL_CRONO_LOCK_BUFFER == ev->cmd
+                        ? IOCTL_CRONO_LOCK_BUFFER
+                        : IOCTL_CRONO_LOCK_BUFFER_EX,
+                    &info);
+        samples_add(OP_SG_LOCK, start, ret);
+        bw->recorded_id = ev->id;
+        bw->id = info.buff_info.id;
+        buffer_add(&sg_buffers, bw);
+        if (ret)
+                buffer_remove(&sg_buffers, bw); // Frees the buffer memory
+}
+
+static void replay_fd_lock(const struct crono_replay_event *ev) {
+        CRONO_FD_BUFFER_LOCK_INFO info;
+        struct crono_replay_buffer *bw = calloc(1, sizeof(*bw));
+        uint64_t start;
+        int ret, memfd = -1;
+
+        // The recorded file isn't available, a memfd of the range is locked
+        memset(&info, 0, sizeof(info));
+        info.lock_info.buff_info.size = ev->size;
+        info.lock_info.buff_info.pages_count =
+            (ev->size + page_size - 1) / page_size;
+        if (NULL == bw ||
+            NULL == (bw->pages = calloc(info.lock_info.buff_info.pages_count,
+                                        sizeof(DMA_ADDR))) ||
+            (memfd = memfd_create("crono_replay", MFD_CLOEXEC)) < 0 ||
+            ftruncate(memfd, ev->offset + ev->size)) {
+                samples[OP_FD_LOCK].errors++;
+                if (memfd >= 0)
+                        close(memfd);
+                if (bw) {
+                        free(bw->pages);
+                        free(bw);
+                }
+                return;
+        }
+        info.lock_info.buff_info.pages = bw->pages;
+        info.lock_info.buff_info.upages = (DMA_ADDR)(uintptr_t)bw->pages;
+        info.lock_info.flags = ev->flags;
+        info.lock_info.dma_dir = ev->dir;
+        info.lock_info.dma_attrs = ev->attrs;
+        info.fd = memfd;
+        info.offset = ev->offset;
+
+        start = now_ns();
+        ret = ioctl(fd, IOCTL_CRONO_LOCK_FD_BUFFER, &info);
+        samples_add(OP_FD_LOCK, start, ret);
+        // The locked pages are kept pinned after the memfd is closed
+        close(memfd);
+        bw->recorded_id = ev->id;
+        bw->id = info.lock_info.buff_info.id;
+        buffer_add(&sg_buffers, bw);
+        if (ret)
+                buffer_remove(&sg_buffers, bw);
+}
+
+static void replay_unlock(const struct crono_replay_event *ev, int is_sg) {
+        struct crono_replay_buffer **head = is_sg ? &sg_buffers
+                                                  : &contig_buffers;
+        struct crono_replay_buffer *bw = buffer_find(*head, ev->id);
+        enum crono_replay_op op = is_sg ? OP_SG_UNLOCK : OP_CONTIG_UNLOCK;
+        uint64_t start;
+        int id;
+
+        if (NULL == bw) {
+                samples[op].skipped++;
+                return;
+        }
+        id = bw->id;
+        start = now_ns();
+        samples_add(op, start,
+                    ioctl(fd,
+                          is_sg ? IOCTL_CRONO_UNLOCK_BUFFER
+                                : IOCTL_CRONO_UNLOCK_CONTIG_BUFFER,
+                          &id));
+        buffer_remove(head, bw);
+}
+
+static void replay_contig_lock(const struct crono_replay_event *ev) {
+        CRONO_CONTIG_BUFFER_INFO info;
+        struct crono_replay_buffer *bw = calloc(1, sizeof(*bw));
+        uint64_t start;
+        int ret;
+
+        if (NULL == bw) {
+                samples[OP_CONTIG_LOCK].errors++;
+                return;
+        }
+        memset(&info, 0, sizeof(info));
+        info.size = ev->size;
+        start = now_ns();
+        ret = ioctl(fd, IOCTL_CRONO_LOCK_CONTIG_BUFFER, &info);
+        samples_add(OP_CONTIG_LOCK, start, ret);
+        if (ret) {
+                free(bw);
+                return;
+        }
+        bw->recorded_id = ev->id;
+        bw->id = info.id;
+        buffer_add(&contig_buffers, bw);
+}
+
+static void replay_alloc_contig_block(const struct crono_replay_event *ev) {
+        CRONO_CONTIG_BLOCK_INFO info;
+        struct crono_replay_buffer *bw = calloc(1, sizeof(*bw));
+        uint64_t start;
+        int ret;
+
+        if (NULL == bw) {
+                samples[OP_ALLOC_CONTIG_BLOCK].errors++;
+                return;
+        }
+        memset(&info, 0, sizeof(info));
+        info.size = ev->size;
+        info.alignment = ev->flags;
+        start = now_ns();
+        ret = ioctl(fd, IOCTL_CRONO_ALLOC_CONTIG_BLOCK, &info);
+        samples_add(OP_ALLOC_CONTIG_BLOCK, start, ret);
+        if (ret) {
+                free(bw);
+                return;
+        }
+        // Blocks are unlocked as contiguous buffers
+        bw->recorded_id = ev->id;
+        bw->id = info.id;
+        buffer_add(&contig_buffers, bw);
+}
+
+static void replay_build_sg_desc_table(const struct crono_replay_event *ev) {
+        CRONO_SG_DESC_TABLE_INFO info;
+        struct crono_replay_buffer *sg_bw = buffer_find(sg_buffers, ev->id);
+        struct crono_replay_buffer *bw;
+        uint64_t start;
+        int ret;
+
+        if (NULL == sg_bw || NULL == (bw = calloc(1, sizeof(*bw)))) {
+                samples[OP_BUILD_SG_DESC_TABLE].skipped++;
+                return;
+        }
+        memset(&info, 0, sizeof(info));
+        info.sg_id = sg_bw->id;
+        info.format = ev->flags;
+        start = now_ns();
+        ret = ioctl(fd, IOCTL_CRONO_BUILD_SG_DESC_TABLE, &info);
+        samples_add(OP_BUILD_SG_DESC_TABLE, start, ret);
+        if (ret) {
+                free(bw);
+                return;
+        }
+        // The table is a contiguous buffer, unlocked as such
+        bw->recorded_id = ev->id2;
+        bw->id = info.table.id;
+        buffer_add(&contig_buffers, bw);
+}
+
+static void replay_sync(const struct crono_replay_event *ev, int for_cpu) {
+        CRONO_SG_BUFFER_SYNC_INFO info;
+        struct crono_replay_buffer *bw = buffer_find(sg_buffers, ev->id);
+        enum crono_replay_op op = for_cpu ? OP_SYNC_FOR_CPU
+                                          : OP_SYNC_FOR_DEVICE;
+        uint64_t start;
+
+        if (NULL == bw) {
+                samples[op].skipped++;
+                return;
+        }
+        info.id = bw->id;
+        info.offset = ev->offset;
+        info.size = ev->size;
+        start = now_ns();
+        samples_add(op, start,
+                    ioctl(fd,
+                          for_cpu ? IOCTL_CRONO_SYNC_BUFFER_FOR_CPU
+                                  : IOCTL_CRONO_SYNC_BUFFER_FOR_DEVICE,
+                          &info));
+}
+
+static void replay_set_buffer_tph(const struct crono_replay_event *ev) {
+        CRONO_SG_BUFFER_TPH_INFO info;
+        struct crono_replay_buffer *bw = buffer_find(sg_buffers, ev->id);
+        uint64_t start;
+
+        if (NULL == bw) {
+                samples[OP_SET_BUFFER_TPH].skipped++;
+                return;
+        }
+        memset(&info, 0, sizeof(info));
+        info.id = bw->id;
+        info.cpu = ev->flags;
+        info.st_index = ev->id2;
+        start = now_ns();
+        samples_add(OP_SET_BUFFER_TPH, start,
+                    ioctl(fd, IOCTL_CRONO_SET_BUFFER_TPH, &info));
+}
+
+static void replay_ring_setup(const struct crono_replay_event *ev) {
+        CRONO_RING_SETUP_INFO info;
+        uint64_t start;
+
+        memset(&info, 0, sizeof(info));
+        info.pages_count = ev->size / page_size;
+        info.flags = ev->flags;
+        start = now_ns();
+        samples_add(OP_RING_SETUP, start,
+                    ioctl(fd, IOCTL_CRONO_RING_SETUP, &info));
+}
+
+static void replay_ring_move(const struct crono_replay_event *ev,
+                             int produce) {
+        CRONO_RING_POS pos;
+        uint64_t start;
+
+        memset(&pos, 0, sizeof(pos));
+        pos.bytes = ev->size;
+        start = now_ns();
+        samples_add(produce ? OP_RING_PRODUCE : OP_RING_CONSUME, start,
+                    ioctl(fd,
+                          produce ? IOCTL_CRONO_RING_PRODUCE
+                                  : IOCTL_CRONO_RING_CONSUME,
+                          &pos));
+}
+
+static void replay_wait_teardown(void) {
+        uint64_t start = now_ns();
+
+        samples_add(OP_WAIT_TEARDOWN, start,
+                    ioctl(fd, IOCTL_CRONO_WAIT_TEARDOWN));
+}
+
+static void replay_cleanup_setup(void) {
+        CRONO_KERNEL_CMDS_INFO info;
+        uint64_t start;
+
+        memset(&info, 0, sizeof(info));
+        start = now_ns();
+        samples_add(OP_CLEANUP_SETUP, start,
+                    ioctl(fd, IOCTL_CRONO_CLEANUP_SETUP, &info));
+}
+
+static void replay_mmap_block_arena(const struct crono_replay_event *ev) {
+        uint64_t start;
+        void *addr;
+
+        if (0 == ev->size) {
+                samples[OP_MMAP_BLOCK_ARENA].skipped++;
+                return;
+        }
+        start = now_ns();
+        addr = mmap(NULL, ev->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                    CRONO_MMAP_OFFSET(CRONO_MMAP_TYPE_BLOCK_ARENA, 0,
+                                      page_size));
+        samples_add(OP_MMAP_BLOCK_ARENA, start, MAP_FAILED == addr);
+        if (MAP_FAILED != addr)
+                munmap(addr, ev->size);
+}
+
+static void replay_mmap(const struct crono_replay_event *ev) {
+        int is_table = CRONO_MMAP_TYPE_SG_ADDR_TABLE == ev->cmd;
+        struct crono_replay_buffer *bw =
+            buffer_find(is_table ? sg_buffers : contig_buffers, ev->id);
+        enum crono_replay_op op = is_table ? OP_MMAP_SG_ADDR_TABLE
+                                           : OP_MMAP_CONTIG;
+        uint64_t start;
+        void *addr;
+
+        if (NULL == bw || 0 == ev->size) {
+                samples[op].skipped++;
+                return;
+        }
+        start = now_ns();
+        addr = mmap(NULL, ev->size,
+                    is_table ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, CRONO_MMAP_OFFSET(ev->cmd, bw->id, page_size));
+        samples_add(op, start, MAP_FAILED == addr);
+        if (MAP_FAILED != addr)
+                munmap(addr, ev->size);
+}
+
+/**
+ * Map a read-only mapping of the device, of `id` 0, as the status page and the
+ * ring.
+ */
+static void replay_mmap_dev(const struct crono_replay_event *ev,
+                            enum crono_replay_op op) {
+        uint64_t start;
+        void *addr;
+
+        if (0 == ev->size) {
+                samples[op].skipped++;
+                return;
+        }
+        start = now_ns();
+        addr = mmap(NULL, ev->size, PROT_READ, MAP_SHARED, fd,
+                    CRONO_MMAP_OFFSET(ev->cmd, 0, page_size));
+        samples_add(op, start, MAP_FAILED == addr);
+        if (MAP_FAILED != addr)
+                munmap(addr, ev->size);
+}
+
+static void replay_event(const struct crono_replay_event *ev) {
+        if (ev->is_mmap) {
+                switch (ev->cmd) {
+                case CRONO_MMAP_TYPE_BLOCK_ARENA:
+                        replay_mmap_block_arena(ev);
+                        break;
+                case CRONO_MMAP_TYPE_STATUS_PAGE:
+                        replay_mmap_dev(ev, OP_MMAP_STATUS_PAGE);
+                        break;
+                case CRONO_MMAP_TYPE_RING:
+                        replay_mmap_dev(ev, OP_MMAP_RING);
+                        break;
+                case CRONO_MMAP_TYPE_RING_ADDR_TABLE:
+                        replay_mmap_dev(ev, OP_MMAP_RING_ADDR_TABLE);
+                        break;
+                case CRONO_MMAP_TYPE_CONTIG:
+                case CRONO_MMAP_TYPE_SG_ADDR_TABLE:
+                        replay_mmap(ev);
+                        break;
+                default:
+                        samples[OP_UNKNOWN].skipped++;
+                        break;
+                }
+                return;
+        }
+        switch (ev->cmd) {
+        case IOCTL_CRONO_LOCK_BUFFER:
+        case IOCTL_CRONO_LOCK_BUFFER_EX:
+                replay_sg_lock(ev);
+                break;
+        case IOCTL_CRONO_UNLOCK_BUFFER:
+                replay_unlock(ev, 1);
+                break;
+        case IOCTL_CRONO_LOCK_CONTIG_BUFFER:
+                replay_contig_lock(ev);
+                break;
+        case IOCTL_CRONO_UNLOCK_CONTIG_BUFFER:
+                replay_unlock(ev, 0);
+                break;
+        case IOCTL_CRONO_CLEANUP_SETUP:
+                replay_cleanup_setup();
+                break;
+        case IOCTL_CRONO_BUILD_SG_DESC_TABLE:
+                replay_build_sg_desc_table(ev);
+                break;
+        case IOCTL_CRONO_SYNC_BUFFER_FOR_CPU:
+                replay_sync(ev, 1);
+                break;
+        case IOCTL_CRONO_SYNC_BUFFER_FOR_DEVICE:
+                replay_sync(ev, 0);
+                break;
+        case IOCTL_CRONO_ALLOC_CONTIG_BLOCK:
+                replay_alloc_contig_block(ev);
+                break;
+        case IOCTL_CRONO_WAIT_TEARDOWN:
+                replay_wait_teardown();
+                break;
+        case IOCTL_CRONO_SET_BUFFER_TPH:
+                replay_set_buffer_tph(ev);
+                break;
+        case IOCTL_CRONO_RING_SETUP:
+                replay_ring_setup(ev);
+                break;
+        case IOCTL_CRONO_RING_PRODUCE:
+                replay_ring_move(ev, 1);
+                break;
+        case IOCTL_CRONO_RING_CONSUME:
+                replay_ring_move(ev, 0);
+                break;
+        case IOCTL_CRONO_LOCK_FD_BUFFER:
+                replay_fd_lock(ev);
+                break;
+        case IOCTL_CRONO_GET_DEV_CAPS:
+                // Queries only, nothing to replay
+                break;
+        default:
+                samples[OP_UNKNOWN].skipped++;
+                break;
+        }
+}
+
+/**
+ * Sleep until the recorded time of the event, scaled, from the replay start.
+ */
+static void wait_event_time(double recorded_offset, double scale,
+                            uint64_t start_ns) {
+        uint64_t due_ns = start_ns + (uint64_t)(recorded_offset * scale * 1e9);
+        struct timespec ts;
+
+        ts.tv_sec = due_ns / 1000000000ULL;
+        ts.tv_nsec = due_ns % 1000000000ULL;
+        while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                                        NULL))
+                ;
+}
+
+static void usage(const char *prog) {
+        fprintf(stderr,
+                "Usage: %s [options] [trace file, default stdin]\n"
+                "  -d path   miscdev, default is the first /dev/crono_*\n"
+                "  -p pid    replay the events of the process only\n"
+                "  -s scale  recorded time scale, e.g. 2 replays twice "
+                "slower, default 0 is as fast as possible\n",
+                prog);
+}
+
+int main(int argc, char *argv[]) {
+        struct crono_replay_event ev;
+        const char *dev_path = NULL;
+        int opt, pid, filter_pid = -1, iop;
+        double scale = 0, first_timestamp = -1, last_timestamp = 0;
+        uint64_t start;
+        size_t replayed = 0;
+        char line[1024];
+        FILE *in = stdin;
+        glob_t devs;
+
+        page_size = sysconf(_SC_PAGESIZE);
+        while (-1 != (opt = getopt(argc, argv, "d:p:s:h"))) {
+                switch (opt) {
+                case 'd':
+                        dev_path = optarg;
+                        break;
+                case 'p':
+                        filter_pid = atoi(optarg);
+                        break;
+                case 's':
+                        scale = strtod(optarg, NULL);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+        if (optind < argc && NULL == (in = fopen(argv[optind], "r"))) {
+                fprintf(stderr, "Error %d opening <%s>\n", errno,
+                        argv[optind]);
+                return EXIT_FAILURE;
+        }
+
+        // Open the device
+        memset(&devs, 0, sizeof(devs));
+        if (NULL == dev_path) {
+                if (glob("/dev/crono_*", 0, NULL, &devs) ||
+                    0 == devs.gl_pathc) {
+                        fprintf(stderr, "No cronologic miscdev is found\n");
+                        return EXIT_FAILURE;
+                }
+                dev_path = devs.gl_pathv[0];
+        }
+        fd = open(dev_path, O_RDWR);
+        if (fd < 0) {
+                fprintf(stderr, "Error %d opening <%s>\n", errno, dev_path);
+                globfree(&devs);
+                return EXIT_FAILURE;
+        }
+
+        // Replay the events in the recorded order
+        start = now_ns();
+        while (fgets(line, sizeof(line), in)) {
+                if (!parse_event(line, &ev, &pid))
+                        continue;
+                if (filter_pid >= 0 && pid != filter_pid)
+                        continue;
+                if (first_timestamp < 0)
+                        first_timestamp = ev.timestamp;
+                last_timestamp = ev.timestamp;
+                if (ev.ret)
+                        continue; // Failed when recorded
+                if (scale > 0)
+                        wait_event_time(ev.timestamp - first_timestamp, scale,
+                                        start);
+                replay_event(&ev);
+                replayed++;
+        }
+        start = now_ns() - start;
+
+        // Unlock the buffers left locked by the recording
+        while (sg_buffers) {
+                ioctl(fd, IOCTL_CRONO_UNLOCK_BUFFER, &sg_buffers->id);
+                buffer_remove(&sg_buffers, sg_buffers);
+        }
+        while (contig_buffers) {
+                ioctl(fd, IOCTL_CRONO_UNLOCK_CONTIG_BUFFER,
+                      &contig_buffers->id);
+                buffer_remove(&contig_buffers, contig_buffers);
+        }
+        close(fd);
+        globfree(&devs);
+        if (stdin != in)
+                fclose(in);
+
+        // Report
+        for (iop = 0; iop < OP_COUNT; iop++) {
+                struct crono_replay_samples *s = &samples[iop];
+
+                if (0 == s->count && 0 == s->errors && 0 == s->skipped)
+                        continue;
+                qsort(s->ns, s->count, sizeof(uint64_t), cmp_u64);
+                printf("{\"op\":\"%s\",\"samples\":%zu,\"errors\":%zu,"
+                       "\"skipped\":%zu,\"p50_us\":%.3f,\"p99_us\":%.3f,"
+                       "\"max_us\":%.3f}\n",
+                       op_names[iop], s->count, s->errors, s->skipped,
+                       percentile_us(s, 0.50), percentile_us(s, 0.99),
+                       s->count ? s->ns[s->count - 1] / 1000.0 : 0);
+                free(s->ns);
+        }
+        printf("{\"replayed\":%zu,\"recorded_s\":%.6f,\"wall_s\":%.6f,"
+               "\"scale\":%.3f}\n",
+               replayed,
+               first_timestamp < 0 ? 0 : last_timestamp - first_timestamp,
+               start / 1e9, scale);
+        return EXIT_SUCCESS;
+}